@@ -83,6 +83,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    smf_internal_set_argv(argc,argv);
+
     settings = smf_settings_new();
     /* parse config file and fill settings struct */
     if (smf_settings_parse_config(&settings,config_file) != 0) {
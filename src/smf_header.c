@@ -19,6 +19,7 @@
 #include <cmime.h>
 
 #include "smf_header.h"
+#include "smf_message_private.h"
 
 #define THIS_MODULE "header"
 
@@ -37,6 +38,7 @@ void smf_header_set_name(SMFHeader_T *header, const char *name) {
     assert(header);
     assert(name);
 
+    smf_message_journal_add_header(header,HEADER_SET,name,NULL);
     cmime_header_set_name((CMimeHeader_T *)header,name);
 }
 
@@ -49,6 +51,8 @@ char *smf_header_get_name(SMFHeader_T *header) {
 void smf_header_set_value(SMFHeader_T *header, const char *value, int overwrite) {
     assert(header);
 
+    smf_message_journal_add_header(header,(overwrite != 0) ? HEADER_SET : HEADER_APPEND,
+        cmime_header_get_name((CMimeHeader_T *)header),value);
     cmime_header_set_value((CMimeHeader_T *)header,value,overwrite);
 }
 
@@ -24,15 +24,29 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/times.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
+#include "spmfilter_config.h"
 #include "smf_internal.h"
+#include "smf_core.h"
+#include "smf_message.h"
 #include "smf_trace.h"
 #include "smf_dict.h"
 #include "smf_session.h"
 #include "smf_lookup.h"
 
+static char **saved_argv = NULL;
+
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void smf_internal_string_list_destroy(void *data) {
     char *s = (char *)data;
     assert(data);
@@ -236,6 +250,100 @@ char *smf_internal_strip_email_addr(char *addr) {
     return out;
 }
 
+reply_table_t *smf_internal_reply_table_new(SMFDict_T *codes) {
+    reply_table_t *table = NULL;
+    char key[8];
+    char *msg = NULL;
+    int code;
+
+    if ((table = (reply_table_t *)calloc(1,sizeof(reply_table_t))) == NULL)
+        return NULL;
+
+    for (code = 200; code < REPLY_CODE_MAX; code++) {
+        snprintf(key,sizeof(key),"%d",code);
+        if ((codes != NULL) && ((msg = smf_dict_get(codes,key)) != NULL)) {
+            if (asprintf(&table->text[code],"%d %s\r\n",code,msg) == -1)
+                table->text[code] = NULL;
+        } else {
+            switch(code) {
+                case 221: table->text[code] = strdup(CODE_221); break;
+                case 250: table->text[code] = strdup(CODE_250); break;
+                case 451: table->text[code] = strdup(CODE_451); break;
+                case 502: table->text[code] = strdup(CODE_502); break;
+                case 552: table->text[code] = strdup(CODE_552); break;
+            }
+        }
+
+        if (table->text[code] != NULL)
+            table->len[code] = strlen(table->text[code]);
+    }
+
+    if (table->text[451] == NULL) {
+        smf_internal_reply_table_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+const char *smf_internal_reply_table_get(reply_table_t *table, int code, size_t *len) {
+    assert(table);
+
+    if ((code < 0) || (code >= REPLY_CODE_MAX) || (table->text[code] == NULL))
+        code = 451;
+
+    if (len != NULL)
+        *len = table->len[code];
+
+    return table->text[code];
+}
+
+void smf_internal_reply_table_free(reply_table_t *table) {
+    int code;
+
+    if (table == NULL)
+        return;
+
+    for (code = 0; code < REPLY_CODE_MAX; code++) {
+        if (table->text[code] != NULL)
+            free(table->text[code]);
+    }
+    free(table);
+}
+
+int smf_internal_parse_mail_params(char *value, unsigned long *size) {
+    char *p = NULL;
+    char *t = NULL;
+    char *endptr = NULL;
+
+    assert(value);
+    assert(size);
+
+    *size = 0;
+
+    /* the address ends with '>' or the first space */
+    if ((*value == '<') && ((p = strchr(value,'>')) != NULL))
+        p++;
+    else if ((p = strchr(value,' ')) == NULL)
+        return 0;
+
+    if (*p == '\0')
+        return 0;
+    *p++ = '\0';
+
+    while ((t = strsep(&p," ")) != NULL) {
+        if (strncasecmp(t,"SIZE=",5) == 0) {
+            t += 5;
+            errno = 0;
+            *size = strtoul(t,&endptr,10);
+            if ((*t < '0') || (*t > '9') || (*endptr != '\0') || (errno != 0))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
 ssize_t smf_internal_readn(int fd, void *buf, size_t nbyte) {
     size_t n;
     ssize_t br;
@@ -272,54 +380,140 @@ ssize_t smf_internal_writen(int fd, const void *buf, size_t nbyte) {
     return nbyte;
 }
 
-ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help) {
-    size_t n;
-    ssize_t br;
-    char c, *ptr = buf;
-    readline_t *rl = *help;
+void smf_internal_lookup_lock(void) {
+    pthread_mutex_lock(&lookup_lock);
+}
 
-    if (rl == NULL) {
-        if ((rl = malloc(sizeof(readline_t))) == NULL)
-            return -1;
+void smf_internal_lookup_unlock(void) {
+    pthread_mutex_unlock(&lookup_lock);
+}
 
-        rl->count = 0;
-        rl->current = rl->buf; 
-        *help = rl;
-    }   
+/* poll until fd is readable, fails with ETIMEDOUT once the earlier deadline passed */
+int smf_internal_wait_readable(int fd, time_t deadline, time_t line_deadline) {
+    struct pollfd pfd;
+    time_t now;
+    int ret;
 
-    for (n = 1; n < nbyte; n++) {
-        if ((br = smf_internal_readcbuf(fd,&c,rl)) < 0)
-            return -1;
+    if ((line_deadline != 0) && ((deadline == 0) || (line_deadline < deadline)))
+        deadline = line_deadline;
 
-        *ptr++ = c;
-        if ((br == 0) || ( c == '\n'))
+    if (deadline == 0)
+        return 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        if ((now = time(NULL)) >= deadline)
             break;
-    }
 
-    if ((br == 0) && (n == 1))
-        return 0;
+        if ((ret = poll(&pfd,1,(deadline - now) * 1000)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (ret > 0)
+            return 0;
+    }
 
-    *ptr = 0;
-    return n;
+    errno = ETIMEDOUT;
+    return -1;
 }
 
-ssize_t smf_internal_readcbuf(int fd, char *buf, readline_t *rl) {
-    while(rl->count < 1) {
-        if ((rl->count = read(fd, rl->buf, sizeof(rl->buf))) < 0) {
+/* buffer input until rl holds a complete line, the buffer is full or 
+ * EOF is reached. eol points to the line break, if one was found */
+static ssize_t smf_internal_readline_fill(int fd, readline_t *rl, char **eol) {
+    ssize_t br;
+    time_t line_deadline = 0;
+
+    for (;;) {
+        if ((rl->count > 0) && ((*eol = memchr(rl->current,'\n',rl->count)) != NULL))
+            return rl->count;
+
+        *eol = NULL;
+        if (rl->count == sizeof(rl->buf))
+            return rl->count;
+
+        /* move remaining input to the start of the buffer */
+        if (rl->current != rl->buf) {
+            if (rl->count > 0)
+                memmove(rl->buf,rl->current,rl->count);
+            rl->current = rl->buf;
+        }
+
+        /* the clock for a line starts with its first byte */
+        if ((rl->line_timeout > 0) && (rl->count > 0) && (line_deadline == 0))
+            line_deadline = time(NULL) + rl->line_timeout;
+
+        if (smf_internal_wait_readable(fd,rl->deadline,line_deadline) != 0)
+            return -1;
+
+        if ((br = read(fd,rl->buf + rl->count,sizeof(rl->buf) - rl->count)) < 0) {
             if (errno == EINTR)
-                rl->count = 0;
-            else
-                return -1;
-        } else if (rl->count == 0)
-            return 0;
+                continue;
+            return -1;
+        } else if (br == 0)
+            return rl->count;
 
-        rl->current = rl->buf;
+        rl->count += br;
     }
+}
 
-    *buf = *rl->current++;
-    rl->count--;
+void smf_internal_readline_init(readline_t *rl) {
+    assert(rl);
 
-    return 1;
+    rl->count = 0;
+    rl->current = rl->buf;
+    rl->deadline = 0;
+    rl->line_timeout = 0;
+}
+
+ssize_t smf_internal_readline_slice(int fd, readline_t *rl, char **line) {
+    ssize_t len;
+    char *eol = NULL;
+
+    assert(rl);
+    assert(line);
+
+    if ((len = smf_internal_readline_fill(fd,rl,&eol)) <= 0)
+        return len;
+
+    if (eol != NULL)
+        len = eol - rl->current + 1;
+
+    *line = rl->current;
+    rl->current += len;
+    rl->count -= len;
+
+    return len;
+}
+
+ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help) {
+    ssize_t len;
+    char *eol = NULL;
+    readline_t *rl = *help;
+
+    if (rl == NULL) {
+        if ((rl = malloc(sizeof(readline_t))) == NULL)
+            return -1;
+
+        smf_internal_readline_init(rl);
+        *help = rl;
+    }   
+
+    if ((len = smf_internal_readline_fill(fd,rl,&eol)) <= 0)
+        return len;
+
+    if (eol != NULL)
+        len = eol - rl->current + 1;
+    if (len > nbyte - 1)
+        len = nbyte - 1;
+
+    memcpy(buf,rl->current,len);
+    ((char *)buf)[len] = '\0';
+    rl->current += len;
+    rl->count -= len;
+
+    return len;
 }
 
 struct tms smf_internal_init_runtime_stats(void) {
@@ -414,3 +608,644 @@ char *smf_internal_generate_sid(void) {
     return sid;
 }
 
+/* names of the fields located by the header scanner, see HDR_* */
+static const struct {
+    const char *name;
+    size_t len;
+} header_scan_fields[HDR_TRACKED] = {
+    { "Message-ID", 10 },
+    { "Date", 4 },
+    { "From", 4 },
+    { "To", 2 }
+};
+
+void smf_internal_header_scan_init(header_scan_t *hs) {
+    int i;
+    assert(hs);
+
+    hs->in_header = 1;
+    hs->bol = 1;
+    hs->found_header = 0;
+    hs->field = HDR_NONE;
+    hs->offset = 0;
+    hs->nl = NULL;
+    hs->block = NULL;
+    hs->block_len = 0;
+    hs->block_size = 0;
+    hs->spooled = 0;
+    hs->synthesized = 0;
+    hs->queue_dir = NULL;
+    hs->mem_limit = 0;
+    hs->spool_size = 0;
+    hs->spool_fd = -1;
+    for (i = 0; i < HDR_TRACKED; i++)
+        hs->pos[i] = -1;
+}
+
+int smf_internal_header_scan(header_scan_t *hs, const char *line, size_t len) {
+    const unsigned char *p = (const unsigned char *)line;
+    long start = hs->offset;
+    int bol = hs->bol;
+    size_t i, name_len;
+    int f;
+
+    if (len == 0)
+        return hs->in_header;
+
+    hs->bol = (p[len - 1] == '\n');
+    hs->offset += len;
+
+    if (hs->nl == NULL) {
+        if (hs->bol == 1)
+            hs->nl = ((len > 1) && (p[len - 2] == '\r')) ? CRLF : LF;
+        else if (memchr(p,'\r',len) != NULL)
+            hs->nl = CR;
+    }
+
+    /* the rest of a long line has been classified already */
+    if ((hs->in_header == 0) || (bol == 0))
+        return hs->in_header;
+
+    /* empty line, end of the header block */
+    if ((p[0] == '\n') || (p[0] == '\r')) {
+        hs->in_header = 0;
+        hs->field = HDR_NONE;
+        return 0;
+    }
+
+    /* folded line, continues the previous field */
+    if ((p[0] == ' ') || (p[0] == '\t')) {
+        if (hs->field == HDR_NONE)
+            hs->in_header = 0;
+        return hs->in_header;
+    }
+
+    /* field name, printable characters except colon (RFC 5322, 2.2),
+     * followed by optional white space (obsolete syntax) and colon */
+    for (i = 0; (i < len) && (p[i] > 32) && (p[i] < 127) && (p[i] != ':'); i++);
+    name_len = i;
+    while ((i < len) && ((p[i] == ' ') || (p[i] == '\t'))) i++;
+
+    if ((name_len == 0) || (i == len) || (p[i] != ':')) {
+        /* no header field, the header block ends here */
+        hs->in_header = 0;
+        hs->field = HDR_NONE;
+        return 0;
+    }
+
+    hs->found_header = 1;
+    hs->field = HDR_OTHER;
+    for (f = 0; f < HDR_TRACKED; f++) {
+        if ((name_len == header_scan_fields[f].len) && 
+                (strncasecmp(line,header_scan_fields[f].name,name_len) == 0)) {
+            hs->field = f;
+            if (hs->pos[f] == -1)
+                hs->pos[f] = start;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/* builds the headers, which are missing in the scanned message */
+static char *smf_internal_missing_headers(SMFSession_T *session, header_scan_t *hs) {
+    char *nl = (hs->nl != NULL) ? hs->nl : CRLF;
+    char *out = strdup("");
+    char *t = NULL;
+    char date[BUFSIZE];
+    time_t currtime;
+
+    if (hs->pos[HDR_MESSAGE_ID] == -1) {
+        t = smf_message_generate_message_id();
+        smf_core_strcat_printf(&out,"Message-Id: %s%s",t,nl);
+        free(t);
+    }
+
+    if (hs->pos[HDR_DATE] == -1) {
+        time(&currtime);
+        strftime(date,BUFSIZE,"Date: %a, %d %b %Y %H:%M:%S %z (%Z)",localtime(&currtime));
+        smf_core_strcat_printf(&out,"%s%s",date,nl);
+    }
+
+    if (hs->pos[HDR_FROM] == -1)
+        smf_core_strcat_printf(&out,"From: %s%s",session->envelope->sender,nl);
+
+    if (hs->pos[HDR_TO] == -1)
+        smf_core_strcat_printf(&out,"To: undisclosed-recipients:;%s",nl);
+
+    /* the message has no header at all, separate it from the new ones */
+    if (hs->found_header == 0)
+        smf_core_strcat_printf(&out,"%s",nl);
+
+    return out;
+}
+
+static int smf_internal_headers_missing(header_scan_t *hs) {
+    return ((hs->pos[HDR_MESSAGE_ID] == -1) || (hs->pos[HDR_DATE] == -1) || 
+            (hs->pos[HDR_FROM] == -1) || (hs->pos[HDR_TO] == -1));
+}
+
+/* move an in-memory spool into queue_dir. The stream keeps its position,
+ * because its descriptor is replaced by the one of the new file */
+static int smf_internal_spool_spill(SMFSession_T *session, FILE *fp, header_scan_t *hs) {
+    char buf[BUFSIZE * 8];
+    char *path = NULL;
+    off_t off = 0;
+    ssize_t br;
+    int fd;
+
+    if (fflush(fp) != 0)
+        return -1;
+
+    if (smf_core_gen_queue_file(hs->queue_dir,&path,session->id) != 0)
+        return -1;
+
+    if ((fd = open(path,O_WRONLY)) == -1) {
+        remove(path);
+        free(path);
+        return -1;
+    }
+
+    while ((br = pread(hs->spool_fd,buf,sizeof(buf),off)) > 0) {
+        if (smf_internal_writen(fd,buf,br) != br) {
+            br = -1;
+            break;
+        }
+        off += br;
+    }
+
+    if ((br < 0) || (dup2(fd,fileno(fp)) == -1)) {
+        close(fd);
+        remove(path);
+        free(path);
+        return -1;
+    }
+
+    STRACE(TRACE_DEBUG,session->id,"message exceeds memory spool limit, using spool file: '%s'",path);
+    close(fd);
+    close(hs->spool_fd);
+    hs->spool_fd = -1;
+    free(session->message_file);
+    session->message_file = path;
+
+    return 0;
+}
+
+static int smf_internal_spool_write(SMFSession_T *session, FILE *fp, header_scan_t *hs, const char *buf, size_t len) {
+    if (fwrite(buf,sizeof(char),len,fp) != len)
+        return -1;
+
+    hs->spool_size += len;
+    if ((hs->spool_fd != -1) && (hs->spool_size > hs->mem_limit))
+        return smf_internal_spool_spill(session,fp,hs);
+
+    return 0;
+}
+
+/* write the buffered header block, preceded by the missing headers if synthesize is set */
+static int smf_internal_spool_header(SMFSession_T *session, FILE *fp, header_scan_t *hs, int synthesize) {
+    char *t = NULL;
+    int ret = 0;
+
+    if ((synthesize == 1) && (smf_internal_headers_missing(hs) == 1)) {
+        t = smf_internal_missing_headers(session,hs);
+        ret = smf_internal_spool_write(session,fp,hs,t,strlen(t));
+        free(t);
+        hs->synthesized = 1;
+    }
+
+    if ((ret == 0) && (hs->block_len > 0))
+        ret = smf_internal_spool_write(session,fp,hs,hs->block,hs->block_len);
+
+    free(hs->block);
+    hs->block = NULL;
+    hs->block_len = hs->block_size = 0;
+    hs->spooled = 1;
+
+    if (ret != 0)
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+
+    return ret;
+}
+
+FILE *smf_internal_spool_open(SMFSession_T *session, header_scan_t *hs, const char *queue_dir, unsigned long mem_limit) {
+    char *path = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+
+    hs->queue_dir = queue_dir;
+    hs->mem_limit = mem_limit;
+    hs->spool_size = 0;
+    hs->spool_fd = -1;
+
+#ifdef HAVE_MEMFD
+    /* the memfd stays open, until smf_internal_spool_remove() is called. Modules
+     * and external programs open it through its path below /proc */
+    if ((mem_limit > 0) && ((fd = memfd_create(session->id,MFD_CLOEXEC)) != -1)) {
+        if (asprintf(&path,"/proc/%d/fd/%d",getpid(),fd) == -1) {
+            close(fd);
+            fd = -1;
+        } else if ((fp = fdopen(dup(fd),"w")) == NULL) {
+            close(fd);
+            fd = -1;
+            free(path);
+        } else {
+            hs->spool_fd = fd;
+        }
+    }
+#endif
+
+    if (fd == -1) {
+        if (smf_core_gen_queue_file(queue_dir,&path,session->id) != 0)
+            return NULL;
+
+        if ((fp = fopen(path,"w")) == NULL) {
+            remove(path);
+            free(path);
+            return NULL;
+        }
+    }
+
+    if (session->message_file != NULL)
+        free(session->message_file);
+    session->message_file = path;
+
+    return fp;
+}
+
+/* returns the memfd of an in-memory spool or -1 */
+static int smf_internal_spool_memfd(SMFSession_T *session) {
+    char prefix[32];
+    size_t len;
+
+    len = snprintf(prefix,sizeof(prefix),"/proc/%d/fd/",getpid());
+    if ((session->message_file != NULL) && (strncmp(session->message_file,prefix,len) == 0))
+        return atoi(session->message_file + len);
+
+    return -1;
+}
+
+/* forget the flushed header block, it doesn't belong to the spooled message any longer */
+static void smf_internal_spool_drop_header(SMFSession_T *session) {
+    if (session->header_file == NULL)
+        return;
+
+    if (unlink(session->header_file) != 0)
+        STRACE(TRACE_ERR,session->id,"failed to remove header file: %s (%d)",strerror(errno),errno);
+
+    free(session->header_file);
+    session->header_file = NULL;
+    session->body_offset = 0;
+}
+
+int smf_internal_spool_remove(SMFSession_T *session) {
+    int fd;
+
+    smf_internal_spool_drop_header(session);
+
+    if (session->message_file == NULL)
+        return 0;
+
+    if ((fd = smf_internal_spool_memfd(session)) != -1)
+        return close(fd);
+
+    return remove(session->message_file);
+}
+
+int smf_internal_spool_replace(SMFSession_T *session, const char *path) {
+    int fd;
+
+    smf_internal_spool_drop_header(session);
+
+    if ((fd = smf_internal_spool_memfd(session)) != -1) {
+        /* the message leaves memory, from now on it lives in path */
+        close(fd);
+        free(session->message_file);
+        session->message_file = strdup(path);
+        return 0;
+    }
+
+    if (unlink(session->message_file)!=0) {
+        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    if (rename(path,session->message_file)!=0) {
+        STRACE(TRACE_ERR,session->id,"failed to rename queue file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* writes the header fields of message and the empty line, which separates 
+ * them from the body. A message loaded with its body would be written as 
+ * a whole otherwise */
+static int smf_internal_write_header_block(SMFMessage_T *message, int fd, const char *nl) {
+    SMFListElem_T *elem = NULL;
+    char *out = strdup("");
+    char *t = NULL;
+    int ret;
+
+    elem = smf_list_head(smf_message_get_headers(message));
+    while(elem != NULL) {
+        t = smf_header_to_string((SMFHeader_T *)smf_list_data(elem));
+        smf_core_strcat_printf(&out,"%s%s",t,nl);
+        free(t);
+        elem = elem->next;
+    }
+    smf_core_strcat_printf(&out,"%s",nl);
+
+    ret = (smf_internal_writen(fd,out,strlen(out)) == (ssize_t)strlen(out)) ? 0 : -1;
+    free(out);
+
+    return ret;
+}
+
+int smf_internal_spool_flush_header(SMFSession_T *session, const char *queue_dir, SMFMessage_T *message) {
+    char tmpname[PATH_MAX];
+    char *line = NULL;
+    char *nl = CRLF;
+    char buf[2];
+    size_t len = 0;
+    ssize_t nbytes;
+    off_t offset = -1;
+    FILE *fp = NULL;
+    int fd;
+
+    /* the body of message_file never changes here, so its
+     * start has to be looked up on the first flush only */
+    if (session->header_file == NULL) {
+        if ((fp = fopen(session->message_file, "r")) == NULL) {
+            STRACE(TRACE_ERR,session->id,"unable to open queue file: %s (%d)",strerror(errno), errno);
+            return -1;
+        }
+
+        while ((nbytes = getline(&line,&len,fp)) != -1) {
+            if ((strcmp(line, LF) == 0) || (strcmp(line, CRLF) == 0)) {
+                offset = ftello(fp);
+                break;
+            }
+        }
+        free(line);
+
+        if (ferror(fp)) {
+            STRACE(TRACE_ERR,session->id,"failed to read queue file: %s (%d)",strerror(errno),errno);
+            fclose(fp);
+            return -1;
+        }
+
+        /* message without body */
+        if (offset == -1)
+            offset = ftello(fp);
+        fclose(fp);
+    } else {
+        offset = session->body_offset;
+    }
+
+    /* keep the line break of the spooled message, the line before the body ends with it */
+    if ((offset >= 2) && ((fd = open(session->message_file, O_RDONLY)) != -1)) {
+        if ((pread(fd,buf,2,offset - 2) == 2) && (buf[1] == '\n') && (buf[0] != '\r'))
+            nl = LF;
+        close(fd);
+    }
+
+    snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", queue_dir);
+    if ((fd = mkstemp(tmpname)) == -1) {
+        STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    if (smf_internal_write_header_block(message, fd, nl) != 0) {
+        STRACE(TRACE_ERR,session->id,"unable to write temporary file [%s]: %s",tmpname, strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    close(fd);
+
+    if (session->header_file != NULL) {
+        if (rename(tmpname,session->header_file) != 0) {
+            STRACE(TRACE_ERR,session->id,"failed to rename header file: %s (%d)",strerror(errno),errno);
+            unlink(tmpname);
+            return -1;
+        }
+    } else {
+        session->header_file = strdup(tmpname);
+        session->body_offset = offset;
+    }
+
+    return 0;
+}
+
+/* fopencookie() stream over the flushed header block and the body of the spooled message */
+typedef struct {
+    FILE *header;
+    FILE *body;
+} spool_stream_t;
+
+static ssize_t smf_internal_spool_stream_read(void *cookie, char *buf, size_t size) {
+    spool_stream_t *st = (spool_stream_t *)cookie;
+    size_t n;
+
+    if (st->header != NULL) {
+        if ((n = fread(buf,sizeof(char),size,st->header)) > 0)
+            return n;
+        if (ferror(st->header))
+            return -1;
+        fclose(st->header);
+        st->header = NULL;
+    }
+
+    n = fread(buf,sizeof(char),size,st->body);
+    return ferror(st->body) ? -1 : (ssize_t)n;
+}
+
+static int smf_internal_spool_stream_close(void *cookie) {
+    spool_stream_t *st = (spool_stream_t *)cookie;
+
+    if (st->header != NULL)
+        fclose(st->header);
+    fclose(st->body);
+    free(st);
+
+    return 0;
+}
+
+FILE *smf_internal_spool_fopen(SMFSession_T *session) {
+    cookie_io_functions_t io = {
+        .read = smf_internal_spool_stream_read,
+        .write = NULL,
+        .seek = NULL,
+        .close = smf_internal_spool_stream_close
+    };
+    spool_stream_t *st = NULL;
+    FILE *fp = NULL;
+
+    if (session->header_file == NULL)
+        return fopen(session->message_file, "r");
+
+    if ((st = calloc(1,sizeof(spool_stream_t))) == NULL)
+        return NULL;
+
+    if ((st->header = fopen(session->header_file, "r")) == NULL) {
+        free(st);
+        return NULL;
+    }
+
+    if (((st->body = fopen(session->message_file, "r")) == NULL) ||
+            (fseeko(st->body,session->body_offset,SEEK_SET) != 0) ||
+            ((fp = fopencookie(st,"r",io)) == NULL)) {
+        if (st->body != NULL)
+            fclose(st->body);
+        fclose(st->header);
+        free(st);
+        return NULL;
+    }
+
+    return fp;
+}
+
+int smf_internal_spool_line(SMFSession_T *session, FILE *fp, header_scan_t *hs, const char *line, size_t len) {
+    char *t = NULL;
+    size_t size;
+
+    if ((hs->in_header == 1) && (hs->spooled == 0)) {
+        if (smf_internal_header_scan(hs,line,len) == 0) {
+            /* end of the header block, now we know which headers are missing */
+            if (smf_internal_spool_header(session,fp,hs,1) != 0)
+                return -1;
+        } else if (hs->block_len + len <= HEADER_BLOCK_MAX) {
+            if (hs->block_len + len > hs->block_size) {
+                size = (hs->block_size == 0) ? BUFSIZE * 4 : hs->block_size;
+                while (size < hs->block_len + len)
+                    size *= 2;
+                if ((t = realloc(hs->block,size)) == NULL) {
+                    STRACE(TRACE_ERR,session->id,"failed to allocate header buffer");
+                    return -1;
+                }
+                hs->block = t;
+                hs->block_size = size;
+            }
+            memcpy(hs->block + hs->block_len,line,len);
+            hs->block_len += len;
+            return 0;
+        } else {
+            /* oversized header block, spool it as is and let
+             * smf_internal_append_missing_headers() do the work,
+             * which needs a spool file in queue_dir */
+            if (smf_internal_spool_header(session,fp,hs,0) != 0)
+                return -1;
+            if ((hs->spool_fd != -1) && (smf_internal_spool_spill(session,fp,hs) != 0)) {
+                STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+                return -1;
+            }
+        }
+    } else if (hs->in_header == 1) {
+        smf_internal_header_scan(hs,line,len);
+    }
+
+    if (smf_internal_spool_write(session,fp,hs,line,len) != 0) {
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int smf_internal_spool_finish(SMFSession_T *session, FILE *fp, header_scan_t *hs) {
+    /* message without body */
+    if (hs->spooled == 0)
+        return smf_internal_spool_header(session,fp,hs,1);
+
+    return 0;
+}
+
+void smf_internal_header_scan_free(header_scan_t *hs) {
+    if (hs->block != NULL)
+        free(hs->block);
+    hs->block = NULL;
+    hs->block_len = hs->block_size = 0;
+}
+
+int smf_internal_append_missing_headers(SMFSession_T *session, char *queue_dir, header_scan_t *hs) {
+    int fd;
+    FILE *new = NULL;
+    FILE *old = NULL;
+    char tmpname[PATH_MAX];
+    size_t len;
+    char buf[BUFSIZE];
+    char *t = NULL;
+
+    if ((hs->synthesized == 1) || (smf_internal_headers_missing(hs) == 0))
+        return 0;
+
+    snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", queue_dir);
+    if ((fd = mkstemp(tmpname)) == -1) {
+        STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+    
+    close(fd);
+    
+    if((new = fopen(tmpname, "w"))==NULL) {
+        STRACE(TRACE_ERR,session->id,"unable to open temporary file: %s (%d)",strerror(errno), errno);
+        return -1;
+    }
+
+    t = smf_internal_missing_headers(session,hs);
+    if (fputs(t,new) < 0) {
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        free(t);
+        fclose(new);
+        return -1;
+    }
+    free(t);
+
+    if((old = fopen(session->message_file, "r"))==NULL) {
+        STRACE(TRACE_ERR,session->id,"unable to open queue file: %s (%d)",strerror(errno), errno);
+        fclose(new);
+        return -1;
+    }
+
+    while((len = fread(&buf,sizeof(char),BUFSIZE,old)) > 0) {
+        if (fwrite(buf,sizeof(char),len,new) != len) {
+            STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+            fclose(old);
+            fclose(new);
+            return -1;
+        }
+    }
+    if (ferror(old)) {
+        STRACE(TRACE_ERR,session->id,"failed to read queue file: %s (%d)",strerror(errno),errno);
+        fclose(old);
+        fclose(new);
+        return -1;
+    }
+    fclose(old); 
+    fclose(new);
+
+    return smf_internal_spool_replace(session,tmpname);
+}
+
+void smf_internal_set_argv(int argc, char **argv) {
+    char path[PATH_MAX];
+    int i;
+
+    if ((saved_argv = (char **)calloc(argc + 1, sizeof(char *))) == NULL)
+        return;
+
+    for (i = 0; i < argc; i++)
+        saved_argv[i] = strdup(argv[i]);
+
+    /* the daemon changes its working directory */
+    if ((argc > 0) && (strchr(argv[0],'/') != NULL) && (realpath(argv[0],path) != NULL)) {
+        free(saved_argv[0]);
+        saved_argv[0] = strdup(path);
+    }
+}
+
+char **smf_internal_get_argv(void) {
+    return saved_argv;
+}
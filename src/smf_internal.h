@@ -27,7 +27,9 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
 
 #include "smf_settings.h"
@@ -35,17 +37,65 @@ extern "C" {
 
 #define MAXLINE 1024
 #define BUFSIZE 1024
+#define READLINE_BUFSIZE 16384
+#define HEADER_BLOCK_MAX 65536
 
 #define CRLF "\r\n"
 #define LF "\n"
 #define CR "\r"
 
+/* default smtp replies, if smtp_codes has no text for the code */
+#define CODE_221 "221 Goodbye. Please recommend us to others!\r\n"
+#define CODE_250 "250 OK\r\n"
+#define CODE_250_ACCEPTED "250 OK message accepted\r\n"
+#define CODE_451 "451 Requested action aborted: local error in processing\r\n"
+#define CODE_502 "502 Command not implemented\r\n"
+#define CODE_552 "552 Requested action aborted: local error in processing\r\n"
+
+#define REPLY_CODE_MAX 600
+
 typedef struct {
-    int count;
-    char *current;
-    char buf[BUFSIZE];
+    size_t count; /**< bytes of unprocessed input */
+    char *current; /**< start of unprocessed input */
+    time_t deadline; /**< reading fails with ETIMEDOUT after this time, 0 for none */
+    int line_timeout; /**< seconds a started line may take to complete, 0 for none */
+    char buf[READLINE_BUFSIZE];
 } readline_t;
 
+/* header fields, located by the header scanner */
+#define HDR_NONE -1
+#define HDR_MESSAGE_ID 0
+#define HDR_DATE 1
+#define HDR_FROM 2
+#define HDR_TO 3
+#define HDR_TRACKED 4 /* number of located fields */
+#define HDR_OTHER 4
+
+typedef struct {
+    int in_header; /**< still inside the header block */
+    int bol; /**< next input starts a new line */
+    int found_header; /**< message contains at least one header field */
+    int field; /**< field of the last header line, continued by folded lines, see HDR_* */
+    long offset; /**< bytes scanned so far */
+    long pos[HDR_TRACKED]; /**< message offset of each located field, -1 if missing */
+    char *nl; /**< line break used by the message */
+    char *block; /**< header block, buffered by smf_internal_spool_line() */
+    size_t block_len;
+    size_t block_size;
+    int spooled; /**< header block has been written to the spool file */
+    int synthesized; /**< missing headers have been written in front of it */
+    const char *queue_dir; /**< spool directory, see smf_internal_spool_open() */
+    unsigned long mem_limit; /**< size limit of an in-memory spool */
+    unsigned long spool_size; /**< bytes written to the spool */
+    int spool_fd; /**< memfd of an in-memory spool, -1 if spooled to queue_dir */
+} header_scan_t;
+
+/* complete smtp reply lines, indexed by code */
+typedef struct {
+    char *text[REPLY_CODE_MAX];
+    size_t len[REPLY_CODE_MAX];
+} reply_table_t;
+
 void smf_internal_string_list_destroy(void *data);
 void smf_internal_dict_list_destroy(void *data);
 void smf_internal_user_data_list_destroy(void *data);
@@ -55,10 +105,41 @@ char *smf_internal_build_module_path(const char *libdir, const char *modname);
  * returns a newlly allocated pointer */
 char *smf_internal_strip_email_addr(char *addr);
 
+/* builds the reply table from the smtp_codes setting, once at startup.
+ * smf_internal_reply_table_get() doesn't allocate anything and falls
+ * back to the 451 reply for unknown codes */
+reply_table_t *smf_internal_reply_table_new(SMFDict_T *codes);
+const char *smf_internal_reply_table_get(reply_table_t *table, int code, size_t *len);
+void smf_internal_reply_table_free(reply_table_t *table);
+
+/* cuts ESMTP parameters off the value of a MAIL FROM command,
+ * size is set to the SIZE parameter (RFC 1870) or 0, if there is none.
+ * Returns -1 if a parameter is invalid */
+int smf_internal_parse_mail_params(char *value, unsigned long *size);
+
 ssize_t smf_internal_readn(int fd, void *buf, size_t nbyte);
 ssize_t smf_internal_writen(int fd, const void *buf, size_t nbyte);
 ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help);
-ssize_t smf_internal_readcbuf(int fd, char *buf, readline_t *rl);
+
+/* serializes sql and ldap lookups, all threads of a process share 
+ * settings->lookup_connection */
+void smf_internal_lookup_lock(void);
+void smf_internal_lookup_unlock(void);
+
+/* waits until fd is readable. Returns -1 and sets errno to ETIMEDOUT,
+ * if the earliest of both deadlines passes first, 0 means no deadline */
+int smf_internal_wait_readable(int fd, time_t deadline, time_t line_deadline);
+
+/* buffered line reader, rl has to be initialized with
+ * smf_internal_readline_init() before the first call. Reading is
+ * limited by rl->deadline and rl->line_timeout, if they are set */
+void smf_internal_readline_init(readline_t *rl);
+
+/* points line to the next line in the read buffer and returns its length,
+ * including the line break. The line is not NUL terminated and only valid
+ * until the next call. Lines longer than READLINE_BUFSIZE are returned in
+ * pieces. Returns 0 on EOF and -1 on error or timeout. */
+ssize_t smf_internal_readline_slice(int fd, readline_t *rl, char **line);
 
 struct tms smf_internal_init_runtime_stats(void);
 void smf_internal_print_runtime_stats(struct tms start_acct, const char *sid);
@@ -66,6 +147,49 @@ char *smf_internal_determine_linebreak(const char *s);
 int smf_internal_fetch_user_data(SMFSettings_T *settings, SMFSession_T *session);
 char *smf_internal_generate_sid(void);
 
+/* single pass header scanner for messages, which are received line by line.
+ * smf_internal_header_scan() takes a line or a piece of a long line, which
+ * needs not to be NUL terminated, and returns 1 while the header block lasts */
+void smf_internal_header_scan_init(header_scan_t *hs);
+int smf_internal_header_scan(header_scan_t *hs, const char *line, size_t len);
+void smf_internal_header_scan_free(header_scan_t *hs);
+
+/* creates the spool for a received message and sets session->message_file.
+ * Messages are kept in memory (memfd) until they exceed mem_limit bytes,
+ * then they are moved to a file in queue_dir. With mem_limit 0 the message
+ * is spooled to queue_dir right away. The message_file of an in-memory
+ * spool is a path below /proc, so it can only be removed with 
+ * smf_internal_spool_remove() */
+FILE *smf_internal_spool_open(SMFSession_T *session, header_scan_t *hs, const char *queue_dir, unsigned long mem_limit);
+int smf_internal_spool_remove(SMFSession_T *session);
+
+/* replaces the spooled message of the session by the file at path */
+int smf_internal_spool_replace(SMFSession_T *session, const char *path);
+
+/* writes the header block of message to session->header_file. The spooled
+ * message itself is left alone, session->body_offset points to its body.
+ * smf_internal_spool_fopen() returns the complete message for reading,
+ * smf_internal_spool_remove() and smf_internal_spool_replace() remove the
+ * header file as well */
+int smf_internal_spool_flush_header(SMFSession_T *session, const char *queue_dir, SMFMessage_T *message);
+FILE *smf_internal_spool_fopen(SMFSession_T *session);
+
+/* writes a received message line to the spool file. The header block is held
+ * back until its end, so missing headers are written in front of it without
+ * copying the spool file afterwards. smf_internal_spool_finish() has to be
+ * called after the last line. Both return -1 if writing fails */
+int smf_internal_spool_line(SMFSession_T *session, FILE *fp, header_scan_t *hs, const char *line, size_t len);
+int smf_internal_spool_finish(SMFSession_T *session, FILE *fp, header_scan_t *hs);
+
+/* prepends Message-Id, Date, From and To headers, which are missing in the
+ * spooled message of the given session and were not added while spooling */
+int smf_internal_append_missing_headers(SMFSession_T *session, char *queue_dir, header_scan_t *hs);
+
+/* saves the command line, so a running daemon is able to 
+ * execute itself again. argv[0] is resolved to an absolute path */
+void smf_internal_set_argv(int argc, char **argv);
+char **smf_internal_get_argv(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -236,7 +236,7 @@ LDAP *smf_lookup_ldap_get_connection(SMFSettings_T *settings) {
 }
 
 
-SMFList_T *smf_lookup_ldap_query(SMFSettings_T *settings, SMFSession_T *session, const char *query) {
+static SMFList_T *_smf_lookup_ldap_query(SMFSettings_T *settings, SMFSession_T *session, const char *query) {
     int i,value_count;
 
     LDAP *c = NULL;
@@ -336,3 +336,14 @@ SMFList_T *smf_lookup_ldap_query(SMFSettings_T *settings, SMFSession_T *session,
     return result;   
 }
 
+SMFList_T *smf_lookup_ldap_query(SMFSettings_T *settings, SMFSession_T *session, const char *query) {
+    SMFList_T *result;
+
+    /* filter threads share the connection of the process */
+    smf_internal_lookup_lock();
+    result = _smf_lookup_ldap_query(settings,session,query);
+    smf_internal_lookup_unlock();
+
+    return result;
+}
+
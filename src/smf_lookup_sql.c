@@ -273,25 +273,13 @@ Connection_T smf_lookup_sql_get_connection(ConnectionPool_T pool) {
     return c;
 }
 
-SMFList_T *smf_lookup_sql_query(SMFSettings_T *settings, SMFSession_T *session, const char *q, ...) {  
+static SMFList_T *_smf_lookup_sql_query(SMFSettings_T *settings, SMFSession_T *session, const char *query) {
     SMFSQLConnection_T *con;
     Connection_T c; 
     ResultSet_T r;
     SMFList_T *result;
-    va_list ap;
-    char *query;
     int i;
 
-    va_start(ap, q);
-    if(vasprintf(&query,q,ap) == -1) {
-        TRACE(TRACE_ERR, "failed to allocate memory");
-        return NULL;
-    }
-    va_end(ap);
-    smf_core_strstrip(query);
-
-    if (strlen(query) == 0) return NULL;
-
     /* active connection? */
     if (settings->lookup_connection == NULL)
         if(smf_lookup_sql_connect(settings) != 0) return NULL;
@@ -332,7 +320,6 @@ SMFList_T *smf_lookup_sql_query(SMFSettings_T *settings, SMFSession_T *session,
         STRACE(TRACE_LOOKUP,session->id,"query [%s] returned [%d] rows", query, result->size);
     }
 
-    free(query);
     smf_lookup_sql_con_close(c);
 
     /* if not persistent, close connection */
@@ -342,3 +329,30 @@ SMFList_T *smf_lookup_sql_query(SMFSettings_T *settings, SMFSession_T *session,
     return result;
 }
 
+SMFList_T *smf_lookup_sql_query(SMFSettings_T *settings, SMFSession_T *session, const char *q, ...) {  
+    SMFList_T *result;
+    va_list ap;
+    char *query;
+
+    va_start(ap, q);
+    if(vasprintf(&query,q,ap) == -1) {
+        TRACE(TRACE_ERR, "failed to allocate memory");
+        return NULL;
+    }
+    va_end(ap);
+    smf_core_strstrip(query);
+
+    if (strlen(query) == 0) {
+        free(query);
+        return NULL;
+    }
+
+    /* filter threads share the connection of the process */
+    smf_internal_lookup_lock();
+    result = _smf_lookup_sql_query(settings,session,query);
+    smf_internal_lookup_unlock();
+    free(query);
+
+    return result;
+}
+
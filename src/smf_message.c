@@ -24,12 +24,97 @@
 #include "smf_header.h"
 #include "smf_internal.h"
 #include "smf_message.h"
+#include "smf_message_private.h"
 #include "smf_part.h"
 #include "smf_trace.h"
 
 
 #define THIS_MODULE "message"
 
+/* header changes of the message, which is processed by the modules
+ * of the calling thread */
+static __thread SMFMessage_T *journal_message = NULL;
+static __thread SMFList_T *journal = NULL;
+
+static void _journal_entry_destroy(void *data) {
+    SMFHeaderModification_T *mod = (SMFHeaderModification_T *)data;
+
+    free(mod->name);
+    free(mod->value);
+    free(mod);
+}
+
+void smf_message_journal_start(SMFMessage_T *message) {
+    smf_message_journal_stop();
+    journal_message = message;
+}
+
+void smf_message_journal_stop(void) {
+    if (journal != NULL)
+        smf_list_free(journal);
+
+    journal = NULL;
+    journal_message = NULL;
+}
+
+void smf_message_journal_replace(SMFMessage_T *old, SMFMessage_T *message) {
+    if ((old != NULL) && (journal_message == old))
+        smf_message_journal_start(message);
+}
+
+SMFList_T *smf_message_journal_get(SMFMessage_T *message) {
+    if ((message == NULL) || (message != journal_message))
+        return NULL;
+
+    return journal;
+}
+
+void smf_message_journal_add(SMFMessage_T *message, SMFHeaderStatus_T status, const char *name, const char *value) {
+    SMFHeaderModification_T *mod = NULL;
+    const char *p = NULL;
+
+    if ((journal_message == NULL) || (message != journal_message))
+        return;
+
+    if ((journal == NULL) && (smf_list_new(&journal,_journal_entry_destroy) != 0)) {
+        journal = NULL;
+        return;
+    }
+
+    if ((mod = (SMFHeaderModification_T *)calloc(1,sizeof(SMFHeaderModification_T))) == NULL)
+        return;
+
+    mod->status = status;
+    /* full header lines are recorded by name */
+    if ((name != NULL) && (value == NULL) && ((p = strchr(name,':')) != NULL)) {
+        mod->name = strndup(name,p - name);
+        value = p + 1;
+    } else if (name != NULL)
+        mod->name = strdup(name);
+
+    if (value != NULL)
+        mod->value = strdup(value);
+
+    smf_list_append(journal,mod);
+}
+
+void smf_message_journal_add_header(SMFHeader_T *header, SMFHeaderStatus_T status, const char *name, const char *value) {
+    SMFListElem_T *elem = NULL;
+
+    if (journal_message == NULL)
+        return;
+
+    /* detached headers and headers of other messages don't touch the queue file */
+    elem = smf_list_head(smf_message_get_headers(journal_message));
+    while(elem != NULL) {
+        if ((SMFHeader_T *)smf_list_data(elem) == header) {
+            smf_message_journal_add(journal_message,status,name,value);
+            break;
+        }
+        elem = elem->next;
+    }
+}
+
 /** Creates a new SMFMessage_T object */
 SMFMessage_T *smf_message_new(void) {
     CMimeMessage_T *message = cmime_message_new();
@@ -70,6 +155,7 @@ void smf_message_set_sender(SMFMessage_T *message, const char *sender) {
     assert(message);
     assert(sender);
     cmime_message_set_sender((CMimeMessage_T *)message, sender);
+    smf_message_journal_add(message,HEADER_SET,"From",sender);
 }
 
 /** Gets the email address of the sender from message. */
@@ -86,6 +172,7 @@ void smf_message_set_message_id(SMFMessage_T *message,const char *message_id) {
     assert(message);
     assert(message_id);
     cmime_message_set_message_id((CMimeMessage_T *)message,message_id);
+    smf_message_journal_add(message,HEADER_SET,"Message-ID",message_id);
 }
 
 char *smf_message_get_message_id(SMFMessage_T *message) {
@@ -98,6 +185,7 @@ int smf_message_set_header(SMFMessage_T *message, const char *header) {
     assert(message);
     assert(header);
 
+    smf_message_journal_add(message,HEADER_SET,header,NULL);
     return cmime_message_set_header((CMimeMessage_T *)message,header);
 }
 
@@ -111,6 +199,7 @@ int smf_message_update_header(SMFMessage_T *message, const char *header, const c
 
     if (asprintf(&header_value, "%s: %s", header, value) == -1)
         return -1;
+    smf_message_journal_add(message,HEADER_SET,header,value);
     result = cmime_message_set_header(message, header_value);
     free(header_value);
     
@@ -157,6 +246,7 @@ int smf_message_remove_header(SMFMessage_T *message, const char *header_name) {
     while(elem != NULL) {
         header = (SMFHeader_T *)smf_list_data(elem);
         if (strcasecmp(header->name,header_name) == 0) {
+            smf_message_journal_add(message,HEADER_REMOVE,header_name,NULL);
             i = smf_list_remove(message->headers, elem, &tf);        
             smf_header_free((SMFHeader_T *)tf);
             break;
@@ -169,9 +259,20 @@ int smf_message_remove_header(SMFMessage_T *message, const char *header_name) {
 
 /** Add a recipient of a chosen type to the message object. */
 int smf_message_add_recipient(SMFMessage_T *message, const char *recipient, SMFEmailAddressType_T t) {
+    int ret;
+
     assert(message);
     assert(recipient);
-    return cmime_message_add_recipient((CMimeMessage_T *)message,recipient,(CMimeAddressType_T)t);
+
+    ret = cmime_message_add_recipient((CMimeMessage_T *)message,recipient,(CMimeAddressType_T)t);
+    if (t == SMF_EMAIL_ADDRESS_TYPE_CC)
+        smf_message_journal_add(message,HEADER_APPEND,"Cc",recipient);
+    else if (t == SMF_EMAIL_ADDRESS_TYPE_BCC)
+        smf_message_journal_add(message,HEADER_APPEND,"Bcc",recipient);
+    else
+        smf_message_journal_add(message,HEADER_APPEND,"To",recipient);
+
+    return ret;
 }
 
 SMFList_T *smf_message_get_recipients(SMFMessage_T *message) {
@@ -183,6 +284,7 @@ void smf_message_set_content_type(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_set_content_type((CMimeMessage_T *)message, s);
+    smf_message_journal_add(message,HEADER_SET,"Content-Type",s);
 }
 
 char *smf_message_get_content_type(SMFMessage_T *message) {
@@ -194,6 +296,7 @@ void smf_message_set_content_transfer_encoding(SMFMessage_T *message, const char
     assert(message);
     assert(s);
     cmime_message_set_content_transfer_encoding((CMimeMessage_T *)message,s);
+    smf_message_journal_add(message,HEADER_SET,"Content-Transfer-Encoding",s);
 }
 
 char *smf_message_get_content_transfer_encoding(SMFMessage_T *message) {
@@ -205,6 +308,7 @@ void smf_message_set_content_id(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_set_content_id((CMimeMessage_T *)message,s);
+    smf_message_journal_add(message,HEADER_SET,"Content-ID",s);
 }
 
 char *smf_message_get_content_id(SMFMessage_T *message) {
@@ -216,6 +320,7 @@ void smf_message_set_mime_version(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_set_mime_version((CMimeMessage_T *)message,s);
+    smf_message_journal_add(message,HEADER_SET,"Mime-Version",s);
 }
 
 char *smf_message_get_mime_version(SMFMessage_T *message) {
@@ -227,6 +332,7 @@ void smf_message_set_date(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_set_date((CMimeMessage_T *)message, s);
+    smf_message_journal_add(message,HEADER_SET,"Date",s);
 }
 
 char *smf_message_get_date(SMFMessage_T *message) {
@@ -236,6 +342,7 @@ char *smf_message_get_date(SMFMessage_T *message) {
 
 int smf_message_set_date_now(SMFMessage_T *message) {
     assert(message);
+    smf_message_journal_add(message,HEADER_SET,"Date",NULL);
     return cmime_message_set_date_now((CMimeMessage_T *)message);
 }
 
@@ -243,6 +350,7 @@ void smf_message_set_boundary(SMFMessage_T *message, const char *boundary) {
     assert(message);
     assert(boundary);
     cmime_message_set_boundary((CMimeMessage_T *)message,boundary);
+    smf_message_journal_add(message,HEADER_SET,"Content-Type",smf_message_get_content_type(message));
 }
 
 char *smf_message_get_boundary(SMFMessage_T *message) {
@@ -257,6 +365,7 @@ char *smf_message_generate_boundary(void) {
 void smf_message_add_generated_boundary(SMFMessage_T *message) {
     assert(message);
     cmime_message_add_generated_boundary((CMimeMessage_T *)message);
+    smf_message_journal_add(message,HEADER_SET,"Content-Type",smf_message_get_content_type(message));
 }
 
 int smf_message_from_file(SMFMessage_T **message, const char *filename, int header_only) {
@@ -310,6 +419,7 @@ void smf_message_set_subject(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_set_subject((CMimeMessage_T *)message, s);
+    smf_message_journal_add(message,HEADER_SET,"Subject",s);
 }
 
 char *smf_message_get_subject(SMFMessage_T *message) {
@@ -321,12 +431,14 @@ void smf_message_prepend_subject(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_prepend_subject((CMimeMessage_T *)message,s);
+    smf_message_journal_add(message,HEADER_PREPEND,"Subject",s);
 }
 
 void smf_message_append_subject(SMFMessage_T *message, const char *s) {
     assert(message);
     assert(s);
     cmime_message_append_subject((CMimeMessage_T *)message,s);
+    smf_message_journal_add(message,HEADER_APPEND,"Subject",s);
 }
 
 int smf_message_set_body(SMFMessage_T *message, const char *content) {
@@ -18,8 +18,10 @@
 #ifndef _SMF_MESSAGE_PRIVATE_H
 #define	_SMF_MESSAGE_PRIVATE_H
 
+#include "smf_message.h"
+#include "smf_list.h"
+
 //void smf_message_extract_addresses(SMFMessageEnvelope_T **envelope);
-#if 0
 typedef enum {
 	HEADER_REMOVE = 0,
 	HEADER_APPEND = 1,
@@ -27,11 +29,33 @@ typedef enum {
 	HEADER_SET = 3,
 } SMFHeaderStatus_T;
 
+/* entry of the header change journal */
 typedef struct {
 	SMFHeaderStatus_T status;
 	char *name;
 	char *value;
 } SMFHeaderModification_T;
-#endif
-#endif	/* _SMF_MESSAGE_PRIVATE_H */
 
+/* start recording header changes of message in the calling thread,
+ * a previous journal is dropped */
+void smf_message_journal_start(SMFMessage_T *message);
+
+/* stop recording and drop the journal */
+void smf_message_journal_stop(void);
+
+/* continue the journal of old with message, which replaces it. The
+ * recorded changes are dropped, message is in sync with the queue file */
+void smf_message_journal_replace(SMFMessage_T *old, SMFMessage_T *message);
+
+/* list of SMFHeaderModification_T, recorded for message since the 
+ * journal has been started, NULL if nothing has been changed */
+SMFList_T *smf_message_journal_get(SMFMessage_T *message);
+
+/* record a header change of message, ignored unless message is journaled */
+void smf_message_journal_add(SMFMessage_T *message, SMFHeaderStatus_T status, const char *name, const char *value);
+
+/* record a change of a SMFHeader_T object, ignored unless the header
+ * belongs to the journaled message */
+void smf_message_journal_add_header(SMFHeader_T *header, SMFHeaderStatus_T status, const char *name, const char *value);
+
+#endif	/* _SMF_MESSAGE_PRIVATE_H */
@@ -26,12 +26,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <assert.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <arpa/inet.h>
 
 #include "smf_modules.h"
 #include "smf_header.h"
 #include "smf_envelope.h"
 #include "smf_message.h"
+#include "smf_message_private.h"
 #include "smf_nexthop.h"
 #include "smf_trace.h"
 #include "smf_internal.h"
@@ -40,38 +45,7 @@
 
 #define THIS_MODULE "modules"
 
-static time_t message_file_mtime(SMFSession_T *session) {
-  struct stat fstat;
-  
-  if (stat(session->message_file, &fstat) != 0) {
-    STRACE(TRACE_ERR, session->id, "%s: %s", session->message_file, strerror(errno));
-    return 0; /* Ignore... */
-  }
-  
-  return fstat.st_mtime;
-}
-
-void _header_destroy(void *data) {
-    SMFHeader_T *h = (SMFHeader_T *)data;
-    smf_header_free(h);
-}
-
-void *_copy_header(SMFListElem_T *elem) {
-    SMFHeader_T *o = (SMFHeader_T *)smf_list_data(elem);
-    SMFHeader_T *n = smf_header_new();
-    char *s = NULL;
-    int i;
-
-    s = smf_header_get_name(o);
-    smf_header_set_name(n, s);
-
-    for(i=0; i < smf_header_get_count(o); i++) {
-        s = smf_header_get_value(o, i);
-        smf_header_set_value(n, s, 0);
-    } 
-
-    return n;
-}
+static void smf_modules_pool_stop(void);
 
 int smf_modules_engine_load(SMFSettings_T *settings) {
     void *module = NULL;
@@ -101,7 +75,15 @@ int smf_modules_engine_load(SMFSettings_T *settings) {
         return -1;
     }
 
+    /* before the engine forks, so module state is shared */
+    if (smf_modules_init(settings) != 0) {
+        dlclose(module);
+        free(engine_path);
+        return -1;
+    }
+
     ret = load_engine(settings);
+    smf_modules_fini(settings);
 
     if (dlclose(module) != 0) {
         TRACE(TRACE_ERR,"failed to unload module [%s]",engine_path);
@@ -167,23 +149,50 @@ static void *smf_module_create_handle(SMFSettings_T *settings, const char *name)
     return handle;
 }
 
+/* resolve the symbols of a shared-object module, so they aren't
+ * looked up again for every message */
+static void smf_module_resolve(SMFModule_T *module) {
+    unsigned int *flags = NULL;
+
+    if (module->u.handle == NULL)
+        return;
+
+    dlerror(); // Clear any errors
+    if ((module->load = (ModuleLoadFunction)dlsym(module->u.handle, "process")) == NULL)
+        module->load = (ModuleLoadFunction)dlsym(module->u.handle, "load");
+
+    if (module->load == NULL)
+        TRACE(TRACE_ERR, "failed to locate 'load'-symbol in module '%s': %s",
+              module->name, dlerror());
+
+    module->init = (ModuleInitFunction)dlsym(module->u.handle, "init");
+    module->child_init = (ModuleInitFunction)dlsym(module->u.handle, "child_init");
+    module->fini = (ModuleFiniFunction)dlsym(module->u.handle, "fini");
+    if ((flags = (unsigned int *)dlsym(module->u.handle, "module_flags")) != NULL)
+        module->flags = *flags;
+    dlerror();
+}
+
 SMFModule_T *smf_module_create_callback(SMFSettings_T *settings, const char *name, ModuleLoadFunction callback) {
     SMFModule_T *module;
 
     assert(name);
 
-    if ((module = malloc(sizeof(SMFModule_T))) == NULL) {
+    if ((module = calloc(1, sizeof(SMFModule_T))) == NULL) {
         return NULL;
     }
     
     module->name = strdup(name);
+    module->flags = SMF_MODULE_DEFAULT;
 
     if (callback == NULL) {
         module->type = 0;
         module->u.handle = smf_module_create_handle(settings, name);
+        smf_module_resolve(module);
     } else {
         module->type = 1;
         module->u.callback = callback;
+        module->load = callback;
     }
     
     TRACE(TRACE_DEBUG, "module %s loaded", name);
@@ -209,114 +218,740 @@ int smf_module_destroy(SMFModule_T *module) {
     return result;
 }
 
-int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session) {
-    ModuleLoadFunction runner;
-    time_t mtime_before, mtime_after;
+/* flags of all modules of the list */
+static unsigned int smf_modules_flags(SMFList_T *modules) {
+    SMFListElem_T *elem = NULL;
+    unsigned int flags = 0;
+
+    elem = smf_list_head(modules);
+    while(elem != NULL) {
+        flags |= ((SMFModule_T *)smf_list_data(elem))->flags;
+        elem = elem->next;
+    }
+
+    return flags;
+}
+
+int smf_modules_readonly(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+
+    assert(settings);
+
+    /* the modules of all routes are listed in settings->modules, too */
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        if ((((SMFModule_T *)smf_list_data(elem))->flags & SMF_MODULE_READONLY) == 0)
+            return 0;
+        elem = elem->next;
+    }
+
+    return 1;
+}
+
+/* invoke module as part of chain, a message rewritten by the module is
+ * reloaded with its body, if any module of the chain needs it */
+static int _smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session, SMFList_T *chain) {
+    unsigned int flags;
     int result;
     
     assert(module);
     assert(session);
     
-    if (module->type == 0) {
-        dlerror(); // Clear any errors
-        if ((runner = dlsym(module->u.handle, "load")) == NULL) {
-            TRACE(TRACE_ERR, "failed to locate 'load'-symbol in module '%s': %s",
-                  module->name, dlerror());
-              return -1;
-          }
-    } else {
-        runner = module->u.callback;
+    if (module->load == NULL) {
+        TRACE(TRACE_ERR, "module '%s' has no 'load'-symbol", module->name);
+        return -1;
     }
     
-    mtime_before = message_file_mtime(session);
-    
-    result = runner(settings,session);
-
-    if (result == 0 && session->message_file != NULL) {
-      mtime_after = message_file_mtime(session);
-      
-      if (mtime_after > mtime_before) {
-        // Spoolfile has change. Reload the message inside the session
+    session->body_dirty = 0;
+    result = module->load(settings,session);
+
+    if ((session->body_dirty == 1) && ((module->flags & SMF_MODULE_MODIFIES_BODY) == 0)) {
+        STRACE(TRACE_WARNING, session->id, "module [%s] marked the message body dirty, but doesn't declare to modify it, ignored",
+            module->name);
+    } else if (result == 0 && session->body_dirty == 1 && session->message_file != NULL) {
+        // Spoolfile has been rewritten by the module. Reload the message inside the session
         SMFMessage_T *message_new = smf_message_new();
-        result = smf_message_from_file(&message_new, session->message_file, 0);
-        
+        flags = module->flags;
+        if (chain != NULL)
+            flags |= smf_modules_flags(chain);
+        result = smf_message_from_file(&message_new, session->message_file, 
+            (flags & SMF_MODULE_NEEDS_BODY) ? 0 : 1);
+
         if (result == 0) {
-          smf_message_free(session->envelope->message);
-          session->envelope->message = message_new;
+            smf_message_journal_replace(session->envelope->message, message_new);
+            smf_message_free(session->envelope->message);
+            session->envelope->message = message_new;
         }
-      }
     }
+    session->body_dirty = 0;
     
     return result;
 }
 
-int smf_modules_process(
-        SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings) {
-    SMFMessage_T *msg = NULL;
-    SMFList_T *initial_headers = NULL;
+int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session) {
+    return _smf_module_invoke(settings, module, session, NULL);
+}
+
+int smf_modules_init(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+
+    assert(settings);
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if ((curmod->init != NULL) && (curmod->init(settings) != 0)) {
+            TRACE(TRACE_ERR, "failed to initialize module [%s]", curmod->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int smf_modules_child_init(SMFSettings_T *settings) {
     SMFListElem_T *elem = NULL;
     SMFModule_T *curmod;
+
+    assert(settings);
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if ((curmod->child_init != NULL) && (curmod->child_init(settings) != 0)) {
+            TRACE(TRACE_ERR, "failed to initialize module [%s] in child %d", curmod->name, getpid());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void smf_modules_fini(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+
+    assert(settings);
+
+    /* no module may be running on the pool while it's finalized */
+    smf_modules_pool_stop();
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if (curmod->fini != NULL)
+            curmod->fini(settings);
+    }
+}
+
+/* client network of a route */
+typedef struct {
+    int family;
+    unsigned char addr[16];
+    int prefix;
+} SMFModuleNetwork_T;
+
+static int smf_modules_network_parse(const char *s, SMFModuleNetwork_T *net) {
+    char buf[INET6_ADDRSTRLEN + 4];
+    char *p = NULL;
+    int max;
+
+    snprintf(buf,sizeof(buf),"%s",s);
+    if ((p = strchr(buf,'/')) != NULL)
+        *p++ = '\0';
+
+    if (inet_pton(AF_INET,buf,net->addr) == 1) {
+        net->family = AF_INET;
+        max = 32;
+    } else if (inet_pton(AF_INET6,buf,net->addr) == 1) {
+        net->family = AF_INET6;
+        max = 128;
+    } else {
+        return -1;
+    }
+
+    net->prefix = (p != NULL) ? atoi(p) : max;
+    if ((net->prefix < 0) || (net->prefix > max))
+        return -1;
+
+    return 0;
+}
+
+static int smf_modules_network_match(SMFList_T *clients, const char *addr) {
+    SMFListElem_T *elem = NULL;
+    SMFModuleNetwork_T *net;
+    unsigned char buf[16];
+    int family, bits, mask;
+
+    if (addr == NULL)
+        return 0;
+
+    if (inet_pton(AF_INET,addr,buf) == 1)
+        family = AF_INET;
+    else if (inet_pton(AF_INET6,addr,buf) == 1)
+        family = AF_INET6;
+    else
+        return 0;
+
+    elem = smf_list_head(clients);
+    while(elem != NULL) {
+        net = (SMFModuleNetwork_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if (net->family != family)
+            continue;
+
+        bits = net->prefix;
+        if (memcmp(net->addr,buf,bits / 8) != 0)
+            continue;
+
+        mask = (0xff << (8 - bits % 8)) & 0xff;
+        if ((bits % 8 == 0) || ((net->addr[bits / 8] & mask) == (buf[bits / 8] & mask)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* lower case domain of an address like <user@example.com> */
+static char *smf_modules_route_domain(const char *addr, char *buf, size_t size) {
+    const char *p = NULL;
+    size_t len = 0;
+
+    if ((addr == NULL) || ((p = strrchr(addr,'@')) == NULL))
+        return NULL;
+
+    for (p++; (*p != '\0') && (*p != '>') && !isspace(*p) && (len < size - 1); p++)
+        buf[len++] = tolower(*p);
+    buf[len] = '\0';
+
+    return (len > 0) ? buf : NULL;
+}
+
+/* values of a [route:name] key, separated by ',' or ';' */
+static char **smf_modules_route_values(SMFSettings_T *settings, char *group, char *key) {
+    char *val = NULL;
+
+    if ((val = smf_settings_group_get(settings,group,key)) == NULL)
+        return NULL;
+
+    return smf_core_strsplit(val,(strchr(val,';') != NULL) ? ";" : ",",NULL);
+}
+
+static SMFDict_T *smf_modules_route_domains(SMFSettings_T *settings, char *group, char *key) {
+    SMFDict_T *dict = NULL;
+    char **sl = NULL;
+    char **p = NULL;
+
+    if ((sl = smf_modules_route_values(settings,group,key)) == NULL)
+        return NULL;
+
+    dict = smf_dict_new();
+    for (p = sl; *p != NULL; p++) {
+        smf_core_strlwc(smf_core_strstrip(*p));
+        if (**p != '\0')
+            smf_dict_set(dict,*p,"1");
+        free(*p);
+    }
+    free(sl);
+
+    return dict;
+}
+
+static void smf_modules_route_free(void *data) {
+    SMFModuleRoute_T *route = (SMFModuleRoute_T *)data;
+
+    free(route->name);
+    free(route->listener);
+    if (route->sender_domains != NULL)
+        smf_dict_free(route->sender_domains);
+    if (route->recipient_domains != NULL)
+        smf_dict_free(route->recipient_domains);
+    if (route->clients != NULL)
+        smf_list_free(route->clients);
+    if (route->modules != NULL)
+        smf_list_free(route->modules);
+    free(route);
+}
+
+static SMFModule_T *smf_modules_find(SMFSettings_T *settings, const char *name) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        if (strcmp(curmod->name,name) == 0)
+            return curmod;
+        elem = elem->next;
+    }
+
+    return NULL;
+}
+
+static SMFModuleRoute_T *smf_modules_route_compile(SMFSettings_T *settings, char *name) {
+    SMFModuleRoute_T *route = NULL;
+    SMFModuleNetwork_T *net = NULL;
+    SMFModule_T *curmod = NULL;
+    char *group = NULL;
+    char *val = NULL;
+    char **sl = NULL;
+    char **p = NULL;
     int ret = 0;
-    int mod_count;
-    char *header = NULL;
-    NexthopFunction nexthop;
 
-    if (smf_list_new(&initial_headers,_header_destroy) != 0) {
-        STRACE(TRACE_ERR,session->id, "failed to create header list");
+    if (asprintf(&group,"route:%s",name) == -1)
+        return NULL;
+
+    if ((route = calloc(1,sizeof(SMFModuleRoute_T))) == NULL) {
+        free(group);
+        return NULL;
+    }
+    route->name = strdup(name);
+
+    if ((val = smf_settings_group_get(settings,group,"listener")) != NULL)
+        route->listener = strdup(val);
+    route->sender_domains = smf_modules_route_domains(settings,group,"sender_domain");
+    route->recipient_domains = smf_modules_route_domains(settings,group,"recipient_domain");
+    if (smf_settings_group_get(settings,group,"min_size") != NULL)
+        route->min_size = strtoul(smf_settings_group_get(settings,group,"min_size"),NULL,10);
+    if (smf_settings_group_get(settings,group,"max_size") != NULL)
+        route->max_size = strtoul(smf_settings_group_get(settings,group,"max_size"),NULL,10);
+
+    if ((sl = smf_modules_route_values(settings,group,"client")) != NULL) {
+        smf_list_new(&route->clients,free);
+        for (p = sl; *p != NULL; p++) {
+            smf_core_strstrip(*p);
+            if ((ret == 0) && (**p != '\0')) {
+                if (((net = calloc(1,sizeof(SMFModuleNetwork_T))) == NULL) || (smf_modules_network_parse(*p,net) != 0)) {
+                    TRACE(TRACE_ERR,"route [%s]: invalid client network [%s]",name,*p);
+                    free(net);
+                    ret = -1;
+                } else {
+                    smf_list_append(route->clients,net);
+                }
+            }
+            free(*p);
+        }
+        free(sl);
+    }
+
+    /* the chain refers to the modules of settings->modules, so they
+     * are loaded and initialized only once */
+    smf_list_new(&route->modules,NULL);
+    if ((sl = smf_modules_route_values(settings,group,"modules")) != NULL) {
+        for (p = sl; *p != NULL; p++) {
+            smf_core_strstrip(*p);
+            if ((ret == 0) && (**p != '\0')) {
+                if ((curmod = smf_modules_find(settings,*p)) == NULL) {
+                    TRACE(TRACE_ERR,"route [%s]: module [%s] is not listed in [global]modules",name,*p);
+                    ret = -1;
+                } else {
+                    smf_list_append(route->modules,curmod);
+                }
+            }
+            free(*p);
+        }
+        free(sl);
+    }
+
+    free(group);
+    if (ret != 0) {
+        smf_modules_route_free(route);
+        return NULL;
+    }
+
+    TRACE(TRACE_DEBUG,"route [%s] compiled with %d modules",name,smf_list_size(route->modules));
+    return route;
+}
+
+int smf_modules_routes_compile(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    SMFModuleRoute_T *route = NULL;
+    SMFList_T *table = NULL;
+
+    assert(settings);
+
+    if (smf_list_new(&table,smf_modules_route_free) != 0)
         return -1;
+
+    elem = smf_list_head(settings->routes);
+    while(elem != NULL) {
+        if ((route = smf_modules_route_compile(settings,(char *)smf_list_data(elem))) == NULL) {
+            smf_list_free(table);
+            return -1;
+        }
+        smf_list_append(table,route);
+        elem = elem->next;
     }
 
-    msg = smf_envelope_get_message(session->envelope);
-    elem = smf_list_head(msg->headers);
+    if (settings->route_table != NULL)
+        smf_list_free(settings->route_table);
+    settings->route_table = table;
+
+    return 0;
+}
+
+static int smf_modules_route_match(SMFModuleRoute_T *route, SMFSession_T *session) {
+    SMFListElem_T *elem = NULL;
+    char buf[256];
+    char *domain = NULL;
+
+    if ((route->listener != NULL) && 
+            ((session->listener == NULL) || (strcmp(route->listener,session->listener) != 0)))
+        return 0;
+
+    if ((route->min_size > 0) && (session->message_size < route->min_size))
+        return 0;
+
+    if ((route->max_size > 0) && (session->message_size > route->max_size))
+        return 0;
+
+    if ((route->clients != NULL) && (smf_modules_network_match(route->clients,session->xforward_addr) == 0))
+        return 0;
+
+    if (route->sender_domains != NULL) {
+        domain = smf_modules_route_domain(session->envelope->sender,buf,sizeof(buf));
+        if ((domain == NULL) || (smf_dict_get(route->sender_domains,domain) == NULL))
+            return 0;
+    }
+
+    if (route->recipient_domains != NULL) {
+        if (smf_list_size(session->envelope->recipients) == 0)
+            return 0;
+
+        elem = smf_list_head(session->envelope->recipients);
+        while(elem != NULL) {
+            domain = smf_modules_route_domain((char *)smf_list_data(elem),buf,sizeof(buf));
+            if ((domain == NULL) || (smf_dict_get(route->recipient_domains,domain) == NULL))
+                return 0;
+            elem = elem->next;
+        }
+    }
+
+    return 1;
+}
+
+SMFModuleRoute_T *smf_modules_route_find(SMFSettings_T *settings, SMFSession_T *session) {
+    SMFListElem_T *elem = NULL;
+    SMFModuleRoute_T *route = NULL;
+
+    assert(settings);
+    assert(session);
+
+    if (settings->route_table == NULL)
+        return NULL;
+
+    elem = smf_list_head(settings->route_table);
     while(elem != NULL) {
-        smf_list_append(initial_headers,_copy_header(elem));
+        route = (SMFModuleRoute_T *)smf_list_data(elem);
+        if (smf_modules_route_match(route,session) == 1)
+            return route;
         elem = elem->next;
     }
 
+    return NULL;
+}
+
+/* a read-only module, which runs on a thread of the module pool. It gets a
+ * private copy of the session, so the response message doesn't collide with
+ * the other modules of the group */
+typedef struct _SMFModuleJob_T {
+    SMFModule_T *module;
+    SMFSettings_T *settings;
+    SMFSession_T session;
+    struct _SMFModuleJob_T *next;
+    int done;
+    int ret;
+} SMFModuleJob_T;
+
+/* per-process pool for read-only module groups, it's created on first use
+ * and torn down in smf_modules_fini() */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    SMFModuleJob_T *head;
+    SMFModuleJob_T *tail;
+    pthread_t *threads;
+    int num_threads;
+    int shutdown;
+    pid_t pid;
+} module_pool = { 
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, NULL, 0, 0, 0 
+};
+
+static void *smf_modules_job_run(void *data) {
+    SMFModuleJob_T *job = (SMFModuleJob_T *)data;
+
+    if (job->module->load == NULL) {
+        TRACE(TRACE_ERR, "module '%s' has no 'load'-symbol", job->module->name);
+        job->ret = -1;
+    } else {
+        job->ret = job->module->load(job->settings, &job->session);
+    }
+
+    if (job->session.body_dirty == 1)
+        STRACE(TRACE_WARNING, job->session.id, "read-only module [%s] marked the message body dirty, ignored",
+            job->module->name);
+
+    return NULL;
+}
+
+static void *smf_modules_pool_worker(void *data) {
+    SMFModuleJob_T *job = NULL;
+
+    pthread_mutex_lock(&module_pool.lock);
+    for (;;) {
+        while ((module_pool.head == NULL) && (module_pool.shutdown == 0))
+            pthread_cond_wait(&module_pool.work, &module_pool.lock);
+        
+        if (module_pool.head == NULL)
+            break;
+
+        job = module_pool.head;
+        module_pool.head = job->next;
+        if (module_pool.head == NULL)
+            module_pool.tail = NULL;
+        pthread_mutex_unlock(&module_pool.lock);
+
+        smf_modules_job_run(job);
+
+        pthread_mutex_lock(&module_pool.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&module_pool.done);
+    }
+    pthread_mutex_unlock(&module_pool.lock);
+
+    return NULL;
+}
+
+/* start the pool, if not yet done in this process. The caller of a group runs
+ * one module by itself, so module_threads - 1 workers are enough. Must be 
+ * called with module_pool.lock held */
+static void smf_modules_pool_start(SMFSettings_T *settings) {
+    int i;
+
+    if (module_pool.pid == getpid())
+        return;
+
+    /* a forked child inherits the state but not the threads */
+    module_pool.head = NULL;
+    module_pool.tail = NULL;
+    module_pool.threads = NULL;
+    module_pool.num_threads = 0;
+    module_pool.shutdown = 0;
+    module_pool.pid = getpid();
+
+    if (settings->module_threads <= 1)
+        return;
+
+    if ((module_pool.threads = calloc(settings->module_threads - 1, sizeof(pthread_t))) == NULL)
+        return;
+
+    for (i = 0; i < settings->module_threads - 1; i++) {
+        if (pthread_create(&module_pool.threads[i], NULL, smf_modules_pool_worker, NULL) != 0) {
+            TRACE(TRACE_WARNING, "failed to create module thread: %s", strerror(errno));
+            break;
+        }
+        module_pool.num_threads++;
+    }
+}
+
+static void smf_modules_pool_stop(void) {
+    int i;
+
+    pthread_mutex_lock(&module_pool.lock);
+    if (module_pool.pid != getpid()) {
+        pthread_mutex_unlock(&module_pool.lock);
+        return;
+    }
+    module_pool.shutdown = 1;
+    pthread_cond_broadcast(&module_pool.work);
+    pthread_mutex_unlock(&module_pool.lock);
+
+    for (i = 0; i < module_pool.num_threads; i++)
+        pthread_join(module_pool.threads[i], NULL);
+
+    free(module_pool.threads);
+    module_pool.threads = NULL;
+    module_pool.num_threads = 0;
+    module_pool.pid = 0;
+}
+
+/* invoke the read-only modules starting at elem at the same time, at most 
+ * settings->module_threads of them. The first one runs in the calling thread,
+ * the others are handed to the module pool */
+static int smf_modules_run_group(SMFSettings_T *settings, SMFSession_T *session, 
+        SMFListElem_T *elem, SMFModuleJob_T **jobs) {
+    SMFModule_T *curmod;
+    int i, count = 0, queued = 0;
+
+    if ((*jobs = calloc(settings->module_threads, sizeof(SMFModuleJob_T))) == NULL)
+        return 0;
+
+    while ((elem != NULL) && (count < settings->module_threads)) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        if ((curmod->flags & SMF_MODULE_READONLY) == 0)
+            break;
+
+        (*jobs)[count].module = curmod;
+        (*jobs)[count].settings = settings;
+        (*jobs)[count].session = *session;
+        (*jobs)[count].session.response_msg = NULL;
+        (*jobs)[count].session.body_dirty = 0;
+        count++;
+        elem = elem->next;
+    }
+
+    if (count > 1) {
+        pthread_mutex_lock(&module_pool.lock);
+        smf_modules_pool_start(settings);
+        if (module_pool.num_threads > 0) {
+            for (i = 1; i < count; i++) {
+                STRACE(TRACE_DEBUG,session->id,"invoke module [%s] in parallel", (*jobs)[i].module->name);
+                if (module_pool.tail != NULL)
+                    module_pool.tail->next = &(*jobs)[i];
+                else
+                    module_pool.head = &(*jobs)[i];
+                module_pool.tail = &(*jobs)[i];
+            }
+            queued = 1;
+            pthread_cond_broadcast(&module_pool.work);
+        }
+        pthread_mutex_unlock(&module_pool.lock);
+    }
+
+    STRACE(TRACE_DEBUG,session->id,"invoke module [%s]", (*jobs)[0].module->name);
+    smf_modules_job_run(&(*jobs)[0]);
+
+    for (i = 1; i < count; i++) {
+        if (queued == 1) {
+            pthread_mutex_lock(&module_pool.lock);
+            while ((*jobs)[i].done == 0)
+                pthread_cond_wait(&module_pool.done, &module_pool.lock);
+            pthread_mutex_unlock(&module_pool.lock);
+        } else {
+            /* no thread available, do it here */
+            smf_modules_job_run(&(*jobs)[i]);
+        }
+    }
+
+    return count;
+}
+
+/* evaluate the result of a module with processing_error(). Returns -1 or 1 
+ * if processing stops, 2 to turn to nexthop processing, otherwise the 
+ * processing goes on */
+static int smf_modules_verdict(SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings,
+        SMFList_T *modules, SMFModule_T *curmod, int ret, int *mod_count, char **header) {
+    if (ret != 0) {
+        ret = q->processing_error(settings,session,ret);
+        
+        if(ret == 0) {
+            STRACE(TRACE_ERR, session->id, "module [%s] failed, stopping processing!", curmod->name);
+            return -1;
+        } else if(ret == 1) {
+            STRACE(TRACE_WARNING, session->id, "module [%s] stopped processing!", curmod->name);
+            return 1;
+        } else if(ret == 2) {
+            STRACE(TRACE_DEBUG,session->id,"module [%s] stopped processing, turning to nexthop processing!",curmod->name);
+            return 2;
+        }
+    } else {
+        STRACE(TRACE_DEBUG, session->id, "module [%s] finished successfully", curmod->name);
+    }
+
+    (*mod_count)++;
+    if (settings->add_header == 1) {
+        if (*mod_count == smf_list_size(modules))
+            smf_core_strcat_printf(header, "%s", curmod->name);
+        else
+            smf_core_strcat_printf(header, "%s, ", curmod->name);
+    }
+
+    return ret;
+}
+
+int smf_modules_process(
+        SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+    SMFModuleJob_T *jobs = NULL;
+    SMFModuleRoute_T *route = NULL;
+    SMFList_T *modules = settings->modules;
+    int ret = 0;
+    int mod_count;
+    int i, count;
+    char *header = NULL;
+    NexthopFunction nexthop;
+
     if (settings->add_header == 1)
         if (asprintf(&header,"X-Spmfilter: ") == -1)
             return -1;
 
-    /* fetch user data */
-    if (smf_internal_fetch_user_data(settings,session) != 0)
+    /* header changes of the modules are recorded, see smf_modules_flush_dirty() */
+    smf_message_journal_start(smf_envelope_get_message(session->envelope));
+
+    /* the module chain of the first matching route, all modules otherwise */
+    if ((route = smf_modules_route_find(settings,session)) != NULL) {
+        STRACE(TRACE_DEBUG, session->id, "message matches route [%s]", route->name);
+        modules = route->modules;
+    }
+
+    /* fetch user data, if any module wants it */
+    if ((smf_modules_flags(modules) & SMF_MODULE_NEEDS_USER_DATA) == 0)
+        STRACE(TRACE_DEBUG, session->id, "no module needs local user data, skipping lookup");
+    else if (smf_internal_fetch_user_data(settings,session) != 0)
         STRACE(TRACE_ERR, session->id, "failed to load local user data"); 
 
     mod_count = 0;
-    elem = smf_list_head(settings->modules);
+    elem = smf_list_head(modules);
     while(elem != NULL) {
         curmod = (SMFModule_T *)smf_list_data(elem);
-        elem = elem->next;
 
-        STRACE(TRACE_DEBUG,session->id,"invoke module [%s]", curmod->name);
-        ret = smf_module_invoke(settings, curmod, session);
-        
-        if(ret != 0) {
-            ret = q->processing_error(settings,session,ret);
-            
-            if(ret == 0) {
-                STRACE(TRACE_ERR, session->id, "module [%s] failed, stopping processing!", curmod->name);
-                free(header);
-                smf_list_free(initial_headers);
-                return -1;
-            } else if(ret == 1) {
-                STRACE(TRACE_WARNING, session->id, "module [%s] stopped processing!", curmod->name);
-                free(header);
-                smf_list_free(initial_headers);
-                return 1;
-            } else if(ret == 2) {
-                STRACE(TRACE_DEBUG,session->id,"module [%s] stopped processing, turning to nexthop processing!",curmod->name);
-                break;
+        /* a group of read-only modules, their results are evaluated in 
+         * the configured order, as if they had run one after another */
+        if ((settings->module_threads > 1) && (curmod->flags & SMF_MODULE_READONLY) &&
+                (elem->next != NULL) && (((SMFModule_T *)smf_list_data(elem->next))->flags & SMF_MODULE_READONLY) &&
+                ((count = smf_modules_run_group(settings, session, elem, &jobs)) > 0)) {
+            for (i = 0; i < count; i++) {
+                elem = elem->next;
+
+                if ((ret == -1) || (ret == 1) || (ret == 2)) {
+                    free(jobs[i].session.response_msg);
+                    continue;
+                }
+
+                if (jobs[i].session.response_msg != NULL) {
+                    free(session->response_msg);
+                    session->response_msg = jobs[i].session.response_msg;
+                }
+                ret = smf_modules_verdict(q, session, settings, modules, jobs[i].module, jobs[i].ret, &mod_count, &header);
             }
+            free(jobs);
+            jobs = NULL;
         } else {
-            STRACE(TRACE_DEBUG, session->id, "module [%s] finished successfully", curmod->name);
+            elem = elem->next;
+
+            STRACE(TRACE_DEBUG,session->id,"invoke module [%s]", curmod->name);
+            ret = _smf_module_invoke(settings, curmod, session, modules);
+            ret = smf_modules_verdict(q, session, settings, modules, curmod, ret, &mod_count, &header);
         }
 
-        mod_count++;
-        if (settings->add_header == 1) {
-            if (mod_count == smf_list_size(settings->modules))
-                smf_core_strcat_printf(&header, "%s", curmod->name);
-            else
-                smf_core_strcat_printf(&header, "%s, ", curmod->name);
+        if ((ret == -1) || (ret == 1)) {
+            free(header);
+            smf_message_journal_stop();
+            return ret;
+        } else if (ret == 2) {
+            break;
         }
     }
 
@@ -325,11 +960,11 @@ int smf_modules_process(
 
     if ((ret == 0) || (ret == 2)) {
         if (settings->add_header == 1) {
-            smf_message_set_header(msg, header);
+            smf_message_set_header(smf_envelope_get_message(session->envelope), header);
             free(header); 
         }
         
-        if ((ret = smf_modules_flush_dirty(settings,session,initial_headers)) != 0)
+        if ((ret = smf_modules_flush_dirty(settings,session)) != 0)
             STRACE(TRACE_ERR,session->id,"message flush failed");
 
         /* queue is done, if we're still here check for next hop and
@@ -340,119 +975,46 @@ int smf_modules_process(
                 q->nexthop_error(settings, session);
         }
     }
-    smf_list_free(initial_headers);
+    smf_message_journal_stop();
 
     return ret;
 }
 
 
 /** Flush modified message headers to queue file */
-int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session, SMFList_T *initial_headers) {
-    SMFHeader_T *h_init = NULL;
-    SMFHeader_T *h_msg = NULL;
-    SMFListElem_T *elem_init = NULL;
-    SMFListElem_T *elem_msg = NULL;
+int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session) {
+    SMFHeaderModification_T *mod = NULL;
+    SMFListElem_T *elem = NULL;
     SMFMessage_T *msg = NULL;
+    SMFList_T *changes = NULL;
     int dirty = 0;
-    int found = 0;
-    int i = 0;
-    char *value1 = NULL;
-    char *value2 = NULL;
 
-    STRACE(TRACE_DEBUG,session->id,"flushing header information to filesystem");
-    
     msg = smf_envelope_get_message(session->envelope);
 
-    elem_msg = smf_list_head(msg->headers);
-
-    /* check if message headers have changed during session */
-    if (msg->headers->size != initial_headers->size) {
+    /* the journal only exists, if headers have changed during session */
+    if (((changes = smf_message_journal_get(msg)) != NULL) && (smf_list_size(changes) > 0)) {
         dirty = 1;
-    } else {
-        while(elem_msg != NULL) {
-            h_msg = (SMFHeader_T *)smf_list_data(elem_msg);
-            found = 0;
-            elem_init = smf_list_head(initial_headers);
-            while (elem_init != NULL) {
-                h_init = (SMFHeader_T *)smf_list_data(elem_init);
-                /* ok, we found the header name in the initial list */
-                if (strcmp(h_msg->name,h_init->name)==0) {
-                    found = 1;
-                    /* lets check if the values are the same */
-                    if (smf_header_get_count(h_msg) != smf_header_get_count(h_init)) {
-                        dirty = 1;
-                    } else {
-                        for (i=0;i<smf_header_get_count(h_msg);i++) {
-                            value1 = smf_header_get_value(h_msg,i);
-                            value2 = smf_header_get_value(h_init,i);
-                            if ((value1 != NULL) && (value2 !=NULL) && (strcmp(value1,value2) != 0)) {
-                                dirty = 1;
-                            }
-                        }
-                    }   
-                    break;
-                }
-                elem_init = elem_init->next;
-            }
-
-            if (found == 0) {
-                dirty = 1;
-                break;
-            }
-            elem_msg = elem_msg->next;
-        }   
+        STRACE(TRACE_DEBUG,session->id,"flushing %d header changes to filesystem",smf_list_size(changes));
+
+        elem = smf_list_head(changes);
+        while(elem != NULL) {
+            mod = (SMFHeaderModification_T *)smf_list_data(elem);
+            STRACE(TRACE_DEBUG,session->id,"header change %d: [%s]",mod->status,
+                (mod->name != NULL) ? mod->name : "");
+            elem = elem->next;
+        }
     }
     
-    /* merge new headers with message content to new queue file */
+    /* only the header block is written, the body stays where it is */
     if (dirty == 1) {
-        char tmpname[PATH_MAX];
-        int fd;
-        FILE *new = NULL;
-        FILE *old = NULL;
-        
-        snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", settings->queue_dir);
-
-        if ((fd = mkstemp(tmpname)) == -1) {
-            STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
+        if (smf_internal_spool_flush_header(session,settings->queue_dir,msg) != 0)
             return -1;
-        }
-    
-        if (smf_message_to_fd(msg, fd) == -1) {
-            STRACE(TRACE_ERR,session->id,"unable to write temporary file [%s]: %s",tmpname, strerror(errno));
-            return -1;
-        }
-        
-        close(fd);
 
-        if((new = fopen(tmpname, "a"))==NULL) {
-            STRACE(TRACE_ERR,session->id,"unable to open temporary file: %s (%d)",strerror(errno), errno);
-            return -1;
-        }
+        STRACE(TRACE_DEBUG,session->id,"header block written to %s, body starts at offset %lld",
+            session->header_file,(long long)session->body_offset);
 
-        if((old = fopen(session->message_file, "r"))==NULL) {
-            STRACE(TRACE_ERR,session->id,"unable to open queue file: %s (%d)",strerror(errno), errno);
-            fclose(new);
-            return -1;
-        }
-
-        if (smf_message_write_skip_header(old, new) == -1) {
-            fclose(old); 
-            fclose(new);
-            return -1;    
-        }
-        
-        fclose(old); 
-        fclose(new);
-
-        if (unlink(session->message_file)!=0) {
-            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
-            return -1;
-        }
-
-        if (rename(tmpname,session->message_file)!=0) {
-            STRACE(TRACE_ERR,session->id,"failed to rename queue file: %s (%d)",strerror(errno),errno);
-            return -1;
-        }
+        /* the queue file is in sync again */
+        smf_message_journal_start(msg);
     }
 
     return 0;
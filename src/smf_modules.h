@@ -27,6 +27,7 @@ extern "C" {
 #include "smf_settings.h"
 #include "smf_session.h"
 #include "smf_list.h"
+#include "smf_dict.h"
 
 /*!
  * @file smf_modules.h
@@ -43,8 +44,55 @@ extern "C" {
  */
 
 typedef int (*ModuleLoadFunction)(SMFSettings_T *settings, SMFSession_T *session);
+typedef int (*ModuleInitFunction)(SMFSettings_T *settings);
+typedef void (*ModuleFiniFunction)(SMFSettings_T *settings);
 typedef int (*LoadEngine)(SMFSettings_T *settings);
 
+/*!
+ * @def SMF_MODULE_READONLY
+ * @brief The module only reads the session and the message. Consecutive 
+ *        read-only modules are run at the same time, if module_threads is 
+ *        greater than 1. Such a module must not change the message, neither 
+ *        headers nor body, it may only set the response message of its session.
+ *        Shared-object modules declare their flags with an exported 
+ *        <code>unsigned int module_flags</code>.
+ */
+#define SMF_MODULE_READONLY 0x01
+
+/*!
+ * @def SMF_MODULE_NEEDS_BODY
+ * @brief The module needs the parsed message body, a message which has been
+ *        rewritten by a module is only parsed completely, if a module needs it
+ */
+#define SMF_MODULE_NEEDS_BODY 0x02
+
+/*!
+ * @def SMF_MODULE_NEEDS_USER_DATA
+ * @brief The module needs the local user data of the session, the lookup 
+ *        is skipped if no module needs it
+ */
+#define SMF_MODULE_NEEDS_USER_DATA 0x04
+
+/*!
+ * @def SMF_MODULE_MODIFIES_HEADERS
+ * @brief The module changes message headers
+ */
+#define SMF_MODULE_MODIFIES_HEADERS 0x08
+
+/*!
+ * @def SMF_MODULE_MODIFIES_BODY
+ * @brief The module rewrites the message file, see smf_session_mark_body_dirty().
+ *        The message is only reloaded after modules with this flag.
+ */
+#define SMF_MODULE_MODIFIES_BODY 0x10
+
+/*!
+ * @def SMF_MODULE_DEFAULT
+ * @brief Flags of modules, which don't declare their flags
+ */
+#define SMF_MODULE_DEFAULT (SMF_MODULE_NEEDS_BODY | SMF_MODULE_NEEDS_USER_DATA | \
+                            SMF_MODULE_MODIFIES_HEADERS | SMF_MODULE_MODIFIES_BODY)
+
 
 /*!
  * @struct SMFModule_T
@@ -59,8 +107,31 @@ typedef struct {
         void *handle; /**< module handle, value for typp 0 */
         ModuleLoadFunction callback; /**< Callback, used for type != 0 */
     } u;
+    ModuleLoadFunction load; /**< entry point, resolved once when the module is created */
+    ModuleInitFunction init; /**< optional <code>init</code>-symbol, NULL if not exported */
+    ModuleInitFunction child_init; /**< optional <code>child_init</code>-symbol, NULL if not exported */
+    ModuleFiniFunction fini; /**< optional <code>fini</code>-symbol, NULL if not exported */
+    unsigned int flags; /**< SMF_MODULE_* flags, from the optional <code>module_flags</code>-symbol,
+                             SMF_MODULE_DEFAULT if not exported */
 } SMFModule_T;
 
+/*!
+ * @struct SMFModuleRoute_T
+ * @brief A module chain for messages, which match all conditions of the 
+ *        route. Routes are configured in [route:name] sections and compiled
+ *        by smf_modules_routes_compile().
+ */
+typedef struct {
+    char *name; /**< name of the route */
+    char *listener; /**< listener name, NULL matches all listeners */
+    SMFDict_T *sender_domains; /**< sender domains, NULL matches all senders */
+    SMFDict_T *recipient_domains; /**< domains, which all recipients must belong to, NULL matches all recipients */
+    SMFList_T *clients; /**< client networks, matched against the xforward address, NULL matches all clients */
+    unsigned long min_size; /**< minimal message size in bytes, 0 for no limit */
+    unsigned long max_size; /**< maximal message size in bytes, 0 for no limit */
+    SMFList_T *modules; /**< module chain, the modules are owned by settings->modules */
+} SMFModuleRoute_T;
+
 typedef struct {
     int (*load_error)(SMFSettings_T *settings, SMFSession_T *session);
     int (*processing_error)(SMFSettings_T *settings, SMFSession_T *session, int retval);
@@ -118,9 +189,19 @@ int smf_module_destroy(SMFModule_T *module);
 /**
  * @brief Invokes the module.
  *
- * The functions locates the <code>load</code>-symbol from the module's
- * shared-object. The load-function must be declared like ModuleLoadFunction
- * and should return 0 on success.
+ * Calls the entry point of the module, which has been resolved by
+ * smf_module_create(). A shared-object exports it as <code>process</code>
+ * or <code>load</code>-symbol, declared like ModuleLoadFunction. It should
+ * return 0 on success.
+ *
+ * Besides the entry point a shared-object may export <code>init</code>,
+ * <code>child_init</code> and <code>fini</code>-symbols, declared like 
+ * ModuleInitFunction and ModuleFiniFunction, see smf_modules_init().
+ *
+ * If the module marks the message body dirty, the message is reloaded
+ * from the spool file, with the body only if the module declares
+ * SMF_MODULE_NEEDS_BODY. smf_modules_process() reloads the body, if any
+ * module of the processed chain needs it.
  *
  * @param settings the settiogs.
  * @param module The module is invoke
@@ -130,11 +211,76 @@ int smf_module_destroy(SMFModule_T *module);
  */
 int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session);
 
+/**
+ * @brief Checks, if all configured modules are read-only.
+ *
+ * Only read-only modules may process several messages at the same 
+ * time, see SMF_MODULE_READONLY. Modules without flags are not.
+ *
+ * @param settings a SMFSettings_T object
+ * @return 1 if every module declares SMF_MODULE_READONLY, 0 otherwise
+ */
+int smf_modules_readonly(SMFSettings_T *settings);
+
+/**
+ * @brief Calls the <code>init</code>-function of all modules.
+ *
+ * Runs once in the master process, before the engine forks its
+ * childs, so state loaded here is shared copy-on-write. Modules, 
+ * which fail to initialize, stop the startup.
+ *
+ * @param settings a SMFSettings_T object
+ * @return 0 on success, -1 if a module failed to initialize
+ */
+int smf_modules_init(SMFSettings_T *settings);
+
+/**
+ * @brief Calls the <code>child_init</code>-function of all modules.
+ *
+ * Runs in each process, which processes messages, right after it has 
+ * been forked.
+ *
+ * @param settings a SMFSettings_T object
+ * @return 0 on success, -1 if a module failed to initialize
+ */
+int smf_modules_child_init(SMFSettings_T *settings);
+
+/**
+ * @brief Calls the <code>fini</code>-function of all modules.
+ *
+ * Runs in the master process at shutdown and in each child, before it exits.
+ *
+ * @param settings a SMFSettings_T object
+ */
+void smf_modules_fini(SMFSettings_T *settings);
+
+/**
+ * @brief Compiles the routes named in settings->routes.
+ *
+ * Each route is configured in a [route:name] section with the keys listener,
+ * sender_domain, recipient_domain, client (networks like 10.0.0.0/8), 
+ * min_size, max_size and modules. The modules of a route have to be listed
+ * in [global]modules, too. The compiled routes replace settings->route_table.
+ *
+ * @param settings a SMFSettings_T object
+ * @return 0 on success, -1 if a route is invalid
+ */
+int smf_modules_routes_compile(SMFSettings_T *settings);
+
+/**
+ * @brief Finds the first route, which matches the session.
+ *
+ * @param settings a SMFSettings_T object
+ * @param session a SMFSession_T object
+ * @return The matching route or NULL, if the message passes all modules
+ */
+SMFModuleRoute_T *smf_modules_route_find(SMFSettings_T *settings, SMFSession_T *session);
+
 /** load all modules and run them */
 int smf_modules_process(SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings);
 
 /** Flush modified message headers to queue file */
-int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session, SMFList_T *initial_headers);
+int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session);
 
 int smf_modules_engine_load(SMFSettings_T *settings);
 
@@ -22,6 +22,7 @@
 #include "smf_nexthop.h"
 #include "smf_smtp.h"
 #include "smf_trace.h"
+#include "smf_internal.h"
 
 #define THIS_MODULE "nexthop"
 
@@ -45,6 +46,7 @@ static int copy_recipients(SMFMessage_T *from, SMFEnvelope_T *to) {
 static int smtp_delivery_nexthop(SMFSettings_T *settings, SMFSession_T *session) {
     SMFEnvelope_T *env = smf_session_get_envelope(session);
     SMFSmtpStatus_T *status = NULL;
+    FILE *fp = NULL;
     int retval = 0;
 
     if (env->sender == NULL)
@@ -58,7 +60,16 @@ static int smtp_delivery_nexthop(SMFSettings_T *settings, SMFSession_T *session)
     if (env->nexthop == NULL)
         smf_envelope_set_nexthop(env, settings->nexthop);
 
-    status = smf_smtp_deliver(env, settings->tls, session->message_file,session->id);
+    if (session->message_file == NULL) {
+        status = smf_smtp_deliver(env, settings->tls, NULL, session->id);
+    } else if ((fp = smf_internal_spool_fopen(session)) == NULL) {
+        STRACE(TRACE_ERR, session->id, "Failed to open %s for reading: %s",
+            session->message_file, strerror(errno));
+        return -1;
+    } else {
+        /* flushed headers are sent in front of the unchanged body */
+        status = smf_smtp_deliver_fp(env, settings->tls, fp, session->id);
+    }
     if (status->code != 250) {
         retval = -1;
         if (status->code != -1) {
@@ -85,7 +96,7 @@ static int file_delivery_nexthop(SMFSettings_T *settings, SMFSession_T *session)
         char block[512];
         size_t nbytes;
         
-        if ((src = fopen(session->message_file, "r")) == NULL) {
+        if ((src = smf_internal_spool_fopen(session)) == NULL) {
             STRACE(TRACE_ERR, session->id, "Failed to open %s for reading: %s",
                 session->message_file, strerror(errno));
             return -1;
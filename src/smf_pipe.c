@@ -102,6 +102,12 @@ int load(SMFSettings_T *settings) {
         return(-1);
     }
 
+    /* the pipe engine doesn't fork, the message is processed right here */
+    if (smf_modules_child_init(settings) != 0) {
+        free(q);
+        return(-1);
+    }
+
     
     /* generate the queue file */
     smf_core_gen_queue_file(settings->queue_dir, &session->message_file, session->id);
@@ -131,6 +137,7 @@ int load(SMFSettings_T *settings) {
           fclose(spool_file);
           return -1;
         }
+        session->message_size += nwritten;
     }
 
     fclose(spool_file);
@@ -143,7 +150,7 @@ int load(SMFSettings_T *settings) {
 
 
     ret = smf_modules_process(q,session,settings);
-    remove(session->message_file);
+    smf_internal_spool_remove(session);
     
     TRACE(TRACE_DEBUG,"removing spool file %s",session->message_file);
     
@@ -21,10 +21,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <sys/select.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -38,247 +43,204 @@
 #include "smf_server.h"
 #include "smf_modules.h"
 #include "smf_settings_private.h"
+#include "smf_internal.h"
 
-#ifdef HAVE_POSIX_SEMAPHORE
-#include <semaphore.h>
 #include <sys/mman.h>
-#include <fcntl.h> 
-#endif
-#ifdef HAVE_SYSV_SEMAPHORE
-#include <sys/ipc.h>
-#include <sys/sem.h>
-#include <sys/shm.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #define THIS_MODULE "server"
 
-#define SEM_LOCK -1
-#define SEM_UNLOCK 1
+/* maximum number of childs forked per second */
+#define MAX_SPAWN_RATE 32
+
+/* signal to stop an idle child */
+#define SIG_CULL SIGWINCH
+
+/* environment of a new master, started for a binary upgrade */
+#define LISTEN_FDS_ENV "SPMFILTER_LISTEN_FDS"
+#define OLD_MASTER_ENV "SPMFILTER_OLD_MASTER"
+
+/* size of the parent's pid => slot table, must be a power of 2 */
+#define SLOT_MAP_SIZE (2 * CHILD_LIMIT)
 
 static volatile int daemon_exit = 0;
+static volatile int daemon_upgrade = 0;
+static volatile int daemon_drain = 0;
+static volatile int daemon_reload = 0;
 
-#ifndef HAVE_POSIX_SEMAPHORE
-static struct sembuf semaphore;
+/* master, which handed over its listeners to us */
+static pid_t old_master = 0;
 
-union semun {
-    int val;
-    struct semid_ds *buf;
-    unsigned short *array;
-};
-#endif
+/* the following is only used by the parent process */
+typedef struct {
+    pid_t pid;
+    int slot;
+} SMFServerSlotMap_T;
 
-int _smf_server_init_ipc(SMFSettings_T *settings, SMFServerState_T *state) {
-    int size_mem;
-    int size_max_childs;
-    int i;
+static SMFServerSlotMap_T slot_map[SLOT_MAP_SIZE];
+static int free_slots[CHILD_LIMIT];
+static int num_free_slots = 0;
 
-#ifdef HAVE_POSIX_SEMAPHORE
-    sem_unlink(SNAME);
-    state->sem_id = sem_open(SNAME, O_CREAT, S_IRUSR | S_IWUSR, 1);
-    if (state->sem_id == SEM_FAILED) {
-        TRACE(TRACE_DEBUG,"failed to open semaphore: %s", strerror(errno));
-        return -1;
-    }
+static unsigned int _smf_server_slot_hash(pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (SLOT_MAP_SIZE - 1);
+}
 
-#endif
-#ifdef HAVE_SYSV_SEMAPHORE    
-    union semun semun;
-    state->sem_key = ftok(".", 's');
-    state->sem_id = semget(state->sem_key, 1, IPC_CREAT | IPC_EXCL | 0600);
-    if (state->sem_id < 0) {
-        if (errno == EEXIST) {
-            if ((state->sem_id = semget(state->sem_key, 1, 0)) < 0) {
-                TRACE(TRACE_ERR,"failed to get semaphore: %s", strerror(errno));
-                return -1;
-            }
-            TRACE(TRACE_DEBUG,"reused semaphore: %d\n", state->sem_id);
-        } else {
-            TRACE(TRACE_ERR,"failed to create semaphore: %s", strerror(errno));
-            return -1;
-        }
-    } else
-        TRACE(TRACE_DEBUG,"created semaphore: %d\n", state->sem_id);
+static void _smf_server_slot_map_add(pid_t pid, int slot) {
+    unsigned int i = _smf_server_slot_hash(pid);
 
-    
-    semun.val = 1;
-    if (semctl(state->sem_id, 0, SETVAL, semun) < 0) {
-        TRACE(TRACE_DEBUG,"failed to initialize semaphore: %s", strerror(errno));
-        return -1;
-    }
-#endif
+    while (slot_map[i].pid != 0)
+        i = (i + 1) & (SLOT_MAP_SIZE - 1);
 
-    size_max_childs = 2 * (CHILD_LIMIT * sizeof(int));
-    size_mem = sizeof(SMFServerCounters_T) + size_max_childs;
+    slot_map[i].pid = pid;
+    slot_map[i].slot = slot;
+}
 
-#ifdef HAVE_POSIX_SEMAPHORE
-    shm_unlink(SHMOBJ_PATH);
-    state->shm_fd = shm_open(SHMOBJ_PATH, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG);
-    if (state->shm_fd < 0) {
-        TRACE(TRACE_ERR, "in shm_open(): %s",strerror(errno));
-        return -1;
+/* remove pid from the table and return its slot, -1 if unknown */
+static int _smf_server_slot_map_remove(pid_t pid) {
+    unsigned int i = _smf_server_slot_hash(pid);
+    unsigned int j, k;
+    int slot;
+
+    while (slot_map[i].pid != pid) {
+        if (slot_map[i].pid == 0)
+            return -1;
+        i = (i + 1) & (SLOT_MAP_SIZE - 1);
     }
 
-    TRACE(TRACE_DEBUG, "Created shared memory object %s %d", SHMOBJ_PATH, state->shm_fd);
-    /* adjusting mapped file size (make room for the whole segment to map) -- ftruncate() */
-    ftruncate(state->shm_fd, size_mem);
+    slot = slot_map[i].slot;
 
-    /* requesting the shared segment -- mmap() */
-    state->counters = (SMFServerCounters_T *)mmap(NULL, size_mem, PROT_READ | PROT_WRITE, MAP_SHARED, state->shm_fd, 0);
-    if (state->counters == NULL) {
-        TRACE(TRACE_ERR,"in mmap(): %s",strerror(errno));
-        return -1;
-    }
-#endif
-#ifdef HAVE_SYSV_SEMAPHORE
-    state->shm_key = ftok(".",'a');
-    state->shm_id = shmget(state->shm_key,size_mem,0600 | IPC_CREAT);
-    if (state->shm_id < 0) {
-        TRACE(TRACE_ERR,"failed to create shm segment: %s", strerror(errno));
-        return -1;
+    /* shift following entries back, so lookups never hit a hole */
+    j = i;
+    for (;;) {
+        j = (j + 1) & (SLOT_MAP_SIZE - 1);
+        if (slot_map[j].pid == 0)
+            break;
+        k = _smf_server_slot_hash(slot_map[j].pid);
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue;
+        slot_map[i] = slot_map[j];
+        i = j;
     }
+    slot_map[i].pid = 0;
 
-    
-    TRACE(TRACE_DEBUG,"created shm segment: %d",state->shm_id);
-    state->counters = (SMFServerCounters_T *)shmat(state->shm_id, (void *)0, 0);
-    if (state->counters == (void *)(-1)) {
-        TRACE(TRACE_ERR,"failed to attach shm segment: %s", strerror(errno));
+    return slot;
+}
+
+int _smf_server_init_ipc(SMFSettings_T *settings, SMFServerState_T *state) {
+    int i;
+
+    /* the scoreboard is only shared with our own childs, so an anonymous 
+     * mapping is sufficient */
+    state->counters = (SMFServerCounters_T *)mmap(NULL, sizeof(SMFServerCounters_T), 
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state->counters == MAP_FAILED) {
+        TRACE(TRACE_ERR,"failed to map scoreboard: %s",strerror(errno));
+        state->counters = NULL;
         return -1;
     }
-#endif
+
     state->counters->num_procs = 0;
     state->counters->num_spare = 0;
+    state->counters->accepts = 0;
     state->counters->max_childs = settings->max_childs;
-    
-    for (i=0; i < settings->max_childs; i++ ) {
-        state->counters->childs_active[i] = 0;
-        state->counters->childs[i] = 0;
+    state->counters->generation = 0;
+    state->slot = -1;
+
+    memset(slot_map, 0, sizeof(slot_map));
+    num_free_slots = 0;
+    /* max_childs may be raised by a reload, so all slots are available */
+    for (i = CHILD_LIMIT - 1; i >= 0; i--) {
+        state->counters->slots[i].pid = 0;
+        state->counters->slots[i].state = SMF_SLOT_FREE;
+        free_slots[num_free_slots++] = i;
     }
 
     return 0;
 }
 
-void _smf_server_sem_operation(int op, SMFServerState_T *state) {
-#ifdef HAVE_POSIX_SEMAPHORE 
-    if (op == SEM_LOCK)
-        sem_wait(state->sem_id);
-    else if (op == SEM_UNLOCK)
-        sem_post(state->sem_id);
-#endif
-#ifdef HAVE_SYSV_SEMAPHORE
-    int err_status;
-
-    semaphore.sem_op = op;
-    semaphore.sem_flg = 0;
-    semaphore.sem_num = 0;
-    
-    do {
-        err_status = semop(state->sem_id, &semaphore, 1);
-    } while (err_status < 0 && errno == EINTR);
+/* reserve a scoreboard slot for a new child, called by the parent */
+static int _smf_server_reserve_slot(SMFServerState_T *state) {
+    int slot;
 
-    if (err_status < 0) {
-        TRACE(TRACE_ERR, "semop failed: %s", strerror(errno));
-        exit (EXIT_FAILURE);
-    }
-#endif
-}
+    if (num_free_slots == 0)
+        return -1;
 
-/*
-SMFServerCounters_T *_smf_server_get_counters(int shm_id) {
-    SMFServerCounters_T *counters;
-    counters = (SMFServerCounters_T *)shmat(shm_id, (void *)0, 0);
-    if (counters == (void *)(-1)) {
-        TRACE(TRACE_ERR,"failed to attach shm segment: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    slot = free_slots[--num_free_slots];
+    state->counters->slots[slot].pid = 0;
+    state->counters->slots[slot].generation = state->counters->generation;
+    __atomic_store_n(&state->counters->slots[slot].state, SMF_SLOT_IDLE, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&state->counters->num_procs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->counters->num_spare, 1, __ATOMIC_RELAXED);
 
-    return counters;
+    return slot;
 }
 
-void _smf_server_detach_counters(SMFServerCounters_T *counters) {
-    if (shmdt(counters) == -1) {
-        TRACE(TRACE_ERR,"failed to detach shm segment: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-}
-*/
-void _smf_server_add_child(SMFServerState_T *state, pid_t pid) {
-    int i;
-    _smf_server_sem_operation(SEM_LOCK,state);
-
-    state->counters->num_procs++;
-    state->counters->num_spare++;
-    
-    for(i=0; i<state->counters->max_childs; i++ ) {
-        if (state->counters->childs[i] == 0) {
-            state->counters->childs[i] = pid;
-            break;
-        }
-    }
-
-    _smf_server_sem_operation(SEM_UNLOCK,state);
-}
+/* release the slot of a dead child, called by the parent */
+static void _smf_server_release_slot(SMFServerState_T *state, int slot) {
+    SMFServerSlot_T *s = &state->counters->slots[slot];
 
-void smf_server_decrement_spare(SMFServerState_T *state) {
-    _smf_server_sem_operation(SEM_LOCK,state);
+    /* an idle child exited, it no longer counts as spare */
+    if (__atomic_exchange_n(&s->state, SMF_SLOT_FREE, __ATOMIC_ACQ_REL) == SMF_SLOT_IDLE)
+        __atomic_sub_fetch(&state->counters->num_spare, 1, __ATOMIC_RELAXED);
 
-    state->counters->num_spare--;
-    
-    _smf_server_sem_operation(SEM_UNLOCK,state);
+    s->pid = 0;
+    __atomic_sub_fetch(&state->counters->num_procs, 1, __ATOMIC_RELAXED);
+    free_slots[num_free_slots++] = slot;
 }
 
-void smf_server_add_active(SMFServerState_T *state,int pid) {
-    int i;
-    _smf_server_sem_operation(SEM_LOCK,state);
+void _smf_server_remove_child(SMFServerState_T *state, pid_t pid) {
+    int slot;
 
-    for(i=0; i<state->counters->max_childs; i++ ) {
-        if (state->counters->childs_active[i] == 0) {
-            state->counters->childs_active[i] = pid;
-            break;
-        }
+    if ((slot = _smf_server_slot_map_remove(pid)) < 0) {
+        TRACE(TRACE_WARNING,"unknown child [%d] exited", pid);
+        return;
     }
 
-    _smf_server_sem_operation(SEM_UNLOCK,state);
-}
+    if (state->counters->slots[slot].state == SMF_SLOT_IDLE)
+        TRACE(TRACE_DEBUG,"spare child [%d] exited", pid);
 
-void _smf_server_remove_active(SMFServerState_T *state,int pid) {
-    int i;
-    int removed = -1;
-
-    _smf_server_sem_operation(SEM_LOCK,state);
-    state->counters->num_procs--;
-    for(i=0; i<state->counters->max_childs; i++ ) {
-        if (state->counters->childs_active[i] == pid) {
-            state->counters->childs_active[i] = 0;
-            removed = 1;
-            break;
-        }
-    }
+    _smf_server_release_slot(state,slot);
+}
 
-    for(i=0; i<state->counters->max_childs; i++ ) {
-        if (state->counters->childs[i] == pid) {
-            state->counters->childs[i] = 0;
-            break;
-        }
-    }
+void smf_server_set_state(SMFServerState_T *state, int slot_state) {
+    int old;
 
-    _smf_server_sem_operation(SEM_UNLOCK,state);
+    if ((state->slot < 0) || (state->counters == NULL))
+        return;
 
-    /* it seems we lost a spare child */
-    if (removed != 1) {
-        TRACE(TRACE_ERR,"lost spare child [%d]", pid);
-        smf_server_decrement_spare(state);
-    }
+    old = __atomic_exchange_n(&state->counters->slots[state->slot].state, slot_state, __ATOMIC_ACQ_REL);
+    
+    if ((old == SMF_SLOT_IDLE) && (slot_state != SMF_SLOT_IDLE))
+        __atomic_sub_fetch(&state->counters->num_spare, 1, __ATOMIC_RELAXED);
+    else if ((old != SMF_SLOT_IDLE) && (slot_state == SMF_SLOT_IDLE))
+        __atomic_add_fetch(&state->counters->num_spare, 1, __ATOMIC_RELAXED);
 }
 
 void smf_server_sig_handler(int sig) {
     /**
      * - SIGUSR1 => child got a new client
+     * - SIGUSR2 => start a new master with our listeners
+     * - SIGQUIT => stop gracefully, a new master took over
+     * - SIGHUP => reload the configuration
+     * - SIG_CULL => idle child should exit
      */
     switch(sig) {
         case SIGTERM:
         case SIGINT:
+        case SIG_CULL:
             daemon_exit = 1;
             break;
+        case SIGUSR2:
+            daemon_upgrade = 1;
+            break;
+        case SIGQUIT:
+            daemon_drain = 1;
+            break;
+        case SIGHUP:
+            daemon_reload = 1;
+            break;
         case SIGCHLD:
             break;
         default:
@@ -314,16 +276,29 @@ void smf_server_sig_init(void) {
         TRACE(TRACE_ERR,"sigaction (SIGCHLD) failed: %s",strerror(errno));
         exit(EXIT_FAILURE);
     }
+
+    if (sigaction(SIGUSR2, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGUSR2) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGQUIT, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGQUIT) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGHUP, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGHUP) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
-void smf_server_init(SMFSettings_T *settings, SMFServerState_T *state) {
+void smf_server_daemonize(SMFSettings_T *settings) {
     pid_t pid;
     FILE *pidfile;
     
     struct passwd *pwd = NULL;
     struct group *grp = NULL;
-   
-    smf_server_sig_init();
 
     /* switch to background */
     if (settings->foreground == 0) {        
@@ -402,32 +377,37 @@ void smf_server_init(SMFSettings_T *settings, SMFServerState_T *state) {
             exit(EXIT_FAILURE);
         }
     }
+}
+
+void smf_server_init(SMFSettings_T *settings, SMFServerState_T *state) {
+    smf_server_sig_init();
+    smf_server_daemonize(settings);
 
     if (_smf_server_init_ipc(settings,state) < 0) {
-        TRACE(TRACE_ERR, "failed to initialize semaphore");
+        TRACE(TRACE_ERR, "failed to initialize scoreboard");
         exit(EXIT_FAILURE);
     }
 }
 
-int smf_server_listen(SMFSettings_T *settings) {
+static int _smf_server_bind(SMFServerListener_T *listener, int reuseport) {
     int sd, reuseaddr;
     int status = -1;
     struct addrinfo hints, *ai, *aptr;
     char *srvname = NULL;
 
-    assert(settings);
+    assert(listener);
 
     memset(&hints,0,sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    if (asprintf(&srvname,"%d",settings->bind_port) == -1) {
+    if (asprintf(&srvname,"%d",listener->port) == -1) {
         TRACE(TRACE_ERR, "failed to set server name");
         return -1;
     }
 
-    if ((status == getaddrinfo(settings->bind_ip,srvname,&hints,&ai)) == 0) {
+    if ((status = getaddrinfo(listener->address,srvname,&hints,&ai)) == 0) {
         for (aptr = ai; aptr != NULL; aptr = aptr->ai_next) {
             if ((sd = socket(aptr->ai_family,aptr->ai_socktype, aptr->ai_protocol)) < 0)
                 continue;
@@ -435,8 +415,22 @@ int smf_server_listen(SMFSettings_T *settings) {
             reuseaddr = 1;
             setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int));
 
+            if (reuseport == 1) {
+#ifdef SO_REUSEPORT
+                if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr, sizeof(int)) < 0) {
+                    TRACE(TRACE_ERR,"failed to set SO_REUSEPORT: %s",strerror(errno));
+                    close(sd);
+                    continue;
+                }
+#else
+                TRACE(TRACE_ERR,"SO_REUSEPORT is not supported on this platform");
+                close(sd);
+                continue;
+#endif
+            }
+
             if (bind(sd,aptr->ai_addr,aptr->ai_addrlen) == 0) {
-                if (listen(sd, settings->listen_backlog) >= 0)
+                if (listen(sd, listener->backlog) >= 0)
                     break;
             }
             close(sd);
@@ -446,10 +440,12 @@ int smf_server_listen(SMFSettings_T *settings) {
 
         if (aptr == NULL) {
             TRACE(TRACE_ERR,"can't listen on port %s: %s", srvname, strerror(errno));
+            free(srvname);
             return -1;
         }
     } else {
         TRACE(TRACE_ERR,"getaddrinfo failed: %s",gai_strerror(status));
+        free(srvname);
         return -1;
     }
 
@@ -458,34 +454,546 @@ int smf_server_listen(SMFSettings_T *settings) {
     return sd;
 }
 
+static int _smf_server_bind_unix(SMFSettings_T *settings, SMFServerListener_T *listener) {
+    int sd;
+    struct sockaddr_un sun;
+    struct stat st;
+    struct passwd *pwd = NULL;
+    struct group *grp = NULL;
+
+    if (strlen(listener->path) >= sizeof(sun.sun_path)) {
+        TRACE(TRACE_ERR,"socket path %s too long",listener->path);
+        return -1;
+    }
+
+    memset(&sun,0,sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path,listener->path);
+
+    /* remove a stale socket of a previous run */
+    if ((lstat(listener->path,&st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(listener->path);
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        TRACE(TRACE_ERR,"failed to create socket: %s",strerror(errno));
+        return -1;
+    }
+
+    if ((bind(sd,(struct sockaddr *)&sun,sizeof(sun)) < 0) || (listen(sd, listener->backlog) < 0)) {
+        TRACE(TRACE_ERR,"can't listen on %s: %s",listener->path,strerror(errno));
+        close(sd);
+        return -1;
+    }
+
+    if (chmod(listener->path,listener->mode) < 0)
+        TRACE(TRACE_ERR,"failed to set permissions of %s: %s",listener->path,strerror(errno));
+
+    /* the socket has to be owned by the user we switch to later */
+    if ((settings->user != NULL) && (settings->group != NULL)) {
+        pwd = getpwnam(settings->user);
+        grp = getgrnam(settings->group);
+        if ((pwd != NULL) && (grp != NULL) && (chown(listener->path,pwd->pw_uid,grp->gr_gid) < 0))
+            TRACE(TRACE_ERR,"failed to change owner of %s: %s",listener->path,strerror(errno));
+    }
+
+    return sd;
+}
+
+static int _smf_server_listener_init(SMFSettings_T *settings, SMFServerListener_T *listener, char *name) {
+    char *group = NULL;
+    char *val = NULL;
+
+    memset(listener,0,sizeof(SMFServerListener_T));
+    listener->sd = -1;
+    listener->port = settings->bind_port;
+    listener->backlog = settings->listen_backlog;
+    listener->mode = 0660;
+    listener->max_size = -1;
+
+    if (name == NULL) {
+        if (settings->bind_ip != NULL)
+            listener->address = strdup(settings->bind_ip);
+        return 0;
+    }
+
+    if (asprintf(&group,"listener:%s",name) == -1) {
+        TRACE(TRACE_ERR,"failed to allocate listener section");
+        return -1;
+    }
+
+    listener->name = strdup(name);
+    if ((val = smf_settings_group_get(settings,group,"path")) != NULL)
+        listener->path = strdup(val);
+    if ((val = smf_settings_group_get(settings,group,"address")) != NULL)
+        listener->address = strdup(val);
+    else if (settings->bind_ip != NULL)
+        listener->address = strdup(settings->bind_ip);
+    if (smf_settings_group_get(settings,group,"port") != NULL)
+        listener->port = smf_settings_group_get_integer(settings,group,"port");
+    if (smf_settings_group_get(settings,group,"mode") != NULL)
+        listener->mode = smf_settings_group_get_integer(settings,group,"mode");
+    if (smf_settings_group_get(settings,group,"backlog") != NULL)
+        listener->backlog = smf_settings_group_get_integer(settings,group,"backlog");
+    if ((val = smf_settings_group_get(settings,group,"max_size")) != NULL)
+        listener->max_size = strtol(val,NULL,10);
+
+    free(group);
+    return 0;
+}
+
+/* read the listening sockets passed by an old master, the environment
+ * is cleared, so our own childs don't see it */
+static int _smf_server_inherited_fds(int **fds) {
+    char *env = NULL;
+    char *p = NULL;
+    char *next = NULL;
+    int num = 0;
+
+    if ((env = getenv(OLD_MASTER_ENV)) != NULL)
+        old_master = (pid_t)strtol(env,NULL,10);
+
+    if ((env = getenv(LISTEN_FDS_ENV)) == NULL) {
+        unsetenv(OLD_MASTER_ENV);
+        return 0;
+    }
+
+    if ((*fds = (int *)calloc(strlen(env) / 2 + 1, sizeof(int))) != NULL) {
+        p = env;
+        while (*p != '\0') {
+            (*fds)[num] = (int)strtol(p,&next,10);
+            if (next == p)
+                break;
+            num++;
+            p = (*next == ',') ? next + 1 : next;
+        }
+    }
+
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(OLD_MASTER_ENV);
+
+    TRACE(TRACE_DEBUG,"inherited %d listening sockets from master [%d]",num,old_master);
+    return num;
+}
+
+/* check, if an inherited socket is bound to the address of the listener */
+static int _smf_server_listener_match(SMFServerListener_T *listener, int sd) {
+    struct sockaddr_storage sa;
+    socklen_t slen = sizeof(sa);
+    struct addrinfo hints, *ai, *aptr;
+    char port[16];
+    int match = 0;
+
+    memset(&sa,0,sizeof(sa));
+    if (getsockname(sd,(struct sockaddr *)&sa,&slen) < 0)
+        return 0;
+
+    if (listener->path != NULL) {
+        return ((sa.ss_family == AF_UNIX) 
+            && (strcmp(((struct sockaddr_un *)&sa)->sun_path,listener->path) == 0));
+    } else if (sa.ss_family == AF_UNIX) {
+        return 0;
+    }
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port,sizeof(port),"%d",listener->port);
+
+    if (getaddrinfo(listener->address,port,&hints,&ai) != 0)
+        return 0;
+
+    for (aptr = ai; aptr != NULL; aptr = aptr->ai_next) {
+        if ((aptr->ai_addrlen == slen) && (memcmp(aptr->ai_addr,&sa,slen) == 0)) {
+            match = 1;
+            break;
+        }
+    }
+    freeaddrinfo(ai);
+
+    return match;
+}
+
+SMFServerListener_T *smf_server_listen(SMFSettings_T *settings, int *num_listeners) {
+    SMFServerListener_T *listeners = NULL;
+    SMFServerListener_T *l = NULL;
+    SMFListElem_T *elem = NULL;
+    int num, i, j;
+    int *fds = NULL;
+    int num_fds = 0;
+    int reuseport;
+
+    assert(settings);
+    assert(num_listeners);
+
+    /* childs bind their SO_REUSEPORT sockets after the user switch, 
+     * where privileged ports fail and the sockets of the parent belong 
+     * to another uid, so the shared socket is used instead */
+    if ((settings->accept_mode == SMF_ACCEPT_REUSEPORT) && (settings->user != NULL) && (settings->group != NULL)) {
+        TRACE(TRACE_WARNING,"accept_mode reuseport is not supported with user and group, using herd");
+        settings->accept_mode = SMF_ACCEPT_HERD;
+    }
+    reuseport = (settings->accept_mode == SMF_ACCEPT_REUSEPORT) ? 1 : 0;
+
+    /* without listener sections, fall back to bind_ip/bind_port */
+    num = smf_list_size(settings->listeners);
+    if ((listeners = (SMFServerListener_T *)calloc((num > 0) ? num : 1, sizeof(SMFServerListener_T))) == NULL) {
+        TRACE(TRACE_ERR,"failed to allocate listeners");
+        return NULL;
+    }
+
+    if (num == 0) {
+        _smf_server_listener_init(settings,&listeners[0],NULL);
+        num = 1;
+    } else {
+        i = 0;
+        elem = smf_list_head(settings->listeners);
+        while (elem != NULL) {
+            if (_smf_server_listener_init(settings,&listeners[i],(char *)smf_list_data(elem)) != 0) {
+                smf_server_listeners_free(listeners,i);
+                return NULL;
+            }
+            i++;
+            elem = elem->next;
+        }
+    }
+
+    num_fds = _smf_server_inherited_fds(&fds);
+
+    for (i = 0; i < num; i++) {
+        l = &listeners[i];
+
+        /* take over the socket of the old master, if it still matches */
+        for (j = 0; j < num_fds; j++) {
+            if ((fds[j] >= 0) && _smf_server_listener_match(l,fds[j])) {
+                l->sd = fds[j];
+                fds[j] = -1;
+                break;
+            }
+        }
+
+        if (l->sd >= 0) {
+            TRACE(TRACE_NOTICE,"using inherited socket for %s",l->path ? l->path : (l->address ? l->address : "*"));
+        } else if (l->path != NULL) {
+            TRACE(TRACE_NOTICE,"binding to %s",l->path);
+            l->sd = _smf_server_bind_unix(settings,l);
+        } else {
+            TRACE(TRACE_NOTICE,"binding to %s:%d",l->address ? l->address : "*",l->port);
+            l->sd = _smf_server_bind(l,reuseport);
+        }
+
+        if (l->sd < 0) {
+            smf_server_listeners_free(listeners,num);
+            free(fds);
+            return NULL;
+        }
+
+        /* childs wait for the listeners before accept(), another child 
+         * may take a connection first */
+        if (fcntl(l->sd, F_SETFL, fcntl(l->sd, F_GETFL) | O_NONBLOCK) < 0) {
+            TRACE(TRACE_ERR,"failed to set listening socket non-blocking: %s",strerror(errno));
+            smf_server_listeners_free(listeners,num);
+            free(fds);
+            return NULL;
+        }
+    }
+
+    /* sockets of listeners, which are no longer configured */
+    for (j = 0; j < num_fds; j++)
+        if (fds[j] >= 0)
+            close(fds[j]);
+    free(fds);
+
+    *num_listeners = num;
+    return listeners;
+}
+
+pid_t smf_server_upgrade(SMFServerListener_T *listeners, int num_listeners) {
+    char **argv = smf_internal_get_argv();
+    char *fds = NULL;
+    char *tmp = NULL;
+    char master[32];
+    sigset_t mask;
+    pid_t pid;
+    int i;
+
+    if ((argv == NULL) || (argv[0] == NULL)) {
+        TRACE(TRACE_ERR,"command line unknown, can't start a new master");
+        return 0;
+    }
+
+    for (i = 0; i < num_listeners; i++) {
+        if (listeners[i].sd < 0)
+            continue;
+
+        if (asprintf(&tmp,"%s%s%d",fds ? fds : "",fds ? "," : "",listeners[i].sd) == -1) {
+            free(fds);
+            return 0;
+        }
+        free(fds);
+        fds = tmp;
+    }
+
+    switch(pid = fork()) {
+        case -1:
+            TRACE(TRACE_ERR,"fork() failed: %s",strerror(errno));
+            pid = 0;
+            break;
+        case 0:
+            /* the signal mask survives execve() */
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+
+            for (i = 0; i < num_listeners; i++)
+                if (listeners[i].sd >= 0)
+                    fcntl(listeners[i].sd, F_SETFD, 0);
+
+            snprintf(master,sizeof(master),"%d",getppid());
+            if (fds != NULL)
+                setenv(LISTEN_FDS_ENV,fds,1);
+            setenv(OLD_MASTER_ENV,master,1);
+
+            execvp(argv[0],argv);
+            TRACE(TRACE_ERR,"failed to execute %s: %s",argv[0],strerror(errno));
+            _exit(EXIT_FAILURE);
+            break;
+        default:
+            TRACE(TRACE_NOTICE,"started new master [%d] with listening sockets %s",pid,fds ? fds : "none");
+            break;
+    }
+
+    free(fds);
+    return pid;
+}
+
+void smf_server_upgrade_done(void) {
+    if (old_master <= 0)
+        return;
+
+    TRACE(TRACE_NOTICE,"asking old master [%d] to stop",old_master);
+    if (kill(old_master,SIGQUIT) < 0)
+        TRACE(TRACE_ERR,"failed to signal old master [%d]: %s",old_master,strerror(errno));
+    old_master = 0;
+}
+
+void smf_server_listeners_close(SMFServerListener_T *listeners, int num_listeners) {
+    int i;
+
+    for (i = 0; i < num_listeners; i++) {
+        if (listeners[i].sd >= 0) {
+            close(listeners[i].sd);
+            listeners[i].sd = -1;
+        }
+    }
+}
+
+void smf_server_listeners_free(SMFServerListener_T *listeners, int num_listeners) {
+    int i;
+
+    if (listeners == NULL)
+        return;
+
+    for (i = 0; i < num_listeners; i++) {
+        if (listeners[i].sd >= 0) {
+            close(listeners[i].sd);
+            if (listeners[i].path != NULL)
+                unlink(listeners[i].path);
+        }
+        free(listeners[i].name);
+        free(listeners[i].address);
+        free(listeners[i].path);
+    }
+    free(listeners);
+}
+
+unsigned long smf_server_get_max_size(SMFSettings_T *settings, SMFServerListener_T *listener) {
+    if ((listener != NULL) && (listener->max_size >= 0))
+        return (unsigned long)listener->max_size;
+
+    return settings->max_size;
+}
+
+char *smf_server_peer_name(int sd, char *buf, size_t size) {
+    struct sockaddr_storage sa;
+    socklen_t slen = sizeof(sa);
+
+    if (getpeername(sd, (struct sockaddr *)&sa, &slen) == -1) {
+        TRACE(TRACE_ERR,"getpeername() failed: %s",strerror(errno));
+        return NULL;
+    }
+
+    if (sa.ss_family == AF_UNIX) {
+        snprintf(buf,size,"unix socket");
+        return buf;
+    }
+
+    if (getnameinfo((struct sockaddr *)&sa, slen, buf, size, NULL, 0, NI_NUMERICHOST) != 0)
+        return NULL;
+
+    return buf;
+}
+
 void smf_server_fork(SMFSettings_T *settings, SMFServerState_T *state,
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerState_T *state)) {
     pid_t pid;
+    int slot;
+    sigset_t mask;
+
+    /* the slot is taken before fork(), so the child knows it right away */
+    if ((slot = _smf_server_reserve_slot(state)) < 0) {
+        TRACE(TRACE_WARNING,"no free scoreboard slot left");
+        return;
+    }
 
     switch(pid = fork()) {
         case -1:
             TRACE(TRACE_ERR,"fork() failed: %s",strerror(errno));
+            _smf_server_release_slot(state,slot);
             break;
         case 0:
+            /* the parent blocks its signals outside of pselect() */
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            state->slot = slot;
+            state->counters->slots[slot].pid = getpid();
+
+            if (smf_modules_child_init(settings) != 0) {
+                smf_settings_free(settings);
+                exit(EXIT_FAILURE);
+            }
+
             smf_server_accept_handler(settings,state,handle_client_func);
             
+            smf_modules_fini(settings);
+            smf_settings_free(settings);
             exit(EXIT_SUCCESS); /* quit child process */
             break;
         default: /* parent process: go on with accept */
             TRACE(TRACE_DEBUG,"forked child [%d]",pid);
+            state->counters->slots[slot].pid = pid;
+            _smf_server_slot_map_add(pid,slot);
             break;
     }
+}
+
+int smf_server_reload(SMFSettings_T *settings) {
+    SMFSettings_T *new_settings = NULL;
+    SMFSettings_T tmp;
+
+    TRACE(TRACE_NOTICE,"reloading configuration %s",settings->config_file);
+
+    if ((new_settings = smf_settings_new()) == NULL) {
+        TRACE(TRACE_ERR,"failed to allocate settings");
+        return -1;
+    }
+
+    if (smf_settings_parse_config(&new_settings,settings->config_file) != 0) {
+        TRACE(TRACE_ERR,"failed to reload configuration, keeping the old one");
+        smf_settings_free(new_settings);
+        return -1;
+    }
+
+    /* keep the command line flag and the persistent lookup connection */
+    new_settings->debug = (new_settings->debug || settings->debug);
+    new_settings->lookup_connection = settings->lookup_connection;
+    new_settings->lookup_connection_type = settings->lookup_connection_type;
+    settings->lookup_connection = NULL;
+
+    /* sockets, user and engine are set up once, they need a restart */
+    new_settings->accept_mode = settings->accept_mode;
+    if (((settings->engine != NULL) && (strcmp(settings->engine,new_settings->engine) != 0))
+            || (smf_list_size(settings->listeners) != smf_list_size(new_settings->listeners))
+            || (settings->bind_port != new_settings->bind_port))
+        TRACE(TRACE_WARNING,"changed engine or listeners are applied on the next restart (SIGUSR2)");
+
+    /* module state of the old configuration is released, before
+     * the new one is set up, they may share the same libraries */
+    smf_modules_fini(settings);
+    if (smf_modules_init(new_settings) != 0) {
+        TRACE(TRACE_ERR,"failed to initialize modules, keeping the old configuration");
+        settings->lookup_connection = new_settings->lookup_connection;
+        new_settings->lookup_connection = NULL;
+        smf_settings_free(new_settings);
+        if (smf_modules_init(settings) != 0)
+            TRACE(TRACE_ERR,"failed to initialize modules of the old configuration");
+        return -1;
+    }
+
+    /* swap the contents, the caller keeps its pointer */
+    tmp = *settings;
+    *settings = *new_settings;
+    *new_settings = tmp;
+    smf_settings_free(new_settings);
+
+    smf_settings_log(settings);
+
+    return 0;
+}
+
+/* let all childs of older generations exit, idle ones leave right 
+ * away, busy ones after their current session */
+static void _smf_server_retire_childs(SMFServerState_T *state) {
+    int i;
+    SMFServerSlot_T *slot;
+
+    for (i = 0; i < CHILD_LIMIT; i++) {
+        slot = &state->counters->slots[i];
+        if ((slot->pid > 0) && (slot->generation != state->counters->generation))
+            kill(slot->pid, SIG_CULL);
+    }
+}
+
+/* stop one idle child, the one with the highest slot is taken, so 
+ * the low slots stay in use */
+static void _smf_server_cull_child(SMFSettings_T *settings, SMFServerState_T *state) {
+    int i;
+    SMFServerSlot_T *slot;
 
-    _smf_server_add_child(state,pid);
+    for (i = CHILD_LIMIT - 1; i >= 0; i--) {
+        slot = &state->counters->slots[i];
+        if ((slot->pid > 0) && (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SMF_SLOT_IDLE)) {
+            TRACE(TRACE_DEBUG,"stopping idle child [%d]",slot->pid);
+            kill(slot->pid, SIG_CULL);
+            break;
+        }
+    }
 }
 
 void smf_server_loop(SMFSettings_T *settings, SMFServerState_T *state,
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerState_T *state)) {
-    int i, status;
+    int i, status, num_spare, min_spare, num_fork;
+    int spawn_rate = 1;
+    pid_t upgrade_pid = 0;
+    unsigned long accepts, last_accepts = 0;
+    time_t now, last_tick, last_spawn = 0;
     pid_t pid;
+    sigset_t block_mask, orig_mask;
+    struct timespec tick;
     
     TRACE(TRACE_NOTICE, "starting spmfilter daemon");
-    TRACE(TRACE_NOTICE,"binding to %s:%d",settings->bind_ip,settings->bind_port);
+
+    /* with SO_REUSEPORT every child opens its own tcp sockets, the parent's 
+     * sockets were only used to check the addresses, they must not stay open, 
+     * since the kernel would queue connections on them, too. */
+    if (settings->accept_mode == SMF_ACCEPT_REUSEPORT) {
+        for (i = 0; i < state->num_listeners; i++) {
+            if (state->listeners[i].path == NULL) {
+                close(state->listeners[i].sd);
+                state->listeners[i].sd = -1;
+            }
+        }
+    }
+
+    /* signals are only delivered while we wait in pselect() */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGCHLD);
+    sigaddset(&block_mask, SIGUSR1);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGUSR2);
+    sigaddset(&block_mask, SIGQUIT);
+    sigaddset(&block_mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &block_mask, &orig_mask);
 
     /* prefork min. 1 child(s) */
     if(settings->spare_childs == 0) {
@@ -496,85 +1004,308 @@ void smf_server_loop(SMFSettings_T *settings, SMFServerState_T *state,
         }
     }
 
+    /* our childs are running, the old master may stop now */
+    smf_server_upgrade_done();
+
+    min_spare = settings->spare_childs;
+    last_tick = time(NULL);
+
+    /* we wake up once per second, whenever a child accepted a new 
+     * connection (SIGUSR1) and whenever a child exits (SIGCHLD) */
     for (;;) {
-        pid = waitpid(-1, &status, 0);
+        tick.tv_sec = 1;
+        tick.tv_nsec = 0;
+        pselect(0, NULL, NULL, NULL, &tick, &orig_mask);
 
-        if (daemon_exit == 1)
+        if ((daemon_exit == 1) || (daemon_drain == 1))
             break;
-        if (pid > 0) {
-            _smf_server_remove_active(state,pid);
+
+        if (daemon_upgrade == 1) {
+            daemon_upgrade = 0;
+            if (upgrade_pid > 0)
+                TRACE(TRACE_WARNING,"new master [%d] is still starting",upgrade_pid);
+            else
+                upgrade_pid = smf_server_upgrade(state->listeners,state->num_listeners);
+        }
+
+        if (daemon_reload == 1) {
+            daemon_reload = 0;
+            if (smf_server_reload(settings) == 0) {
+                state->counters->max_childs = settings->max_childs;
+                state->counters->generation++;
+                _smf_server_retire_childs(state);
+
+                /* start spare childs with the new configuration right 
+                 * away, the retired ones leave the pool by themselves */
+                for (i = 0; (i < settings->spare_childs) && (state->counters->num_procs < settings->max_childs); i++)
+                    smf_server_fork(settings,state,handle_client_func);
+            }
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (pid == upgrade_pid) {
+                if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                    TRACE(TRACE_ERR,"new master [%d] failed to start",pid);
+                upgrade_pid = 0;
+                continue;
+            }
+
+            if (WIFSIGNALED(status))
+                TRACE(TRACE_ERR,"child [%d] terminated by signal %d",pid,WTERMSIG(status));
+            _smf_server_remove_child(state,pid);
+        }
+
+        now = time(NULL);
+        num_spare = __atomic_load_n(&state->counters->num_spare, __ATOMIC_RELAXED);
+
+        if (now != last_tick) {
+            /* keep as many childs idle, as connections arrived during 
+             * the last second, within spare_childs and max_spare_childs */
+            accepts = __atomic_load_n(&state->counters->accepts, __ATOMIC_RELAXED);
+            min_spare = (int)((accepts - last_accepts) / (now - last_tick));
+            if (min_spare < settings->spare_childs)
+                min_spare = settings->spare_childs;
+            if (min_spare >= settings->max_spare_childs)
+                min_spare = settings->max_spare_childs - 1;
+            last_accepts = accepts;
+            last_tick = now;
+
+            /* stop one idle child per second */
+            if (num_spare > settings->max_spare_childs)
+                _smf_server_cull_child(settings,state);
+        }
+
+        if (num_spare >= min_spare) {
+            spawn_rate = 1;
+            continue;
         }
 
-        
-        while(state->counters->num_procs < settings->max_childs) {
+        /* fork at most spawn_rate childs per second, the rate is doubled 
+         * every second, as long as we are short of spare childs */
+        if (now == last_spawn)
+            continue;
+
+        num_fork = min_spare - num_spare;
+        if (num_fork > spawn_rate)
+            num_fork = spawn_rate;
+        if (num_fork > settings->max_childs - state->counters->num_procs)
+            num_fork = settings->max_childs - state->counters->num_procs;
 
-            if ((state->counters->num_spare < settings->spare_childs) || (state->counters->num_procs < state->counters->num_spare)) {
+        if (num_fork > 0) {
+            TRACE(TRACE_DEBUG,"%d spare childs, forking %d new childs",num_spare,num_fork);
+            for (i = 0; i < num_fork; i++)
                 smf_server_fork(settings,state,handle_client_func);
-            } else
-              break;
-        }      
+            last_spawn = now;
+            if (spawn_rate < MAX_SPAWN_RATE)
+                spawn_rate *= 2;
+        }
+    }
+
+    if (daemon_drain == 1) {
+        /* the new master owns the listeners now, so unix sockets must 
+         * not be removed. Our childs finish their sessions, then exit. */
+        TRACE(TRACE_NOTICE, "stopping spmfilter daemon, waiting for active sessions");
+        smf_server_listeners_close(state->listeners,state->num_listeners);
 
+        for (i = 0; i < CHILD_LIMIT; i++)
+            if (state->counters->slots[i].pid > 0)
+                kill(state->counters->slots[i].pid,SIG_CULL);
+    } else {
+        TRACE(TRACE_NOTICE, "stopping spmfilter daemon");
+
+        for (i = 0; i < CHILD_LIMIT; i++)
+            if (state->counters->slots[i].pid > 0)
+                kill(state->counters->slots[i].pid,SIGTERM);
     }
+    smf_server_listeners_free(state->listeners,state->num_listeners);
 
-    TRACE(TRACE_NOTICE, "stopping spmfilter daemon");
-    close(state->sd);
+    /* a new master started in foreground is our child, too */
+    while (state->counters->num_procs > 0) {
+        if ((pid = wait(NULL)) < 0)
+            break;
+        if (pid != upgrade_pid)
+            _smf_server_remove_child(state,pid);
+    }
 
-    for (i = 0; i < settings->max_childs; i++)
-        if (state->counters->childs[i] > 0) {
-            kill(state->counters->childs[i],SIGTERM);
-        }
-    while(wait(NULL) > 0)
-        ;
+    munmap(state->counters, sizeof(SMFServerCounters_T));
+    free(state->q);
+    free(state);
+
+    /* the pid file belongs to the new master */
+    if (daemon_drain == 0)
+        unlink(settings->pid_file);
+}
 
-#ifdef HAVE_POSIX_SEMAPHORE
-    if (sem_close(state->sem_id) < 0) {
-        TRACE(TRACE_ERR,"sem_close failed: %s",strerror(errno));
+#ifdef HAVE_EPOLL
+/* register the shared listening sockets with EPOLLEXCLUSIVE, so only
+ * one waiting child is woken up per connection */
+static int _smf_server_exclusive_init(SMFServerState_T *state) {
+#ifdef EPOLLEXCLUSIVE
+    struct epoll_event ev;
+    int epfd, i, sd;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        TRACE(TRACE_ERR,"epoll_create failed: %s",strerror(errno));
+        return -1;
     }
 
-    if (sem_unlink(SNAME) < 0) {
-        TRACE(TRACE_ERR,"sem_unlink failed: %s",strerror(errno));
+    for (i = 0; i < state->num_listeners; i++) {
+        sd = state->listeners[i].sd;
+        memset(&ev,0,sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+            TRACE(TRACE_WARNING,"EPOLLEXCLUSIVE not supported, falling back to accept(): %s",strerror(errno));
+            close(epfd);
+            return -1;
+        }
+
+        /* another child may take the connection first */
+        if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0) {
+            TRACE(TRACE_ERR,"failed to set listening socket non-blocking: %s",strerror(errno));
+            close(epfd);
+            return -1;
+        }
     }
-    
-    if (shm_unlink(SHMOBJ_PATH) < 0) {
-        TRACE(TRACE_ERR,"shm_unlink failed: %s",strerror(errno));
+
+    return epfd;
+#else
+    TRACE(TRACE_WARNING,"EPOLLEXCLUSIVE not supported, falling back to accept()");
+    return -1;
+#endif
+}
+#endif
+
+/* wait until one of the listeners has a pending connection and return 
+ * its index, -1 if we got interrupted. Signals are only delivered with 
+ * wait_mask while we wait */
+static int _smf_server_wait(SMFServerState_T *state, int epfd, const sigset_t *wait_mask) {
+    static int next = 0;
+    struct pollfd pfd[state->num_listeners];
+    int i, n;
+#ifdef HAVE_EPOLL
+    struct epoll_event ev;
+
+    if (epfd >= 0) {
+        if (epoll_pwait(epfd, &ev, 1, -1, wait_mask) < 1)
+            return -1;
+        return ev.data.u32;
     }
 #endif
-#ifdef HAVE_SYSV_SEMAPHORE
-    if (semctl(state->sem_id, 0, IPC_RMID) < 0) {
-        TRACE(TRACE_ERR,"failed to remove semaphore id %d: %s",state->sem_id,strerror(errno));
+
+    for (i = 0; i < state->num_listeners; i++) {
+        pfd[i].fd = state->listeners[i].sd;
+        pfd[i].events = POLLIN;
+        pfd[i].revents = 0;
     }
 
-    shmctl(state->shm_id, IPC_RMID, NULL);
-#endif
-    free(state->q);
-    free(state);
+    if (ppoll(pfd, state->num_listeners, NULL, wait_mask) < 1)
+        return -1;
 
-    unlink(settings->pid_file);
+    /* start with the listener after the last one served, so a busy 
+     * listener can't starve the others */
+    for (i = 0; i < state->num_listeners; i++) {
+        n = (next + i) % state->num_listeners;
+        if (pfd[n].revents & POLLIN) {
+            next = n + 1;
+            return n;
+        }
+    }
+
+    return -1;
 }
 
 void smf_server_accept_handler(SMFSettings_T *settings, SMFServerState_T *state, 
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerState_T *state)) {
-    int client;
+    int client, i, sd;
+    int requests = 0;
+    int epfd = -1;
     socklen_t slen;
     struct sockaddr_storage sa;
+    struct sigaction action;
+    sigset_t cull_mask, wait_mask;
+
+    if (settings->accept_mode == SMF_ACCEPT_REUSEPORT) {
+        for (i = 0; i < state->num_listeners; i++) {
+            if (state->listeners[i].path != NULL)
+                continue;
+
+            if ((sd = _smf_server_bind(&state->listeners[i],1)) < 0) {
+                TRACE(TRACE_ERR,"child [%d] failed to open listening socket",getpid());
+                return;
+            }
+            if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0)
+                TRACE(TRACE_ERR,"failed to set listening socket non-blocking: %s",strerror(errno));
+            state->listeners[i].sd = sd;
+        }
+    }
+#ifdef HAVE_EPOLL
+    else if (settings->accept_mode == SMF_ACCEPT_EXCLUSIVE) {
+        epfd = _smf_server_exclusive_init(state);
+    }
+#endif
 
-    /* process incoming connection in an infinite loop */
+    /* SIG_CULL and SIGTERM are only accepted while we are waiting for 
+     * a connection, a running session is never interrupted by SIG_CULL 
+     * and handles SIGTERM itself */
+    sigemptyset(&cull_mask);
+    sigaddset(&cull_mask, SIG_CULL);
+    sigaddset(&cull_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &cull_mask, &wait_mask);
+    sigdelset(&wait_mask, SIG_CULL);
+    sigdelset(&wait_mask, SIGTERM);
+
+    action.sa_handler = smf_server_sig_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    if (sigaction(SIG_CULL, &action, NULL) < 0)
+        TRACE(TRACE_ERR,"sigaction (SIG_CULL) failed: %s",strerror(errno));
+
+    /* process incoming connections until we reach max_requests_per_child */
     for (;;) {
-        slen = sizeof(sa);
+        if (daemon_exit)
+            break;
+
+        if ((i = _smf_server_wait(state,epfd,&wait_mask)) < 0)
+            continue;
+
+        /* SIG_CULL may have arrived together with the connection */
+        if (daemon_exit)
+            break;
 
         /* accept new connection */
-        if ((client = accept(state->sd, (struct sockaddr *)&sa, &slen)) < 0) {
-            if (daemon_exit)
-                break;
+        slen = sizeof(sa);
+        client = accept(state->listeners[i].sd, (struct sockaddr *)&sa, &slen);
 
-            if (errno != EINTR) {
+        if (client < 0) {
+            if ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
                 TRACE(TRACE_ERR,"accept failed: %s",strerror(errno));
             }
             continue;
         }
+
+        state->listener = &state->listeners[i];
+        smf_server_set_state(state,SMF_SLOT_READING);
+        __atomic_add_fetch(&state->counters->accepts, 1, __ATOMIC_RELAXED);
+
+        /* send signal to parent that we've got a new client */
+        kill(getppid(),SIGUSR1);
+
         handle_client_func(settings,client,state);
         close(client);
+        state->listener = NULL;
+
+        requests++;
+        if ((settings->max_requests_per_child > 0) && (requests >= settings->max_requests_per_child)) {
+            TRACE(TRACE_DEBUG,"child [%d] handled %d connections, exiting",getpid(),requests);
+            break;
+        }
+
+        smf_server_set_state(state,SMF_SLOT_IDLE);
     }
 
-}
+    if (epfd >= 0)
+        close(epfd);
 
+    smf_server_listeners_close(state->listeners,state->num_listeners);
+}
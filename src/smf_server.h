@@ -22,32 +22,48 @@
 #include "smf_modules.h"
 #include "spmfilter_config.h"
 
-#ifdef HAVE_POSIX_SEMAPHORE
-#include <semaphore.h>
-#define SHMOBJ_PATH "/shmspmfilter"
-#define SNAME "/spmfilter"
-#endif
+#include <sys/types.h>
 
+/* scoreboard slot states */
+#define SMF_SLOT_FREE 0 /* slot not used */
+#define SMF_SLOT_IDLE 1 /* child is waiting in accept() */
+#define SMF_SLOT_READING 2 /* child is reading smtp commands */
+#define SMF_SLOT_PROCESSING 3 /* child is running the module queue */
+
+typedef struct {
+  pid_t pid; /**< pid of the child, written by the parent only */
+  int state; /**< one of SMF_SLOT_*, written by the child */
+  int generation; /**< configuration generation the child was forked with */
+} SMFServerSlot_T;
+
+/* scoreboard, shared between the parent and all childs. Every child
+ * owns one slot, which is handed out by the parent before fork(), the 
+ * counters are only modified with atomic operations. */
 typedef struct {
   int num_procs;
   int num_spare;
   int max_childs;
-  int childs_active[CHILD_LIMIT];
-  int childs[CHILD_LIMIT];
+  unsigned long accepts; /**< connections accepted by all childs */
+  int generation; /**< incremented with every configuration reload */
+  SMFServerSlot_T slots[CHILD_LIMIT];
 } SMFServerCounters_T;
 
 typedef struct {
-#ifdef HAVE_POSIX_SEMAPHORE
-  sem_t *sem_id;
-  int shm_fd;
-#endif
-#ifdef HAVE_SYSV_SEMAPHORE
-  int sem_id;
-  int shm_id;
-  key_t sem_key;
-  key_t shm_key;
-#endif
-  int sd;
+  char *name; /**< name of the listener section, NULL for bind_ip/bind_port */
+  char *address; /**< address to bind to */
+  int port; /**< tcp port to bind to */
+  char *path; /**< path of a unix socket, NULL for tcp listeners */
+  int mode; /**< permissions of the unix socket */
+  int backlog; /**< listen queue backlog */
+  long max_size; /**< message size limit, -1 uses the global max_size */
+  int sd; /**< listening socket, -1 if closed */
+} SMFServerListener_T;
+
+typedef struct {
+  SMFServerListener_T *listeners; /**< all listening sockets */
+  int num_listeners;
+  SMFServerListener_T *listener; /**< listener of the current connection */
+  int slot; /**< scoreboard slot of the child, -1 in the parent */
   SMFProcessQueue_T *q;
   SMFServerCounters_T *counters;
 } SMFServerState_T;
@@ -57,8 +73,16 @@ typedef void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerS
 void smf_server_sig_init(void);
 void smf_server_sig_handler(int sig);
 
+void smf_server_daemonize(SMFSettings_T *settings);
 void smf_server_init(SMFSettings_T *settings, SMFServerState_T *state);
-int smf_server_listen(SMFSettings_T *settings);
+SMFServerListener_T *smf_server_listen(SMFSettings_T *settings, int *num_listeners);
+void smf_server_listeners_close(SMFServerListener_T *listeners, int num_listeners);
+void smf_server_listeners_free(SMFServerListener_T *listeners, int num_listeners);
+unsigned long smf_server_get_max_size(SMFSettings_T *settings, SMFServerListener_T *listener);
+char *smf_server_peer_name(int sd, char *buf, size_t size);
+pid_t smf_server_upgrade(SMFServerListener_T *listeners, int num_listeners);
+void smf_server_upgrade_done(void);
+int smf_server_reload(SMFSettings_T *settings);
 
 void smf_server_fork(SMFSettings_T *settings, SMFServerState_T *state,
     void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerState_T *state));
@@ -71,8 +95,7 @@ void smf_server_accept_handler(
     SMFServerState_T *state,
     void (*handle_client_func)(SMFSettings_T *settings,int client,SMFServerState_T *state));
 
-void smf_server_decrement_spare(SMFServerState_T *state);
-void smf_server_add_active(SMFServerState_T *state, int pid);
+void smf_server_set_state(SMFServerState_T *state, int slot_state);
 
 #endif  /* _SMF_SERVER_H */
 
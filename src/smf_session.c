@@ -18,6 +18,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "smf_envelope.h"
 #include "smf_trace.h"
@@ -39,9 +40,13 @@ SMFSession_T *smf_session_new(void) {
 
     session->helo = NULL;
     session->xforward_addr = NULL;
+    session->listener = NULL;
     session->message_file = NULL;
     session->message_size = 0;
     session->response_msg = NULL;
+    session->body_dirty = 0;
+    session->header_file = NULL;
+    session->body_offset = 0;
     session->envelope = smf_envelope_new();
     session->id = smf_internal_generate_sid();
     TRACE(TRACE_INFO,"start new session SID %s",session->id);
@@ -60,9 +65,18 @@ void smf_session_free(SMFSession_T *session) {
 
     if (session->message_file != NULL)    
         free(session->message_file);  
+
+    /* normally removed by smf_internal_spool_remove() already */
+    if (session->header_file != NULL) {
+        unlink(session->header_file);
+        free(session->header_file);
+    }
     
     if (session->xforward_addr!=NULL)
         free(session->xforward_addr);
+
+    if (session->listener!=NULL)
+        free(session->listener);
     
     if (session->response_msg!=NULL)
         free(session->response_msg);
@@ -131,6 +145,23 @@ char *smf_session_get_xforward_addr(SMFSession_T *session) {
     return session->xforward_addr;
 }
 
+void smf_session_set_listener(SMFSession_T *session, char *name) {
+    assert(session);
+    assert(name);
+
+    if (session->listener != NULL) {
+        free(session->listener);
+    }
+
+    session->listener = strdup(name);
+}
+
+char *smf_session_get_listener(SMFSession_T *session) {
+    assert(session);
+
+    return session->listener;
+}
+
 void smf_session_set_response_msg(SMFSession_T *session, char *rmsg) {
     assert(session);
     assert(rmsg);
@@ -154,6 +185,16 @@ SMFEnvelope_T *smf_session_get_envelope(SMFSession_T *session) {
     return session->envelope;
 }
 
+void smf_session_mark_body_dirty(SMFSession_T *session) {
+    assert(session);
+    session->body_dirty = 1;
+}
+
+int smf_session_is_body_dirty(SMFSession_T *session) {
+    assert(session);
+    return session->body_dirty;
+}
+
 char *smf_session_get_id(SMFSession_T *session) {
     assert(session);
 
@@ -26,12 +26,16 @@
  * @details If a header of a session object has been modified, the session will 
  *          be marked as "dirty" - that means the header will be flushed to disk 
  *          before the final delivery is initialized, to keep the message in sync 
- *          with the modified data.
+ *          with the modified data. Only the header block is written, to a 
+ *          separate header file, the body stays in the message file and is 
+ *          appended during delivery.
  */
 
 #ifndef _SMF_SESSION_H
 #define _SMF_SESSION_H
 
+#include <sys/types.h>
+
 #include "smf_envelope.h"
 #include "smf_list.h"
 #include "smf_dict.h"
@@ -55,6 +59,10 @@ typedef struct {
   int sock; /**< socket */
   char *id; /**< session id **/
   SMFList_T *local_users; /**< list with local user data */
+  int body_dirty; /**< message file has been rewritten by a module */
+  char *header_file; /**< flushed header block, replaces the headers of message_file */
+  off_t body_offset; /**< start of the body in message_file, if header_file is set */
+  char *listener; /**< name of the listener, which accepted the connection */
 } SMFSession_T;
 
 /*!
@@ -103,6 +111,22 @@ void smf_session_set_xforward_addr(SMFSession_T *session, char *xfwd);
  */
 char *smf_session_get_xforward_addr(SMFSession_T *session);
 
+/*!
+ * @fn void smf_session_set_listener(SMFSession_T *session, char *name)
+ * @brief Set the name of the listener, which accepted the connection
+ * @param session SMFSession_T object
+ * @param name listener name
+ */
+void smf_session_set_listener(SMFSession_T *session, char *name);
+
+/*!
+ * @fn char *smf_session_get_listener(SMFSession_T *session)
+ * @brief Get listener name
+ * @param session SMFSession_T object
+ * @returns listener name or NULL, if the default listener is used
+ */
+char *smf_session_get_listener(SMFSession_T *session);
+
 /*!
  * @fn void smf_session_set_response_msg(SMFSession_T *session, char *rmsg)
  * @brief Set response message
@@ -144,6 +168,23 @@ void smf_session_set_message_file(SMFSession_T *session, char *fp);
  */
 char *smf_session_get_message_file(SMFSession_T *session);
 
+/*!
+ * @fn void smf_session_mark_body_dirty(SMFSession_T *session)
+ * @brief Tell spmfilter, that the message file has been rewritten. 
+ *  Modules have to call this after changing the message file, the
+ *  message is parsed again once the module returns.
+ * @param session SMFSession_T object
+ */
+void smf_session_mark_body_dirty(SMFSession_T *session);
+
+/*!
+ * @fn int smf_session_is_body_dirty(SMFSession_T *session)
+ * @brief Check if the message file has been rewritten
+ * @param session SMFSession_T object
+ * @returns 1 if the message file has been marked dirty, otherwise 0
+ */
+int smf_session_is_body_dirty(SMFSession_T *session);
+
 /*!
  * @fn char *smf_session_get_id(SMFSession_T *session)
  * @brief Get session id
@@ -210,9 +210,15 @@ void _set_config_value(SMFSettings_T **settings, char *section, char *key, char
         /** [global]add_header **/
         } else if (strcmp(key,"add_header")==0) {
             (*settings)->add_header = _get_boolean(val);
+        /** [global]module_threads **/
+        } else if (strcmp(key,"module_threads")==0) {
+            (*settings)->module_threads = _get_integer(val);
         /** [global]max_size **/
         } else if (strcmp(key,"max_size")==0) {
             (*settings)->max_size = _get_integer(val);
+        /** [global]spool_memory_limit **/
+        } else if (strcmp(key,"spool_memory_limit")==0) {
+            (*settings)->spool_memory_limit = _get_integer(val);
         /** [global]tls_enable **/
         } else if (strcmp(key,"tls_enable")==0) {
             i = _get_integer(val);
@@ -266,6 +272,56 @@ void _set_config_value(SMFSettings_T **settings, char *section, char *key, char
         /** [global]spare_childs **/
         } else if (strcmp(key,"spare_childs")==0) {
             (*settings)->spare_childs = _get_integer(val);
+        /** [global]max_spare_childs **/
+        } else if (strcmp(key,"max_spare_childs")==0) {
+            (*settings)->max_spare_childs = _get_integer(val);
+        /** [global]max_requests_per_child **/
+        } else if (strcmp(key,"max_requests_per_child")==0) {
+            (*settings)->max_requests_per_child = _get_integer(val);
+        /** [global]accept_mode **/
+        } else if (strcmp(key,"accept_mode")==0) {
+            if (strcmp(val,"herd")==0)
+                (*settings)->accept_mode = SMF_ACCEPT_HERD;
+            else if (strcmp(val,"exclusive")==0)
+                (*settings)->accept_mode = SMF_ACCEPT_EXCLUSIVE;
+            else if (strcmp(val,"reuseport")==0)
+                (*settings)->accept_mode = SMF_ACCEPT_REUSEPORT;
+            else
+                TRACE(TRACE_ERR,"invalid accept_mode [%s], using default",val);
+        /** [global]listeners **/
+        } else if (strcmp(key,"listeners")==0) {
+            if (smf_list_size((*settings)->listeners) > 0) {
+                if (smf_list_free((*settings)->listeners)!=0)
+                    TRACE(TRACE_ERR,"failed to free listener list");
+                else 
+                    if (smf_list_new(&((*settings)->listeners),smf_internal_string_list_destroy)!=0)
+                        TRACE(TRACE_ERR,"failed to create listener list");
+            }
+            sl = _get_list(val);
+            p = sl;
+            while(*p != NULL) {
+                s = smf_core_strstrip(*p);
+                smf_list_append((*settings)->listeners, s);
+                p++;
+            }
+            free(sl);
+        /** [global]routes **/
+        } else if (strcmp(key,"routes")==0) {
+            if (smf_list_size((*settings)->routes) > 0) {
+                if (smf_list_free((*settings)->routes)!=0)
+                    TRACE(TRACE_ERR,"failed to free route list");
+                else 
+                    if (smf_list_new(&((*settings)->routes),smf_internal_string_list_destroy)!=0)
+                        TRACE(TRACE_ERR,"failed to create route list");
+            }
+            sl = _get_list(val);
+            p = sl;
+            while(*p != NULL) {
+                s = smf_core_strstrip(*p);
+                smf_list_append((*settings)->routes, s);
+                p++;
+            }
+            free(sl);
         /** [global]lookup_persistent **/
         } else if (strcmp(key,"lookup_persistent")==0) {
             (*settings)->lookup_persistent = _get_boolean(val);
@@ -426,8 +482,21 @@ void _set_config_value(SMFSettings_T **settings, char *section, char *key, char
         /** [smtpd]nexthop_fail_code **/
         } else if (strcmp(key, "nexthop_fail_code")==0) {
             (*settings)->nexthop_fail_code = _get_integer(val);
+        /** [smtpd]smtpd_timeout **/
         } else if (strcmp(key, "smtpd_timeout")==0) {
             (*settings)->smtpd_timeout = _get_integer(val);
+        /** [smtpd]smtpd_command_timeout **/
+        } else if (strcmp(key, "smtpd_command_timeout")==0) {
+            (*settings)->smtpd_command_timeout = _get_integer(val);
+        /** [smtpd]smtpd_data_timeout **/
+        } else if (strcmp(key, "smtpd_data_timeout")==0) {
+            (*settings)->smtpd_data_timeout = _get_integer(val);
+        /** [smtpd]event_processes **/
+        } else if (strcmp(key, "event_processes")==0) {
+            (*settings)->event_processes = _get_integer(val);
+        /** [smtpd]event_threads **/
+        } else if (strcmp(key, "event_threads")==0) {
+            (*settings)->event_threads = _get_integer(val);
         /** smtp code **/
         } else {
             i = _get_integer(key);
@@ -472,17 +541,40 @@ SMFSettings_T *smf_settings_new(void) {
     settings->group = NULL;
     settings->max_childs = 10;
     settings->spare_childs = 2;
+    settings->max_spare_childs = 5;
+    settings->max_requests_per_child = 0;
+    settings->accept_mode = SMF_ACCEPT_HERD;
     settings->lookup_persistent = 0;
     settings->syslog_facility = LOG_MAIL;
+    if (smf_list_new(&settings->listeners, smf_internal_string_list_destroy) != 0) {
+        TRACE(TRACE_ERR,"failed to allocate space for settings->listeners");
+        smf_list_free(settings->modules);
+        free(settings);
+        return NULL;
+    }
+    if (smf_list_new(&settings->routes, smf_internal_string_list_destroy) != 0) {
+        TRACE(TRACE_ERR,"failed to allocate space for settings->routes");
+        smf_list_free(settings->modules);
+        smf_list_free(settings->listeners);
+        free(settings);
+        return NULL;
+    }
+    settings->route_table = NULL;
 
     settings->smtp_codes = smf_dict_new();
     settings->smtpd_timeout = 300;
+    settings->smtpd_command_timeout = 30;
+    settings->smtpd_data_timeout = 600;
+    settings->event_processes = 2;
+    settings->event_threads = 4;
 
     settings->sql_driver = NULL;
     settings->sql_name = NULL;
     if (smf_list_new(&settings->sql_host, smf_internal_string_list_destroy) != 0) {
         TRACE(TRACE_ERR,"failed to allocate space for settings->sql_host");
         smf_list_free(settings->modules);
+        smf_list_free(settings->listeners);
+        smf_list_free(settings->routes);
         free(settings);
         return NULL;
     }
@@ -494,6 +586,8 @@ SMFSettings_T *smf_settings_new(void) {
     if (smf_list_new(&settings->ldap_host, smf_internal_string_list_destroy) != 0) {
         TRACE(TRACE_ERR,"failed to allocate space for settings->ldap_host");
         smf_list_free(settings->modules);
+        smf_list_free(settings->listeners);
+        smf_list_free(settings->routes);
         smf_list_free(settings->sql_host);
         free(settings);
         return NULL;
@@ -507,6 +601,8 @@ SMFSettings_T *smf_settings_new(void) {
     if (smf_list_new(&settings->ldap_result_attributes, smf_internal_string_list_destroy) != 0) {
         TRACE(TRACE_ERR, "failed to allocate space for settings->ldap_result_attributes");
         smf_list_free(settings->modules);
+        smf_list_free(settings->listeners);
+        smf_list_free(settings->routes);
         smf_list_free(settings->sql_host);
         smf_list_free(settings->ldap_host);
         free(settings);
@@ -515,7 +611,9 @@ SMFSettings_T *smf_settings_new(void) {
     settings->module_fail = 3;
     settings->nexthop_fail_code = 451;
     settings->add_header = 1;
+    settings->module_threads = 1;
     settings->max_size = 0;
+    settings->spool_memory_limit = 65536;
     settings->tls = 0;
     settings->sql_max_connections = 3;
     settings->sql_port = 0;
@@ -550,6 +648,12 @@ void smf_settings_free(SMFSettings_T *settings) {
     smf_dict_free(settings->smtp_codes);
     if (settings->sql_driver) free(settings->sql_driver);
     if (settings->sql_name) free(settings->sql_name);
+    if (smf_list_free(settings->listeners) != 0)
+        TRACE(TRACE_ERR,"failed to free settings->listeners");
+    if (smf_list_free(settings->routes) != 0)
+        TRACE(TRACE_ERR,"failed to free settings->routes");
+    if ((settings->route_table != NULL) && (smf_list_free(settings->route_table) != 0))
+        TRACE(TRACE_ERR,"failed to free settings->route_table");
     if (smf_list_free(settings->sql_host) != 0)
         TRACE(TRACE_ERR,"failed to free settings->sql_host");
     if (settings->sql_user != NULL) free(settings->sql_user);
@@ -696,6 +800,13 @@ int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file) {
         return -1;
     }
 
+    /* keep a gap between both thresholds, otherwise childs would be 
+     * forked and culled over and over again */
+    if ((*settings)->max_spare_childs <= (*settings)->spare_childs) {
+        (*settings)->max_spare_childs = (*settings)->spare_childs + 1;
+        TRACE(TRACE_DEBUG,"max_spare_childs must be larger than spare_childs, using %d",(*settings)->max_spare_childs);
+    }
+
     if ((*settings)->backend_connection == NULL) 
         (*settings)->backend_connection = strdup("failover");
 
@@ -754,6 +865,10 @@ int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file) {
     if ((*settings)->nexthop_fail_msg == NULL)
         (*settings)->nexthop_fail_msg = strdup("Requested action aborted: local error in processing");
 
+    /** module routes, the [route:name] sections are complete now **/
+    if (smf_modules_routes_compile(*settings) != 0)
+        return -1;
+
     return 0;
 }
 
@@ -776,7 +891,9 @@ void smf_settings_log(SMFSettings_T *settings) {
     TRACE(TRACE_DEBUG, "settings->backend: [%s]", settings->backend);
     TRACE(TRACE_DEBUG, "settings->backend_connection: [%s]", settings->backend_connection);
     TRACE(TRACE_DEBUG, "settings->add_header: [%d]", settings->add_header);
+    TRACE(TRACE_DEBUG, "settings->module_threads: [%d]", settings->module_threads);
     TRACE(TRACE_DEBUG, "settings->max_size: [%d]", settings->max_size);
+    TRACE(TRACE_DEBUG, "settings->spool_memory_limit: [%lu]", settings->spool_memory_limit);
     TRACE(TRACE_DEBUG, "settings->tls: [%d]", settings->tls);
     TRACE(TRACE_DEBUG, "settings->lib_dir: [%s]", settings->lib_dir);
     TRACE(TRACE_DEBUG, "settings->pid_file: [%s]", settings->pid_file);
@@ -788,6 +905,15 @@ void smf_settings_log(SMFSettings_T *settings) {
     TRACE(TRACE_DEBUG, "settings->group: [%s]", settings->group);
     TRACE(TRACE_DEBUG, "settings->max_childs: [%d]", settings->max_childs);
     TRACE(TRACE_DEBUG, "settings->spare_childs: [%d]", settings->spare_childs);
+    TRACE(TRACE_DEBUG, "settings->max_spare_childs: [%d]", settings->max_spare_childs);
+    TRACE(TRACE_DEBUG, "settings->max_requests_per_child: [%d]", settings->max_requests_per_child);
+    TRACE(TRACE_DEBUG, "settings->accept_mode: [%d]", settings->accept_mode);
+    elem = smf_list_head(settings->listeners);
+    while(elem != NULL) {
+        s = (char *)smf_list_data(elem);
+        TRACE(TRACE_DEBUG, "settings->listeners: [%s]", s);
+        elem = elem->next;
+    }
     TRACE(TRACE_DEBUG, "settings->lookup_persistent: [%d]", settings->lookup_persistent);
     TRACE(TRACE_DEBUG, "settings->syslog_facility: [%d]", settings->syslog_facility);
 
@@ -830,6 +956,10 @@ void smf_settings_log(SMFSettings_T *settings) {
     TRACE(TRACE_DEBUG, "settings->nexthop_fail_code: [%d]", settings->nexthop_fail_code);
     TRACE(TRACE_DEBUG, "settings->nexthop_fail_msg: [%s]", settings->nexthop_fail_msg);
     TRACE(TRACE_DEBUG, "settings->smtpd_timeout: [%d]\n", settings->smtpd_timeout);
+    TRACE(TRACE_DEBUG, "settings->smtpd_command_timeout: [%d]", settings->smtpd_command_timeout);
+    TRACE(TRACE_DEBUG, "settings->smtpd_data_timeout: [%d]", settings->smtpd_data_timeout);
+    TRACE(TRACE_DEBUG, "settings->event_processes: [%d]", settings->event_processes);
+    TRACE(TRACE_DEBUG, "settings->event_threads: [%d]", settings->event_threads);
 
     list = smf_dict_get_keys(settings->smtp_codes);
     elem = smf_list_head(list);
@@ -1030,6 +1160,16 @@ int smf_settings_get_add_header(SMFSettings_T *settings) {
     return settings->add_header;
 }
 
+void smf_settings_set_module_threads(SMFSettings_T *settings, int threads) {
+    assert(settings);
+    settings->module_threads = threads;
+}
+
+int smf_settings_get_module_threads(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->module_threads;
+}
+
 void smf_settings_set_max_size(SMFSettings_T *settings, unsigned long size) {
     assert(settings);
     settings->max_size = size;
@@ -1040,6 +1180,16 @@ unsigned long smf_settings_get_max_size(SMFSettings_T *settings) {
     return settings->max_size;
 }
 
+void smf_settings_set_spool_memory_limit(SMFSettings_T *settings, unsigned long size) {
+    assert(settings);
+    settings->spool_memory_limit = size;
+}
+
+unsigned long smf_settings_get_spool_memory_limit(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->spool_memory_limit;
+}
+
 void smf_settings_set_tls(SMFSettings_T *settings, SMFTlsOption_T t) {
     assert(settings);
     settings->tls = t;
@@ -1170,6 +1320,60 @@ int smf_settings_get_spare_childs(SMFSettings_T *settings) {
     return settings->spare_childs;
 }
 
+void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs) {
+    assert(settings);
+    settings->max_spare_childs = max_spare_childs;
+}
+
+int smf_settings_get_max_spare_childs(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->max_spare_childs;
+}
+
+void smf_settings_set_max_requests_per_child(SMFSettings_T *settings, int max_requests) {
+    assert(settings);
+    settings->max_requests_per_child = max_requests;
+}
+
+int smf_settings_get_max_requests_per_child(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->max_requests_per_child;
+}
+
+void smf_settings_set_accept_mode(SMFSettings_T *settings, SMFAcceptMode_T mode) {
+    assert(settings);
+    settings->accept_mode = mode;
+}
+
+SMFAcceptMode_T smf_settings_get_accept_mode(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->accept_mode;
+}
+
+int smf_settings_add_listener(SMFSettings_T *settings, char *name) {
+    assert(settings);
+    assert(name);
+
+    return smf_list_append(settings->listeners,(void *)name);
+}
+
+SMFList_T *smf_settings_get_listeners(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->listeners;
+}
+
+int smf_settings_add_route(SMFSettings_T *settings, char *name) {
+    assert(settings);
+    assert(name);
+
+    return smf_list_append(settings->routes,(void *)name);
+}
+
+SMFList_T *smf_settings_get_routes(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->routes;
+}
+
 void smf_settings_set_syslog_facility(SMFSettings_T *settings, char *facility) {
     if (strcasecmp(facility,"auth")==0) 
         settings->syslog_facility = LOG_AUTH;
@@ -1254,6 +1458,46 @@ int smf_settings_get_smtpd_timeout(SMFSettings_T *settings) {
     return settings->smtpd_timeout;
 }
 
+void smf_settings_set_smtpd_command_timeout(SMFSettings_T *settings, int timeout) {
+    assert(settings);
+    settings->smtpd_command_timeout = timeout;
+}
+
+int smf_settings_get_smtpd_command_timeout(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->smtpd_command_timeout;
+}
+
+void smf_settings_set_smtpd_data_timeout(SMFSettings_T *settings, int timeout) {
+    assert(settings);
+    settings->smtpd_data_timeout = timeout;
+}
+
+int smf_settings_get_smtpd_data_timeout(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->smtpd_data_timeout;
+}
+
+void smf_settings_set_event_processes(SMFSettings_T *settings, int processes) {
+    assert(settings);
+    settings->event_processes = processes;
+}
+
+int smf_settings_get_event_processes(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->event_processes;
+}
+
+void smf_settings_set_event_threads(SMFSettings_T *settings, int threads) {
+    assert(settings);
+    settings->event_threads = threads;
+}
+
+int smf_settings_get_event_threads(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->event_threads;
+}
+
 void smf_settings_set_sql_driver(SMFSettings_T *settings, char *driver) {
     assert(settings);   
     assert(driver);
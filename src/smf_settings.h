@@ -42,6 +42,16 @@ typedef enum {
     SMF_TLS_REQUIRED /**< TLS is enabled and required */
 } SMFTlsOption_T;
 
+/*!
+ * @enum SMFAcceptMode_T
+ * @brief How prefork childs wait for new connections
+ */
+typedef enum {
+    SMF_ACCEPT_HERD, /**< all childs block in accept() on the shared socket */
+    SMF_ACCEPT_EXCLUSIVE, /**< shared socket, only one child is woken via EPOLLEXCLUSIVE */
+    SMF_ACCEPT_REUSEPORT /**< every child binds its own SO_REUSEPORT socket */
+} SMFAcceptMode_T;
+
 /*!
  * @enum SMFConnectionType_T
  * @brief Possible backend connection types
@@ -77,7 +87,9 @@ typedef struct {
                                *   failover connections in the order listed
                                */
     int add_header; /**< add spmfilter processing header */
+    int module_threads; /**< read-only modules running at the same time (default 1, no concurrency) */
     unsigned long max_size; /**< maximal message size in bytes */
+    unsigned long spool_memory_limit; /**< messages up to this size are spooled in memory (default 65536) */
     SMFTlsOption_T tls; /**< enable/disable TLS */
     char *lib_dir; /**< user defined directory path for shared libraries */
     char *pid_file; /**< path to pid file */
@@ -88,11 +100,21 @@ typedef struct {
     char *user; /**< run daemon as user */
     char *group; /**< run daemon as group */
     int max_childs; /**< maximum number of allowed processes (default 10) */
-    int spare_childs; /**< number of spare childs (default 2) */
+    int spare_childs; /**< minimum number of spare childs (default 2) */
+    int max_spare_childs; /**< maximum number of spare childs, more idle childs are stopped (default 5) */
+    int max_requests_per_child; /**< number of connections a child handles before it exits, 0 = unlimited (default 0) */
+    SMFAcceptMode_T accept_mode; /**< how childs accept connections (default SMF_ACCEPT_HERD) */
+    SMFList_T *listeners; /**< names of the [listener:name] sections, empty to use bind_ip/bind_port */
+    SMFList_T *routes; /**< names of the [route:name] sections, checked in this order */
+    SMFList_T *route_table; /**< compiled routes, see smf_modules_routes_compile() */
     int syslog_facility; /**< syslog facility **/
 
     SMFDict_T *smtp_codes; /**< user defined smtp return codes */
     int smtpd_timeout; /**< time limit for receiving a remote SMTP client request (default 300s) */
+    int smtpd_command_timeout; /**< time limit for completing a started SMTP command line (default 30s) */
+    int smtpd_data_timeout; /**< time limit for receiving the whole message content (default 600s) */
+    int event_processes; /**< number of event loop processes of the smtpd_event engine (default 2) */
+    int event_threads; /**< number of filter threads per event loop process (default 4) */
 
     char *sql_driver; /**< sql driver name */
     char *sql_name; /**< sql database name */
@@ -340,6 +362,22 @@ void smf_settings_set_add_header(SMFSettings_T *settings, int i);
  */
 int smf_settings_get_add_header(SMFSettings_T *settings);
 
+/*!
+ * @fn void smf_settings_set_module_threads(SMFSettings_T *settings, int threads)
+ * @brief Set the number of read-only modules, which may run at the same time
+ * @param settings a SMFSettings_T object
+ * @param threads number of concurrent modules, 1 runs all modules one after another
+ */
+void smf_settings_set_module_threads(SMFSettings_T *settings, int threads);
+
+/*!
+ * @fn int smf_settings_get_module_threads(SMFSettings_T *settings)
+ * @brief Get module_threads setting
+ * @param settings a SMFSettings_T object
+ * @returns number of concurrent modules
+ */
+int smf_settings_get_module_threads(SMFSettings_T *settings);
+
 /*!
  * @fn void smf_settings_set_max_size(SMFSettings_T *settings, unsigned long size)
  * @brief Set max. allowed message size in byte
@@ -356,6 +394,22 @@ void smf_settings_set_max_size(SMFSettings_T *settings, unsigned long size);
  */
 unsigned long smf_settings_get_max_size(SMFSettings_T *settings);
 
+/*!
+ * @fn void smf_settings_set_spool_memory_limit(SMFSettings_T *settings, unsigned long size)
+ * @brief Set size limit in bytes for messages, which are spooled in memory
+ * @param settings a SMFSettings_T object
+ * @param size spool_memory_limit setting, 0 disables the in-memory spool
+ */
+void smf_settings_set_spool_memory_limit(SMFSettings_T *settings, unsigned long size);
+
+/*!
+ * @fn unsigned long smf_settings_get_spool_memory_limit(SMFSettings_T *settings)
+ * @brief Get spool_memory_limit setting in bytes
+ * @param settings a SMFSettings_T object
+ * @returns spool_memory_limit value
+ */
+unsigned long smf_settings_get_spool_memory_limit(SMFSettings_T *settings);
+
 /*!
  * @fn void smf_settings_set_tls(SMFSettings_T *settings, SMFTlsOption_T t)
  * @brief Set tls setting
@@ -532,6 +586,88 @@ void smf_settings_set_spare_childs(SMFSettings_T *settings, int spare_childs);
  */
 int smf_settings_get_spare_childs(SMFSettings_T *settings);
 
+/*!
+ * @fn void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs)
+ * @brief Set maximum number of idle processes, before childs are stopped
+ * @param settings a SMFSettings_T object
+ * @param max_spare_childs number of spare processes
+ */
+void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs);
+
+/*!
+ * @fn int smf_settings_get_max_spare_childs(SMFSettings_T *settings)
+ * @brief Get maximum number of idle processes, before childs are stopped
+ * @param settings a SMFSettings_T object
+ * @returns number of spare processes
+ */
+int smf_settings_get_max_spare_childs(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_max_requests_per_child(SMFSettings_T *settings, int max_requests)
+ * @brief Set the number of connections a child process handles before it exits
+ * @param settings a SMFSettings_T object
+ * @param max_requests number of connections, 0 means unlimited
+ */
+void smf_settings_set_max_requests_per_child(SMFSettings_T *settings, int max_requests);
+
+/*!
+ * @fn int smf_settings_get_max_requests_per_child(SMFSettings_T *settings)
+ * @brief Get the number of connections a child process handles before it exits
+ * @param settings a SMFSettings_T object
+ * @returns number of connections, 0 means unlimited
+ */
+int smf_settings_get_max_requests_per_child(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_accept_mode(SMFSettings_T *settings, SMFAcceptMode_T mode)
+ * @brief Set how child processes accept new connections
+ * @param settings a SMFSettings_T object
+ * @param mode a SMFAcceptMode_T value
+ */
+void smf_settings_set_accept_mode(SMFSettings_T *settings, SMFAcceptMode_T mode);
+
+/*!
+ * @fn SMFAcceptMode_T smf_settings_get_accept_mode(SMFSettings_T *settings)
+ * @brief Get how child processes accept new connections
+ * @param settings a SMFSettings_T object
+ * @returns a SMFAcceptMode_T value
+ */
+SMFAcceptMode_T smf_settings_get_accept_mode(SMFSettings_T *settings);
+
+/*!
+ * @fn int smf_settings_add_listener(SMFSettings_T *settings, char *name)
+ * @brief Add a listener, it's configured in the section [listener:name]
+ * @param settings a SMFSettings_T object
+ * @param name name of the listener
+ * @returns 0 on success or -1 in case of error  
+ */
+int smf_settings_add_listener(SMFSettings_T *settings, char *name);
+
+/*!
+ * @fn SMFList_T *smf_settings_get_listeners(SMFSettings_T *settings)
+ * @brief Get names of all configured listeners
+ * @param settings a SMFSettings_T object
+ * @returns listener list
+ */
+SMFList_T *smf_settings_get_listeners(SMFSettings_T *settings);
+
+/*!
+ * @fn int smf_settings_add_route(SMFSettings_T *settings, char *name)
+ * @brief Add a module route, it's configured in the section [route:name]
+ * @param settings a SMFSettings_T object
+ * @param name name of the route
+ * @returns 0 on success or -1 in case of error  
+ */
+int smf_settings_add_route(SMFSettings_T *settings, char *name);
+
+/*!
+ * @fn SMFList_T *smf_settings_get_routes(SMFSettings_T *settings)
+ * @brief Get names of all configured module routes
+ * @param settings a SMFSettings_T object
+ * @returns route list
+ */
+SMFList_T *smf_settings_get_routes(SMFSettings_T *settings);
+
 /*!
  * @fn void smf_settings_set_syslog_facility(SMFSettings_T *settings, char *facility)
  * @brief Set syslog facility
@@ -583,6 +719,70 @@ void smf_settings_set_smtpd_timeout(SMFSettings_T *settings, int timeout);
  */
 int smf_settings_get_smtpd_timeout(SMFSettings_T *settings);
 
+/*!
+ * @fn void smf_settings_set_smtpd_command_timeout(SMFSettings_T *settings, int timeout)
+ * @brief Set time limit for completing a SMTP command line, once its first bytes arrived
+ * @param settings a SMFSettings_T object
+ * @param timeout timeout limit in seconds
+ */
+void smf_settings_set_smtpd_command_timeout(SMFSettings_T *settings, int timeout);
+
+/*!
+ * @fn int smf_settings_get_smtpd_command_timeout(SMFSettings_T *settings)
+ * @brief Get time limit for completing a SMTP command line
+ * @param settings a SMFSettings_T object
+ * @returns timeout command timeout in seconds
+ */
+int smf_settings_get_smtpd_command_timeout(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_smtpd_data_timeout(SMFSettings_T *settings, int timeout)
+ * @brief Set time limit for receiving the message content after DATA or BDAT
+ * @param settings a SMFSettings_T object
+ * @param timeout timeout limit in seconds
+ */
+void smf_settings_set_smtpd_data_timeout(SMFSettings_T *settings, int timeout);
+
+/*!
+ * @fn int smf_settings_get_smtpd_data_timeout(SMFSettings_T *settings)
+ * @brief Get time limit for receiving the message content
+ * @param settings a SMFSettings_T object
+ * @returns timeout data timeout in seconds
+ */
+int smf_settings_get_smtpd_data_timeout(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_event_processes(SMFSettings_T *settings, int processes)
+ * @brief Set number of event loop processes of the smtpd_event engine
+ * @param settings a SMFSettings_T object
+ * @param processes number of processes
+ */
+void smf_settings_set_event_processes(SMFSettings_T *settings, int processes);
+
+/*!
+ * @fn int smf_settings_get_event_processes(SMFSettings_T *settings)
+ * @brief Get number of event loop processes of the smtpd_event engine
+ * @param settings a SMFSettings_T object
+ * @returns number of processes
+ */
+int smf_settings_get_event_processes(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_event_threads(SMFSettings_T *settings, int threads)
+ * @brief Set number of filter threads per event loop process
+ * @param settings a SMFSettings_T object
+ * @param threads number of threads
+ */
+void smf_settings_set_event_threads(SMFSettings_T *settings, int threads);
+
+/*!
+ * @fn int smf_settings_get_event_threads(SMFSettings_T *settings)
+ * @brief Get number of filter threads per event loop process
+ * @param settings a SMFSettings_T object
+ * @returns number of threads
+ */
+int smf_settings_get_event_threads(SMFSettings_T *settings);
+
 /*!
  * @fn void smf_settings_set_sql_driver(SMFSettings_T *settings, char *driver)
  * @brief Set SQL driver, which should be used.
@@ -206,7 +206,7 @@ void smf_smtp_event_cb (smtp_session_t session, int event_no, void *arg,...) {
     va_end(alist);
 }
 
-SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *msg_file, char *sid) {
+static SMFSmtpStatus_T *smf_smtp_deliver_message(SMFEnvelope_T *env, SMFTlsOption_T tls, char *msg_file, FILE *msg_fp, char *sid) {
     smtp_session_t session;
     smtp_message_t message;
     smtp_recipient_t recipient;
@@ -255,6 +255,7 @@ SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *
             else
                 TRACE(TRACE_ERR,status->text);
         }
+        if (msg_fp != NULL) fclose(msg_fp);
         return status;
     }
 
@@ -296,6 +297,7 @@ SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *
             STRACE(TRACE_ERR,sid,status->text);
         else
             TRACE(TRACE_ERR,status->text);
+        if (msg_fp != NULL) fclose(msg_fp);
         if (did != NULL) free(did);
         if (ids != NULL) free(ids);
         return status;
@@ -303,7 +305,11 @@ SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *
     
     free(reverse_path);
 
-    if (msg_file != NULL) {
+    if (msg_fp != NULL) {
+        fp = msg_fp;
+        msg_fp = NULL;
+        smtp_set_message_fp(message, fp);
+    } else if (msg_file != NULL) {
         if((fp = fopen(msg_file, "r"))==NULL) {
             if (asprintf(&status->text,"unable to open file: %s (%d)",strerror(errno), errno) == -1)
                 TRACE(TRACE_ERR,"failed to set status text");
@@ -418,3 +424,12 @@ SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *
     return status;
 }
 
+SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *msg_file, char *sid) {
+    return smf_smtp_deliver_message(env, tls, msg_file, NULL, sid);
+}
+
+SMFSmtpStatus_T *smf_smtp_deliver_fp(SMFEnvelope_T *env, SMFTlsOption_T tls, FILE *fp, char *sid) {
+    assert(fp);
+
+    return smf_smtp_deliver_message(env, tls, NULL, fp, sid);
+}
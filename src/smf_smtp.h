@@ -30,6 +30,8 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
+
 #include "smf_settings.h"
 #include "smf_envelope.h"
 
@@ -67,6 +69,17 @@ void smf_smtp_status_free(SMFSmtpStatus_T *status);
  */
 SMFSmtpStatus_T *smf_smtp_deliver(SMFEnvelope_T *env, SMFTlsOption_T tls, char *msg_file, char *sid); 
 
+/*!
+ * @fn SMFSmtpStatus_T *smf_smtp_deliver_fp(SMFEnvelope_T *env, SMFTlsOption_T tls, FILE *fp, char *sid)
+ * @brief Deliver a message, which is read from a stream, via smtp
+ * @param env a SMFEnvelope_T object
+ * @param tls enable/disable TLS for connection
+ * @param fp message content, the stream is closed after delivery
+ * @param sid optional session id for logging
+ * @returns 0 on success or -1 in case of error
+ */
+SMFSmtpStatus_T *smf_smtp_deliver_fp(SMFEnvelope_T *env, SMFTlsOption_T tls, FILE *fp, char *sid);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,15 +26,14 @@
 #include <sys/times.h>
 #include <signal.h>
 #include <sys/types.h>
-#include <sys/shm.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
-#include <regex.h>
 
 #include "spmfilter_config.h"
 #include "smf_smtpd.h"
@@ -53,19 +52,22 @@
 
 #define THIS_MODULE "smtpd"
 
-int client_sock = 0;
+static int smf_smtpd_handle_q_error(SMFSettings_T *settings, SMFSession_T *session);
+static int smf_smtpd_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval);
+static int smf_smtpd_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session);
 
-void smf_smtpd_sig_handler(int sig) {
-    if (sig == SIGALRM) {
-        char *hostname = NULL;
-        TRACE(TRACE_DEBUG,"session timeout exceeded");
+/* replies to pipelined commands are collected here and sent with
+ * a single write, once all buffered client input is processed (RFC 2920) */
+static char reply_buf[REPLY_BUFSIZE];
+static size_t reply_len = 0;
 
-        hostname = (char *)malloc(MAXHOSTNAMELEN);
-        gethostname(hostname,MAXHOSTNAMELEN);
-        smf_smtpd_string_reply(client_sock,"421 %s Error: timeout exceeded\r\n",hostname);
-        free(hostname);
-    }
+/* replies for smtp codes, see smf_smtpd_code_reply() */
+static reply_table_t *reply_table = NULL;
 
+/* spool file of a running BDAT transaction */
+static int bdat_fd = -1;
+
+void smf_smtpd_sig_handler(int sig) {
     TRACE(TRACE_NOTICE, "terminating child %i", getpid());
     exit(0);
 }
@@ -92,27 +94,17 @@ static int smf_smtpd_handle_q_processing_error(SMFSettings_T *settings, SMFSessi
                     return(0);
         }
     } else if(retval == 1) {
-        if (session->response_msg != NULL) {
-            char *smtp_response;
-            if (asprintf(&smtp_response, "250 %s\r\n",session->response_msg) != -1) {
-                smf_smtpd_string_reply(session->sock,smtp_response);
-                free(smtp_response);
-            } else
-                smf_smtpd_string_reply(session->sock,CODE_250_ACCEPTED);
-        } else
+        if (session->response_msg != NULL)
+            smf_smtpd_string_reply(session->sock,"250 %s\r\n",session->response_msg);
+        else
             smf_smtpd_string_reply(session->sock,CODE_250_ACCEPTED);
         return(1);
     } else if(retval == 2) {
         return(2);
     } else {
-        if (session->response_msg != NULL) {
-            char *smtp_response;
-            if (asprintf(&smtp_response,"%d %s\r\n",retval,session->response_msg) != -1) {
-                smf_smtpd_string_reply(session->sock,smtp_response);
-                free(smtp_response);
-            } else
-                smf_smtpd_code_reply(session->sock,retval,settings->smtp_codes);
-        } else
+        if (session->response_msg != NULL)
+            smf_smtpd_string_reply(session->sock,"%d %s\r\n",retval,session->response_msg);
+        else
             smf_smtpd_code_reply(session->sock,retval,settings->smtp_codes);
         return(1);
     }
@@ -126,17 +118,12 @@ static int smf_smtpd_handle_q_processing_error(SMFSettings_T *settings, SMFSessi
 
 /* handle nexthop delivery error */
 static int smf_smtpd_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
-    char *out = NULL;
-    if (asprintf(&out, "%d %s\r\n",settings->nexthop_fail_code,settings->nexthop_fail_msg) == -1)
-        TRACE(TRACE_ERR,"failed to write nexthop error message");
-    smf_smtpd_string_reply(session->sock,out);
-    free(out);
+    smf_smtpd_string_reply(session->sock,"%d %s\r\n",settings->nexthop_fail_code,settings->nexthop_fail_msg);
     return 0;
 }
 
 int smf_smtpd_process_modules(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
     int ret;
-    char *msg = NULL;
     /* now tun the process queue */
     ret = smf_modules_process(q,session,settings);
 
@@ -147,20 +134,10 @@ int smf_smtpd_process_modules(SMFSession_T *session, SMFSettings_T *settings, SM
         return(0);
     }
 
-    if (session->response_msg != NULL) {
-        char *smtp_response;
-        if (asprintf(&smtp_response,"250 %s\r\n",session->response_msg) != -1) {
-            smf_smtpd_string_reply(session->sock,smtp_response);
-            free(smtp_response);
-        } else
-            smf_smtpd_string_reply(session->sock,"250 Ok");
-    } else {
-        if (asprintf(&msg,"250 Ok: processed as %s\r\n",session->id) != -1) {
-            smf_smtpd_string_reply(session->sock,msg);
-            free(msg);
-        } else
-            smf_smtpd_string_reply(session->sock,"250 Ok");
-    }
+    if (session->response_msg != NULL)
+        smf_smtpd_string_reply(session->sock,"250 %s\r\n",session->response_msg);
+    else
+        smf_smtpd_string_reply(session->sock,"250 Ok: processed as %s\r\n",session->id);
     return(0);
 }
 
@@ -193,341 +170,550 @@ void smf_smtpd_stuffing(char chain[]) {
     chain[j]='\0';
 }
 
-#define fputs_or_return(s, stream) \
-    if (fputs(s, stream)<0) { \
-        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno); \
-        fclose(stream); \
-        return -1; \
-    }
+/* write all queued replies to the client */
+void smf_smtpd_flush_reply(int sock) {
+    ssize_t len = 0;
 
-int smf_smtpd_append_missing_headers(SMFSession_T *session, char *queue_dir, int mid, int to, int from, int date, int headers, char *nl) {
-    int fd;
-    FILE *new = NULL;
-    FILE *old = NULL;
-    char tmpname[PATH_MAX];
-    size_t len;
-    char buf[BUFSIZE];
-    time_t currtime;  
-    char *t1 = NULL;
-    char *t2 = NULL;
-
-    snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", queue_dir);
-    if ((fd = mkstemp(tmpname)) == -1) {
-        STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
-        return -1;
-    }
-    
-    close(fd);
-    
-    if((new = fopen(tmpname, "w"))==NULL) {
-        STRACE(TRACE_ERR,session->id,"unable to open temporary file: %s (%d)",strerror(errno), errno);
-        return -1;
-    }
+    if (reply_len == 0)
+        return;
 
-    if (mid==0) {
-        t1 = smf_message_generate_message_id();
-        if (asprintf(&t2,"Message-Id: %s%s",t1,nl) != -1) {
-            fputs_or_return(t2, new);
-            free(t2);
-        }
-        free(t1);
+    if ((len = smf_internal_writen(sock,reply_buf,reply_len)) != reply_len) {
+        TRACE(TRACE_WARNING, "unexpected size [%d], expected [%d] bytes",len,reply_len);
     }
+    reply_len = 0;
+}
 
-    if (date==0) {
-        time(&currtime);  
-        t1 = calloc(BUFSIZE,sizeof(char));                                                   
-        strftime(t1,BUFSIZE,"Date: %a, %d %b %Y %H:%M:%S %z (%Z)",localtime(&currtime));
-        smf_core_strcat_printf(&t1, "%s", nl);
-        fputs_or_return(t1, new);
-        free(t1);
-    }
+/* queue reply, replies which don't fit into the buffer are written at once */
+static void smf_smtpd_queue_reply(int sock, const char *out, size_t len) {
+    ssize_t wl = 0;
 
-    if (from==0) {
-        if (asprintf(&t1,"From: %s%s",session->envelope->sender,nl) != -1) {
-            fputs_or_return(t1, new);
-            free(t1);
-        }
-    }
+    if (reply_len + len > REPLY_BUFSIZE)
+        smf_smtpd_flush_reply(sock);
 
-    if (to==0) {
-        if (asprintf(&t1,"To: undisclosed-recipients:;%s",nl) != -1) {
-            fputs_or_return(t1, new);
-            free(t1);
+    if (len > REPLY_BUFSIZE) {
+        if ((wl = smf_internal_writen(sock,out,len)) != len) {
+            TRACE(TRACE_WARNING, "unexpected size [%d], expected [%d] bytes",wl,len);
         }
+        return;
     }
 
-    if (headers==0) {
-        if (asprintf(&t1,"%s",nl) != -1) {
-            fputs_or_return(t1, new);
-            free(t1);
-        }
-    }
+    memcpy(reply_buf + reply_len, out, len);
+    reply_len += len;
+}
 
-    if((old = fopen(session->message_file, "r"))==NULL) {
-        STRACE(TRACE_ERR,session->id,"unable to open queue file: %s (%d)",strerror(errno), errno);
-        fclose(new);
-        return -1;
-    }
+/* is there still unprocessed client input in the readline buffer? */
+static int smf_smtpd_input_pending(readline_t *rl) {
+    return (rl->count > 0);
+}
 
-    while(!feof(old)) {
-        if ((len = fread(&buf,sizeof(char),BUFSIZE,old)) < 0) {
-            STRACE(TRACE_ERR,session->id,"failed to read queue file: %s (%d)",strerror(errno),errno);
-            fclose(old);
-            fclose(new);
-            return -1;
-        }
-        if (fwrite(buf,sizeof(char),len,new) < 0) {
-            STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
-            fclose(old);
-            fclose(new);
-            return -1;
-        }
-    }
-    fclose(old); 
-    fclose(new);
+/* smtp answer with format string as arg, formatted straight into the reply buffer */
+void smf_smtpd_string_reply(int sock, const char *format, ...) {
+    char *out = NULL;
+    ssize_t wl = 0;
+    va_list ap;
+    int len;
 
-    if (unlink(session->message_file)!=0) {
-        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
-        return -1;
-    }
+    va_start(ap, format);
+    len = vsnprintf(reply_buf + reply_len, REPLY_BUFSIZE - reply_len, format, ap);
+    va_end(ap);
 
-    if (rename(tmpname,session->message_file)!=0) {
-        STRACE(TRACE_ERR,session->id,"failed to rename queue file: %s (%d)",strerror(errno),errno);
-        return -1;
+    if (len < 0) {
+        TRACE(TRACE_ERR,"failed to write message");
+        return;
     }
 
-    return 0;
-}
+    if (reply_len + len < REPLY_BUFSIZE) {
+        reply_len += len;
+        return;
+    }
 
-/* smtp answer with format string as arg */
-void smf_smtpd_string_reply(int sock, const char *format, ...) {
-    ssize_t len = 0;
-    char *out = NULL;
-    va_list ap;
+    /* the reply doesn't fit behind the queued ones */
+    smf_smtpd_flush_reply(sock);
+    if (len < REPLY_BUFSIZE) {
+        va_start(ap, format);
+        vsnprintf(reply_buf, REPLY_BUFSIZE, format, ap);
+        va_end(ap);
+        reply_len = len;
+        return;
+    }
 
     va_start(ap, format);
-    
     if (vasprintf(&out,format,ap) <= 0) {
         TRACE(TRACE_ERR,"failed to write message");
+        va_end(ap);
         return;
     }
+    va_end(ap);
 
-    if ((len = smf_internal_writen(sock,out,strlen(out))) != strlen(out)) {
-        TRACE(TRACE_WARNING, "unexpected size [%d], expected [%d] bytes",strlen(out),len);
-    } 
+    if ((wl = smf_internal_writen(sock,out,len)) != len) {
+        TRACE(TRACE_WARNING, "unexpected size [%d], expected [%d] bytes",wl,len);
+    }
     free(out);
-    va_end(ap);
 }
 
 void smf_smtpd_code_reply(int sock, int code, SMFDict_T *codes) {
-    char *code_msg = NULL;
-    char *code_str = NULL;
-    char *out = NULL;
-    ssize_t len = 0;
+    const char *out = NULL;
+    size_t len;
 
-    if (asprintf(&code_str,"%d",code) != -1) {
-        code_msg = smf_dict_get(codes,code_str);
-        free(code_str);
+    /* built by each child on first use, so it follows reloaded settings */
+    if ((reply_table == NULL) && ((reply_table = smf_internal_reply_table_new(codes)) == NULL)) {
+        TRACE(TRACE_ERR,"failed to build reply table");
+        return;
     }
-    
-    if (code_msg!=NULL) {
-        if (asprintf(&out,"%d %s\r\n",code,code_msg) == -1)
-            TRACE(TRACE_ERR,"failed to write response message");
+
+    out = smf_internal_reply_table_get(reply_table,code,&len);
+    smf_smtpd_queue_reply(sock,out,len);
+}
+
+/* pass the spooled message to the module queue and remove the spool file */
+static void smf_smtpd_deliver(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q, unsigned long max_size) {
+    SMFMessage_T *message = NULL;
+    char *mid = NULL;
+    SMFListElem_T *e = NULL;
+
+    if ((session->message_size > max_size)&&(max_size != 0)) {
+        STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded"); 
+        smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
     } else {
-        switch(code) {
-            case 221:
-                out = strdup(CODE_221);
-                break;
-            case 250:
-                out = strdup(CODE_250);
-                break;
-            case 451:
-                out = strdup(CODE_451);
-                break;
-            case 502:
-                out = strdup(CODE_502);
-                break;
-            case 552:
-                out = strdup(CODE_552);
-                break;
-            default:
-                out = strdup(CODE_451);
-                break;
+        message = smf_message_new();
+        if (smf_message_from_file(&message,session->message_file,1) != 0) {
+            STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
+            smf_message_free(message);
+            smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        } else {
+            mid = strdup(smf_message_get_message_id(message));
+            mid = smf_core_strstrip(mid);
+            STRACE(TRACE_INFO,session->id,"message-id=%s",mid);
+            STRACE(TRACE_INFO,session->id,"from=<%s> size=%d",session->envelope->sender,(u_int32_t)session->message_size);
+            e = smf_list_head(session->envelope->recipients);
+            while(e != NULL) {
+                STRACE(TRACE_INFO,session->id,"to=<%s> relay=%s",(char *)smf_list_data(e),settings->nexthop);
+                e = e->next;
+            }
+
+            free(mid);
+            session->envelope->message = message;
+            smf_smtpd_process_modules(session,settings,q);
         }
     }
 
-    if ((len = smf_internal_writen(sock,out,strlen(out))) != strlen(out)) {
-        TRACE(TRACE_WARNING, "unexpected size [%d], expected [%d] bytes",strlen(out),len);
-    } 
-    free(out);
+    STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
+    if (smf_internal_spool_remove(session) != 0)
+        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
 }
 
-void smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
-    ssize_t br;
-    char buf[MAXLINE];
-    void *rl = NULL;
+/* a read deadline passed, tell the client before the session is closed */
+static void smf_smtpd_timeout_reply(int sock) {
+    char hostname[MAXHOSTNAMELEN];
+
+    TRACE(TRACE_DEBUG,"session timeout exceeded");
+    gethostname(hostname,MAXHOSTNAMELEN);
+    smf_smtpd_string_reply(sock,"421 %s Error: timeout exceeded\r\n",hostname);
+    smf_smtpd_flush_reply(sock);
+}
+
+/* sets the deadline for reading the message content */
+static void smf_smtpd_data_deadline(SMFSettings_T *settings, readline_t *rl) {
+    rl->deadline = (settings->smtpd_data_timeout > 0) ? time(NULL) + settings->smtpd_data_timeout : 0;
+    rl->line_timeout = 0;
+}
+
+int smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q, unsigned long max_size, readline_t *rl) {
+    ssize_t len;
+    char *line = NULL;
     FILE *spool_file;
-    SMFMessage_T *message = smf_message_new();
-    int found_mid = 0;
-    int found_to = 0;
-    int found_from = 0;
-    int found_date = 0;
-    int found_header = 0;
-    int in_header = 1;
-    regex_t regex;
-    regex_t regex_message_id;
-    int reti;
-    int reti_message_id;
-    char *nl = NULL;
-    char *mid = NULL;
-    SMFListElem_T *e = NULL;
+    int bol = 1;
+    int too_big = 0;
+    header_scan_t hs;
 
-    reti = regcomp(&regex, "[A-Za-z0-9\\._-]*:.*", 0);
-    reti_message_id = regcomp(&regex_message_id, "^Message-ID:", REG_EXTENDED|REG_ICASE);
+    smf_internal_header_scan_init(&hs);
 
-	  smf_core_gen_queue_file(settings->queue_dir, &session->message_file, session->id);
-    if (session->message_file == NULL) {
-        STRACE(TRACE_ERR,session->id,"got no spool file path");
-        smf_smtpd_code_reply(session->sock, 552,settings->smtp_codes);
-        return;
-    }
-    
     /* open the spool file */
-    spool_file = fopen(session->message_file, "w+");
+    spool_file = smf_internal_spool_open(session,&hs,settings->queue_dir,settings->spool_memory_limit);
     if(spool_file == NULL) {
         STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
         smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
-        return;
+        return 0;
     }
 
     STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file); 
+    /* DATA ends a pipelined command group, the client waits for 354 */
     smf_smtpd_string_reply(session->sock,"354 End data with <CR><LF>.<CR><LF>\r\n");
-
-    while((br = smf_internal_readline(session->sock,buf,MAXLINE,&rl)) > 0) {
-        if ((strncasecmp(buf,".\r\n",3)==0)||(strncasecmp(buf,".\n",2)==0)) break;
-        if (strncasecmp(buf,".",1)==0) smf_smtpd_stuffing(buf);
-
-        if ((found_mid == 0) && (in_header==1)) {
-            reti_message_id = regexec(&regex_message_id, buf, 0, NULL, 0);
-            if (reti_message_id == 0) found_mid = 1;
-        }
-        if ((strncasecmp(buf,"Date:",5)==0) && (in_header==1)) found_date = 1;
-        if ((strncasecmp(buf,"To:",3)==0) && (in_header==1)) found_to = 1;
-        if ((strncasecmp(buf,"From:",5)==0) && (in_header==1)) found_from = 1;
-
-        if (nl == NULL) nl = smf_internal_determine_linebreak(buf);
-
-        if ((strncmp(buf,"\n",1)==0)||(strncmp(buf,"\r\n",2)==0)||(strncmp(buf,"\r",1)==0))
-            in_header = 0;
-
-        if (found_header == 0) {
-            reti = regexec(&regex, buf, 0, NULL, 0);
-            if(reti == 0){
-                found_header = 1;
+    smf_smtpd_flush_reply(session->sock);
+    smf_smtpd_data_deadline(settings,rl);
+
+    while((len = smf_internal_readline_slice(session->sock,rl,&line)) > 0) {
+        if (bol == 1) {
+            if (((len == 3) && (strncmp(line,".\r\n",3)==0))||((len == 2) && (strncmp(line,".\n",2)==0))) break;
+            /* dot-stuffing */
+            if (*line == '.') {
+                line++;
+                len--;
             }
         }
+        bol = (line[len - 1] == '\n');
+
+        /* oversized messages are read until the end, but not spooled */
+        if ((max_size != 0) && (session->message_size + len > max_size)) {
+            if (too_big == 0)
+                STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded, discarding message");
+            too_big = 1;
+            session->message_size += len;
+            continue;
+        }
 
-        if (fwrite(buf, sizeof(char), strlen(buf), spool_file)<0) {
-            STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        if (smf_internal_spool_line(session,spool_file,&hs,line,len) != 0) {
             smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+            smf_internal_header_scan_free(&hs);
             fclose(spool_file);
-            return;
+            if (smf_internal_spool_remove(session) != 0)
+                STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+            return 0;
         }
-        session->message_size += br;
+        session->message_size += len;
+    }
+
+    /* the client went away or timed out before the final dot */
+    if (len <= 0) {
+        if ((len < 0) && (errno == ETIMEDOUT))
+            smf_smtpd_timeout_reply(session->sock);
+        smf_internal_header_scan_free(&hs);
+        fclose(spool_file);
+        if (smf_internal_spool_remove(session) != 0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    if (too_big == 1) {
+        smf_internal_header_scan_free(&hs);
+        fclose(spool_file);
+        if (smf_internal_spool_remove(session) != 0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
+        return 0;
+    }
+
+    if (smf_internal_spool_finish(session,spool_file,&hs) != 0) {
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        smf_internal_header_scan_free(&hs);
+        fclose(spool_file);
+        if (smf_internal_spool_remove(session) != 0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        return 0;
     }
-    if (rl !=NULL) free(rl);
-    regfree(&regex);
-    regfree(&regex_message_id);
     fclose(spool_file);
   
-    if ((found_mid==0)||(found_to==0)||(found_from==0)||(found_date==0))
-        smf_smtpd_append_missing_headers(session, settings->queue_dir,found_mid,found_to,found_from,found_date,found_header,nl);
+    smf_internal_append_missing_headers(session,settings->queue_dir,&hs);
     
     STRACE(TRACE_DEBUG,session->id,"data complete, message size: %d", (u_int32_t)session->message_size);
-    
-    if ((session->message_size > smf_settings_get_max_size(settings))&&(smf_settings_get_max_size(settings) != 0)) {
-        STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded"); 
-        smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
-    } else {
-        if(smf_message_from_file(&message,session->message_file,1) != 0) {
-            STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
-            smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
-            return;
-        }
+    smf_smtpd_deliver(session,settings,q,max_size);
 
-        mid = strdup(smf_message_get_message_id(message));
-        mid = smf_core_strstrip(mid);
-        STRACE(TRACE_INFO,session->id,"message-id=%s",mid);
-        STRACE(TRACE_INFO,session->id,"from=<%s> size=%d",session->envelope->sender,(u_int32_t)session->message_size);
-        e = smf_list_head(session->envelope->recipients);
-        while(e != NULL) {
-            STRACE(TRACE_INFO,session->id,"to=<%s> relay=%s",(char *)smf_list_data(e),settings->nexthop);
-            e = e->next;
-        }
+    return 0;
+}
+
+/* BDAT content isn't parsed while it's received, so look
+ * for missing headers in the spooled message afterwards */
+static void smf_smtpd_check_spool_header(SMFSession_T *session, SMFSettings_T *settings) {
+    FILE *fp = NULL;
+    char buf[MAXLINE];
+    header_scan_t hs;
 
-        free(mid);
-        session->envelope->message = message;
-        smf_smtpd_process_modules(session,settings,q);
+    if ((fp = fopen(session->message_file, "r")) == NULL) {
+        STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
+        return;
     }
 
+    smf_internal_header_scan_init(&hs);
+    while ((fgets(buf,MAXLINE,fp) != NULL) && (smf_internal_header_scan(&hs,buf,strlen(buf)) == 1));
+    fclose(fp);
+
+    smf_internal_append_missing_headers(session,settings->queue_dir,&hs);
+}
+
+/* discard the spool file of an unfinished BDAT transaction */
+static void smf_smtpd_bdat_abort(SMFSession_T *session) {
+    if (bdat_fd == -1)
+        return;
+
+    close(bdat_fd);
+    bdat_fd = -1;
+
     STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
-    if (remove(session->message_file) != 0)
+    if (smf_internal_spool_remove(session) != 0)
         STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
 }
 
+/* copy len bytes of a BDAT chunk from the client into fd, without looking 
+ * at the content. If fd is -1 or writing fails, the chunk is still read, but 
+ * discarded. Returns -1 if the client connection failed.
+ */
+static int smf_smtpd_read_chunk(int sock, readline_t *rl, int fd, size_t len, int *spool_error) {
+    static char buf[CHUNK_BUFSIZE];
+    size_t n;
+    ssize_t br;
+#ifdef HAVE_SPLICE
+    ssize_t bw;
+    int pfd[2];
+#endif
+
+    /* part of the chunk may already be buffered with the BDAT command */
+    if (rl->count > 0) {
+        n = ((size_t)rl->count < len) ? (size_t)rl->count : len;
+        if ((fd != -1) && (*spool_error == 0) && (smf_internal_writen(fd,rl->current,n) != n))
+            *spool_error = 1;
+        rl->current += n;
+        rl->count -= n;
+        len -= n;
+    }
+
+#ifdef HAVE_SPLICE
+    /* move the chunk from the socket into the spool file within the kernel */
+    if ((len > 0) && (fd != -1) && (*spool_error == 0) && (pipe(pfd) == 0)) {
+        while ((len > 0) && (*spool_error == 0)) {
+            if (smf_internal_wait_readable(sock,rl->deadline,0) != 0) {
+                smf_smtpd_timeout_reply(sock);
+                close(pfd[0]);
+                close(pfd[1]);
+                return -1;
+            }
+
+            if ((br = splice(sock,NULL,pfd[1],NULL,len,SPLICE_F_MOVE|SPLICE_F_MORE)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EINVAL) || (errno == ENOSYS))
+                    break; /* not supported, fall back to read() */
+            }
+
+            if (br <= 0) {
+                close(pfd[0]);
+                close(pfd[1]);
+                return -1;
+            }
+            len -= br;
+
+            while (br > 0) {
+                if ((bw = splice(pfd[0],NULL,fd,NULL,br,SPLICE_F_MOVE|SPLICE_F_MORE)) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    *spool_error = 1;
+                    break;
+                }
+                br -= bw;
+            }
+        }
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+#endif
+
+    while (len > 0) {
+        n = (len < sizeof(buf)) ? len : sizeof(buf);
+        if (smf_internal_wait_readable(sock,rl->deadline,0) != 0) {
+            smf_smtpd_timeout_reply(sock);
+            return -1;
+        }
+
+        if ((br = read(sock,buf,n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (br == 0)
+            return -1;
+
+        if ((fd != -1) && (*spool_error == 0) && (smf_internal_writen(fd,buf,br) != br))
+            *spool_error = 1;
+        len -= br;
+    }
+
+    return 0;
+}
+
+int smf_smtpd_process_bdat(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q, 
+        unsigned long max_size, char *req, readline_t *rl, int *state) {
+    char *p = NULL;
+    char *endptr = NULL;
+    unsigned long chunk_size;
+    int last = 0;
+    int spool_error = 0;
+
+    p = req + 4;
+    while (*p == ' ') p++;
+
+    errno = 0;
+    chunk_size = strtoul(p,&endptr,10);
+    if ((endptr == p) || (*p == '-') || (errno != 0)) {
+        /* without a valid size the chunk can't be skipped */
+        smf_smtpd_string_reply(session->sock,"501 Syntax: BDAT chunk-size [LAST]\r\n");
+        return -1;
+    }
+
+    p = endptr;
+    while (*p == ' ') p++;
+    if (strncasecmp(p,"last",4)==0) {
+        last = 1;
+        p += 4;
+    }
+    while ((*p == ' ') || (*p == '\r') || (*p == '\n')) p++;
+
+    /* each chunk has to arrive within smtpd_data_timeout */
+    smf_smtpd_data_deadline(settings,rl);
+
+    if (*p != '\0') {
+        if (smf_smtpd_read_chunk(session->sock,rl,-1,chunk_size,&spool_error) != 0)
+            return -1;
+        smf_smtpd_string_reply(session->sock,"501 Syntax: BDAT chunk-size [LAST]\r\n");
+        return 0;
+    }
+
+    if ((*state != ST_RCPT) && (*state != ST_BDAT)) {
+        if (smf_smtpd_read_chunk(session->sock,rl,-1,chunk_size,&spool_error) != 0)
+            return -1;
+
+        if (*state == ST_MAIL)
+            smf_smtpd_string_reply(session->sock,"554 Error: no valid recipients\r\n");
+        else
+            smf_smtpd_string_reply(session->sock,"503 Error: need RCPT command\r\n");
+        return 0;
+    }
+
+    if (*state == ST_RCPT) {
+        /* first chunk, create the spool file */
+        smf_core_gen_queue_file(settings->queue_dir, &session->message_file, session->id);
+        if (session->message_file == NULL) {
+            STRACE(TRACE_ERR,session->id,"got no spool file path");
+        } else if ((bdat_fd = open(session->message_file,O_WRONLY|O_CREAT|O_TRUNC,0666)) == -1) {
+            STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
+        }
+
+        if (bdat_fd == -1) {
+            if (smf_smtpd_read_chunk(session->sock,rl,-1,chunk_size,&spool_error) != 0)
+                return -1;
+            smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+            return 0;
+        }
+
+        STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file); 
+        *state = ST_BDAT;
+    }
+
+    if ((max_size != 0) && (session->message_size + chunk_size > max_size)) {
+        STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded");
+        smf_smtpd_bdat_abort(session);
+        *state = ST_DATA;
+        if (smf_smtpd_read_chunk(session->sock,rl,-1,chunk_size,&spool_error) != 0)
+            return -1;
+        smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
+        return 0;
+    }
+
+    if (smf_smtpd_read_chunk(session->sock,rl,bdat_fd,chunk_size,&spool_error) != 0) {
+        smf_smtpd_bdat_abort(session);
+        return -1;
+    }
+    session->message_size += chunk_size;
+
+    if (spool_error != 0) {
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        smf_smtpd_bdat_abort(session);
+        *state = ST_DATA;
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        return 0;
+    }
+
+    if (last == 0) {
+        smf_smtpd_string_reply(session->sock,"250 Ok: %lu octets received\r\n",chunk_size);
+        return 0;
+    }
+
+    close(bdat_fd);
+    bdat_fd = -1;
+    *state = ST_DATA;
+
+    smf_smtpd_check_spool_header(session,settings);
+    STRACE(TRACE_DEBUG,session->id,"data complete, message size: %d", (u_int32_t)session->message_size);
+    smf_smtpd_deliver(session,settings,q,max_size);
+
+    return 0;
+}
+
+/* a new session for the client, connected to the current listener */
+static SMFSession_T *smf_smtpd_session_new(int client, SMFServerState_T *server_state) {
+    SMFSession_T *session = smf_session_new();
+
+    session->sock = client;
+    if ((server_state->listener != NULL) && (server_state->listener->name != NULL))
+        smf_session_set_listener(session,server_state->listener->name);
+
+    return session;
+}
+
 void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState_T *server_state) {
     char *hostname = NULL;
-    int br;
-    void *rl = NULL;
+    ssize_t br;
+    readline_t rl;
+    char *line = NULL;
     char req[MAXLINE];
     char *req_value = NULL;
+    unsigned long max_size;
+    unsigned long mail_size;
     char *t = NULL;
     int state=ST_INIT;
-    SMFSession_T *session = smf_session_new();
+    SMFSession_T *session = smf_smtpd_session_new(client,server_state);
     SMFListElem_T *elem = NULL;
     struct tms start_acct;
-    struct sigaction action;
-    struct sockaddr_in peer;
-    socklen_t peer_len;
+    struct sigaction action, old_action;
+    sigset_t term_mask;
+    char peer[NI_MAXHOST];
     SMFProcessQueue_T *q = server_state->q;
 
     start_acct = smf_internal_init_runtime_stats();
-    /* send signal to parent that we've got a new client */
-    kill(getppid(),SIGUSR1);
+    smf_internal_readline_init(&rl);
 
-    smf_server_decrement_spare(server_state);
-    smf_server_add_active(server_state,getpid());
-    
-    session->sock = client;
-    client_sock = client;
-
-    peer_len = sizeof(peer);
-    if (getpeername(client, (struct sockaddr *)&peer, &peer_len) == -1)
-        TRACE(TRACE_ERR,"getpeername() failed: %s",strerror(errno));
-    else
-        TRACE(TRACE_INFO,"connect from %s",inet_ntoa(peer.sin_addr));
+    if (smf_server_peer_name(client,peer,sizeof(peer)) != NULL) {
+        if ((server_state->listener != NULL) && (server_state->listener->name != NULL))
+            TRACE(TRACE_INFO,"connect from %s on listener %s",peer,server_state->listener->name);
+        else
+            TRACE(TRACE_INFO,"connect from %s",peer);
+    }
 
     hostname = (char *)malloc(MAXHOSTNAMELEN);
     gethostname(hostname,MAXHOSTNAMELEN);
     smf_smtpd_string_reply(session->sock,"220 %s spmfilter\r\n",hostname);
 
-    /* set timeout */
+    /* SIGTERM ends a running session right away, the idle child 
+     * gets it only while it waits for the next connection */
     action.sa_handler = smf_smtpd_sig_handler;
     sigemptyset(&action.sa_mask);
     action.sa_flags = 0;
-    if (sigaction(SIGALRM, &action, NULL) < 0) {
-        TRACE(TRACE_ERR,"sigaction (SIGALRM) failed: %s",strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    if (sigaction(SIGTERM, &action, NULL) < 0) {
+    if (sigaction(SIGTERM, &action, &old_action) < 0) {
         TRACE(TRACE_ERR,"sigaction (SIGTERM) failed: %s",strerror(errno));
         exit(EXIT_FAILURE);
     }
-    alarm(settings->smtpd_timeout);
-    
+    sigemptyset(&term_mask);
+    sigaddset(&term_mask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &term_mask, NULL);
+
     for (;;) {
-        if ((br = smf_internal_readline(session->sock,req,MAXLINE,&rl)) < 1)
-            break; /* EOF or error */
+        /* send the replies of a pipelined command group, before waiting for more input */
+        if (!smf_smtpd_input_pending(&rl))
+            smf_smtpd_flush_reply(session->sock);
+
+        /* the client may idle for smtpd_timeout, but a started 
+         * command has to be completed within smtpd_command_timeout */
+        rl.deadline = (settings->smtpd_timeout > 0) ? time(NULL) + settings->smtpd_timeout : 0;
+        rl.line_timeout = settings->smtpd_command_timeout;
+
+        if ((br = smf_internal_readline_slice(session->sock,&rl,&line)) < 1) {
+            if ((br < 0) && (errno == ETIMEDOUT))
+                smf_smtpd_timeout_reply(session->sock);
+            break; /* EOF, error or timeout */
+        }
+
+        /* overlong commands are truncated */
+        if (br > MAXLINE - 1)
+            br = MAXLINE - 1;
+        memcpy(req,line,br);
+        req[br] = '\0';
 
         STRACE(TRACE_DEBUG,session->id,"client smtp dialog: [%s]",req);
 
@@ -542,13 +728,11 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
              * clear all buffers and reset the state exactly as if a RSET
              * command had been issued.
              */
-            alarm(settings->smtpd_timeout);
-            
             if (state != ST_INIT) {
+                smf_smtpd_bdat_abort(session);
                 smf_session_free(session);
                 /* reinit session */
-                session = smf_session_new();
-                session->sock = client;
+                session = smf_smtpd_session_new(client,server_state);
                 STRACE(TRACE_DEBUG,session->id,"session reset, helo/ehlo recieved not in init state");
             }
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'helo/ehlo' received");
@@ -562,7 +746,8 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
 
                 if (strncasecmp(req, "ehlo", 4)==0) {
                     smf_smtpd_string_reply(session->sock,
-                        "250-%s\r\n250-XFORWARD ADDR\r\n250 SIZE %i\r\n",hostname,settings->max_size);
+                        "250-%s\r\n250-PIPELINING\r\n250-CHUNKING\r\n250-XFORWARD ADDR\r\n250 SIZE %lu\r\n",hostname,
+                        smf_server_get_max_size(settings,server_state->listener));
                 } else {
                     smf_smtpd_string_reply(session->sock,"250 %s\r\n",hostname);
                 }
@@ -571,7 +756,6 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
             
             free(req_value);
         } else if (strncasecmp(req,"xforward",8)==0) {
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'xforward' received");
             t = strcasestr(req,"ADDR=");
             if (t != NULL) {
@@ -597,16 +781,22 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
              * one was aborted with a RSET.
              */
 
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'mail from' received");
-            if (state == ST_MAIL) {
+            if ((state == ST_MAIL) || (state == ST_BDAT)) {
                 /* we already got the mail command */
                 smf_smtpd_string_reply(session->sock,"503 Error: nested MAIL command\r\n");
             } else {
                 req_value = smf_smtpd_get_req_value(req,10);
+                max_size = smf_server_get_max_size(settings,server_state->listener);
                 if (strcmp(req_value,"") == 0) {
                     /* empty mail from? */
                     smf_smtpd_string_reply(session->sock,"501 Syntax: MAIL FROM:<address>\r\n");
+                } else if (smf_internal_parse_mail_params(req_value,&mail_size) != 0) {
+                    smf_smtpd_string_reply(session->sock,"501 Syntax: MAIL FROM:<address> [SIZE=size]\r\n");
+                } else if ((max_size != 0) && (mail_size > max_size)) {
+                    /* the client announced a message, we won't accept anyway */
+                    STRACE(TRACE_DEBUG,session->id,"announced message size %lu exceeds limit",mail_size);
+                    smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
                 } else {
                     smf_envelope_set_sender(session->envelope,req_value);
                     STRACE(TRACE_DEBUG,session->id,"session->envelope->sender: [%s]",session->envelope->sender);
@@ -617,7 +807,6 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
                 
             }
         } else if (strncasecmp(req, "rcpt to:", 8)==0) {
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'rcpt to' received");
             if ((state != ST_MAIL) && (state != ST_RCPT)) {
                 /* someone wants to break smtp rules... */
@@ -637,7 +826,6 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
                 free(req_value);
             }
         } else if (strncasecmp(req,"data", 4)==0) {
-            alarm(settings->smtpd_timeout);
             if ((state != ST_RCPT) && (state != ST_MAIL)) {
                 /* someone wants to break smtp rules... */
                 smf_smtpd_string_reply(session->sock,"503 Error: need RCPT command\r\n");
@@ -647,35 +835,46 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState
             } else {
                 state = ST_DATA;
                 STRACE(TRACE_DEBUG,session->id,"SMTP: 'data' received");
-                smf_smtpd_process_data(session,settings,q);
+                smf_server_set_state(server_state,SMF_SLOT_PROCESSING);
+                br = smf_smtpd_process_data(session,settings,q,smf_server_get_max_size(settings,server_state->listener),&rl);
+                smf_server_set_state(server_state,SMF_SLOT_READING);
+                if (br != 0)
+                    break; /* client connection failed */
             }
+        } else if (strncasecmp(req,"bdat", 4)==0) {
+            STRACE(TRACE_DEBUG,session->id,"SMTP: 'bdat' received");
+            smf_server_set_state(server_state,SMF_SLOT_PROCESSING);
+            br = smf_smtpd_process_bdat(session,settings,q,
+                smf_server_get_max_size(settings,server_state->listener),req,&rl,&state);
+            smf_server_set_state(server_state,SMF_SLOT_READING);
+            if (br != 0)
+                break; /* client connection failed */
         } else if (strncasecmp(req,"rset", 4)==0) {
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'rset' received");
+            smf_smtpd_bdat_abort(session);
             smf_session_free(session);
             /* reinit session */
-            session = smf_session_new();
-            session->sock = client;
+            session = smf_smtpd_session_new(client,server_state);
             smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
             state = ST_INIT;
         } else if (strncasecmp(req, "noop", 4)==0) {
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'noop' received");
             smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
         } else {
-            alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: got unknown command");
             smf_smtpd_string_reply(session->sock,"502 Error: command not recognized\r\n");
         }
     }
-    free(rl);
+    /* session finished, the child goes back to accept() */
+    sigprocmask(SIG_BLOCK, &term_mask, NULL);
+    sigaction(SIGTERM, &old_action, NULL);
+    smf_smtpd_bdat_abort(session);
+    smf_smtpd_flush_reply(session->sock);
+
     free(hostname);
 
     smf_internal_print_runtime_stats(start_acct,session->id);
     smf_session_free(session);
-    
-    smf_settings_free(settings);
-    exit(0);
 }
 
 int load(SMFSettings_T *settings) {
@@ -695,7 +894,7 @@ int load(SMFSettings_T *settings) {
         return(-1);
     }
 
-    if ((state->sd = smf_server_listen(settings)) < 0) {
+    if ((state->listeners = smf_server_listen(settings,&state->num_listeners)) == NULL) {
         exit(EXIT_FAILURE);
     }
 
@@ -22,13 +22,10 @@
 #include "smf_session.h"
 #include "smf_modules.h"
 #include "smf_server.h"
+#include "smf_internal.h"
 
-#define CODE_221 "221 Goodbye. Please recommend us to others!\r\n"
-#define CODE_250 "250 OK\r\n"
-#define CODE_250_ACCEPTED "250 OK message accepted\r\n"
-#define CODE_451 "451 Requested action aborted: local error in processing\r\n"
-#define CODE_502 "502 Command not implemented\r\n"
-#define CODE_552 "552 Requested action aborted: local error in processing\r\n"
+#define REPLY_BUFSIZE 4096
+#define CHUNK_BUFSIZE 65536
 
 /* SMTP States */
 #define ST_INIT 0
@@ -38,24 +35,16 @@
 #define ST_RCPT 4
 #define ST_DATA 5
 #define ST_QUIT 6
+#define ST_BDAT 7
 
-static int smf_smtpd_handle_q_error(SMFSettings_T *settings, SMFSession_T *session);
-static int smf_smtpd_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval);
-static int smf_smtpd_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session);
 int smf_smtpd_process_modules(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q);
 char *smf_smtpd_get_req_value(char *req, int jmp);
 void smf_smtpd_stuffing(char chain[]);
-int smf_smtpd_append_missing_headers(SMFSession_T *session, 
-    char *queue_dir, 
-    int mid, 
-    int to, 
-    int from, 
-    int date, 
-    int headers, 
-    char *nl);
 void smf_smtpd_string_reply(int sock, const char *format, ...);
 void smf_smtpd_code_reply(int sock, int code, SMFDict_T *codes);
-void smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings,SMFProcessQueue_T *q);
+void smf_smtpd_flush_reply(int sock);
+int smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings,SMFProcessQueue_T *q, unsigned long max_size, readline_t *rl);
+int smf_smtpd_process_bdat(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q, unsigned long max_size, char *req, readline_t *rl, int *state);
 void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFServerState_T *server_state);
 
 #endif  /* _SMF_SMTPD_H */
@@ -0,0 +1,1355 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2017 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The smtpd_event engine serves many SMTP sessions per process. Each
+ * event loop process multiplexes its client connections with epoll and
+ * passes complete DATA transactions to a pool of filter threads, which
+ * run the configured modules and the nexthop delivery. Filter threads
+ * never touch the client socket, their reply is handed back to the
+ * event loop through an eventfd.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "spmfilter_config.h"
+#include "smf_smtpd.h"
+#include "smf_smtpd_event.h"
+#include "smf_trace.h"
+#include "smf_settings.h"
+#include "smf_settings_private.h"
+#include "smf_modules.h"
+#include "smf_session.h"
+#include "smf_core.h"
+#include "smf_message.h"
+#include "smf_internal.h"
+#include "smf_dict.h"
+#include "smf_server.h"
+
+#define THIS_MODULE "smtpd_event"
+
+static volatile sig_atomic_t event_exit = 0;
+static volatile sig_atomic_t event_upgrade = 0;
+static volatile sig_atomic_t event_drain = 0;
+static volatile sig_atomic_t event_reload = 0;
+
+/* job processed by the current filter thread */
+static __thread SMFEventJob_T *current_job = NULL;
+
+/* replies for smtp codes, built before the filter threads start
+ * and read-only afterwards */
+static reply_table_t *replies = NULL;
+
+static void smf_smtpd_event_sig_handler(int sig) {
+    switch(sig) {
+        case SIGTERM:
+        case SIGINT:
+            event_exit = 1;
+            break;
+        case SIGUSR2:
+            event_upgrade = 1;
+            break;
+        case SIGQUIT:
+            event_drain = 1;
+            break;
+        case SIGHUP:
+            event_reload = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+static void smf_smtpd_event_sig_init(void) {
+    struct sigaction action;
+
+    action.sa_handler = smf_smtpd_event_sig_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+
+    if (sigaction(SIGTERM, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGTERM) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGINT, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGINT) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGUSR2, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGUSR2) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGQUIT, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGQUIT) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGHUP, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGHUP) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* wakes up the master, when an event loop exits */
+    if (sigaction(SIGCHLD, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGCHLD) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGPIPE) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* store the reply of the current filter thread job */
+static void smf_smtpd_event_job_reply(const char *format, ...) {
+    va_list ap;
+    char *out = NULL;
+
+    assert(current_job);
+
+    va_start(ap, format);
+    if (vasprintf(&out,format,ap) == -1) {
+        TRACE(TRACE_ERR,"failed to write message");
+        out = NULL;
+    }
+    va_end(ap);
+
+    if (out != NULL) {
+        free(current_job->reply);
+        current_job->reply = out;
+    }
+}
+
+static void smf_smtpd_event_job_code_reply(int code) {
+    assert(current_job);
+
+    free(current_job->reply);
+    current_job->reply = strdup(smf_internal_reply_table_get(replies,code,NULL));
+}
+
+static int smf_smtpd_event_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
+    switch (settings->module_fail) {
+        case 1: return(1);
+        case 2: smf_smtpd_event_job_code_reply(552);
+                return(0);
+        case 3: smf_smtpd_event_job_code_reply(451);
+                return(0);
+    }
+
+    return 0;
+}
+
+static int smf_smtpd_event_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval) {
+    if (retval == -1) {
+        switch (settings->module_fail) {
+            case 1: return(1);
+            case 2: smf_smtpd_event_job_code_reply(552);
+                    return(0);
+            case 3: smf_smtpd_event_job_code_reply(451);
+                    return(0);
+        }
+    } else if(retval == 1) {
+        if (session->response_msg != NULL)
+            smf_smtpd_event_job_reply("250 %s\r\n",session->response_msg);
+        else
+            smf_smtpd_event_job_reply(CODE_250_ACCEPTED);
+        return(1);
+    } else if(retval == 2) {
+        return(2);
+    } else {
+        if (session->response_msg != NULL)
+            smf_smtpd_event_job_reply("%d %s\r\n",retval,session->response_msg);
+        else
+            smf_smtpd_event_job_code_reply(retval);
+        return(1);
+    }
+
+    /* if none of the above matched, halt processing, this is just
+     * for safety purposes
+     */
+    STRACE(TRACE_DEBUG, session->id, "no conditional matched, will stop queue processing!");
+    return(0);
+}
+
+/* handle nexthop delivery error */
+static int smf_smtpd_event_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
+    smf_smtpd_event_job_reply("%d %s\r\n",settings->nexthop_fail_code,settings->nexthop_fail_msg);
+    return 0;
+}
+
+/* process a spooled message, runs in a filter thread */
+static void smf_smtpd_event_job_run(SMFEventPool_T *pool, SMFEventJob_T *job) {
+    SMFSettings_T *settings = pool->settings;
+    SMFSession_T *session = job->session;
+    SMFMessage_T *message = NULL;
+    SMFListElem_T *e = NULL;
+    char *mid = NULL;
+    int ret;
+
+    current_job = job;
+
+    smf_internal_append_missing_headers(session,settings->queue_dir,&job->hs);
+
+    STRACE(TRACE_DEBUG,session->id,"data complete, message size: %d", (u_int32_t)session->message_size);
+
+    if ((session->message_size > job->max_size)&&(job->max_size != 0)) {
+        STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded");
+        smf_smtpd_event_job_reply("552 message size exceeds fixed maximium message size\r\n");
+    } else {
+        message = smf_message_new();
+        if (smf_message_from_file(&message,session->message_file,1) != 0) {
+            STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
+            smf_message_free(message);
+            smf_smtpd_event_job_code_reply(451);
+        } else {
+            mid = smf_core_strstrip(strdup(smf_message_get_message_id(message)));
+            STRACE(TRACE_INFO,session->id,"message-id=%s",mid);
+            STRACE(TRACE_INFO,session->id,"from=<%s> size=%d",session->envelope->sender,(u_int32_t)session->message_size);
+            e = smf_list_head(session->envelope->recipients);
+            while(e != NULL) {
+                STRACE(TRACE_INFO,session->id,"to=<%s> relay=%s",(char *)smf_list_data(e),settings->nexthop);
+                e = e->next;
+            }
+            free(mid);
+
+            session->envelope->message = message;
+            ret = smf_modules_process(pool->q,session,settings);
+
+            if (ret == -1) {
+                STRACE(TRACE_DEBUG, session->id, "smtpd_event engine failed!");
+                if (job->reply == NULL)
+                    smf_smtpd_event_job_code_reply(451);
+            } else if (ret != 1) {
+                if (session->response_msg != NULL)
+                    smf_smtpd_event_job_reply("250 %s\r\n",session->response_msg);
+                else
+                    smf_smtpd_event_job_reply("250 Ok: processed as %s\r\n",session->id);
+            }
+        }
+    }
+
+    /* the module queue may stop without a reply, never leave the client waiting */
+    if (job->reply == NULL)
+        smf_smtpd_event_job_code_reply(451);
+
+    STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
+    if (smf_internal_spool_remove(session) != 0)
+        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+
+    current_job = NULL;
+}
+
+static void *smf_smtpd_event_worker(void *data) {
+    SMFEventPool_T *pool = (SMFEventPool_T *)data;
+    SMFEventJob_T *job = NULL;
+    uint64_t one = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while ((pool->queue_head == NULL) && (pool->shutdown == 0))
+            pthread_cond_wait(&pool->cond,&pool->lock);
+
+        if (pool->queue_head == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job = pool->queue_head;
+        pool->queue_head = job->next;
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        smf_smtpd_event_job_run(pool,job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (write(pool->notify_fd,&one,sizeof(one)) != sizeof(one))
+            TRACE(TRACE_ERR,"failed to notify event loop: %s",strerror(errno));
+    }
+
+    return NULL;
+}
+
+static SMFEventPool_T *smf_smtpd_event_pool_new(SMFSettings_T *settings, SMFProcessQueue_T *q) {
+    SMFEventPool_T *pool = NULL;
+    sigset_t set, old_set;
+    int i;
+
+    pool = (SMFEventPool_T *)calloc(1,sizeof(SMFEventPool_T));
+    if (pool == NULL) {
+        TRACE(TRACE_ERR,"failed to allocate thread pool");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->cond,NULL);
+    pool->settings = settings;
+    pool->q = q;
+    pool->num_threads = (settings->event_threads > 0) ? settings->event_threads : 1;
+
+    /* a module, which isn't read-only, is not known to be thread-safe, 
+     * so it must not process two messages at once */
+    if ((pool->num_threads > 1) && (smf_modules_readonly(settings) == 0)) {
+        TRACE(TRACE_NOTICE,"not all modules are read-only, using a single filter thread");
+        pool->num_threads = 1;
+    }
+
+    if ((pool->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        TRACE(TRACE_ERR,"eventfd failed: %s",strerror(errno));
+        free(pool);
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *)calloc(pool->num_threads,sizeof(pthread_t));
+
+    /* signals are handled by the event loop thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK,&set,&old_set);
+    for (i = 0; i < pool->num_threads; i++) {
+        if (pthread_create(&pool->threads[i],NULL,smf_smtpd_event_worker,pool) != 0) {
+            TRACE(TRACE_ERR,"failed to start filter thread");
+            pool->num_threads = i;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+    if (pool->num_threads == 0) {
+        close(pool->notify_fd);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    TRACE(TRACE_DEBUG,"started %d filter threads",pool->num_threads);
+
+    return pool;
+}
+
+static void smf_smtpd_event_pool_submit(SMFEventPool_T *pool, SMFEventJob_T *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_tail != NULL)
+        pool->queue_tail->next = job;
+    else
+        pool->queue_head = job;
+    pool->queue_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait for queued jobs and stop all filter threads */
+static void smf_smtpd_event_pool_stop(SMFEventPool_T *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i],NULL);
+}
+
+static void smf_smtpd_event_pool_free(SMFEventPool_T *pool) {
+    close(pool->notify_fd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+}
+
+static void smf_smtpd_event_job_free(SMFEventJob_T *job) {
+    if (job->reply != NULL)
+        free(job->reply);
+    smf_internal_header_scan_free(&job->hs);
+    free(job);
+}
+
+/* queue a reply for the client */
+static void smf_smtpd_event_reply(SMFEventConn_T *conn, const char *format, ...) {
+    va_list ap;
+    int len;
+    size_t size;
+    char *p = NULL;
+
+    for (;;) {
+        va_start(ap, format);
+        len = vsnprintf(conn->out + conn->out_len, conn->out_size - conn->out_len, format, ap);
+        va_end(ap);
+
+        if (len < 0) {
+            TRACE(TRACE_ERR,"failed to write message");
+            return;
+        }
+
+        if ((size_t)len < conn->out_size - conn->out_len)
+            break;
+
+        size = conn->out_size + ((len + 1 > BUFSIZE) ? len + 1 : BUFSIZE);
+        if ((p = realloc(conn->out, size)) == NULL) {
+            TRACE(TRACE_ERR,"failed to allocate reply buffer");
+            return;
+        }
+        conn->out = p;
+        conn->out_size = size;
+    }
+
+    conn->out_len += len;
+}
+
+static void smf_smtpd_event_code_reply(SMFEventLoop_T *loop, SMFEventConn_T *conn, int code) {
+    smf_smtpd_event_reply(conn,"%s",smf_internal_reply_table_get(replies,code,NULL));
+}
+
+/* register the epoll events matching the connection phase */
+static void smf_smtpd_event_update(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    struct epoll_event ev;
+    int events = 0;
+
+    if (conn->fd < 0)
+        return;
+
+    if ((conn->phase == EV_PHASE_COMMAND) || (conn->phase == EV_PHASE_DATA))
+        events |= EPOLLIN;
+    if (conn->out_len > conn->out_off)
+        events |= EPOLLOUT;
+
+    if (events == conn->events)
+        return;
+
+    memset(&ev,0,sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        TRACE(TRACE_ERR,"epoll_ctl failed: %s",strerror(errno));
+    else
+        conn->events = events;
+}
+
+/* send pending replies, returns -1 if the client is gone */
+static int smf_smtpd_event_flush(SMFEventConn_T *conn) {
+    ssize_t n;
+
+    while (conn->out_off < conn->out_len) {
+        n = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            STRACE(TRACE_DEBUG,conn->session->id,"failed to write to client: %s",strerror(errno));
+            return -1;
+        }
+        conn->out_off += n;
+    }
+
+    conn->out_off = 0;
+    conn->out_len = 0;
+
+    return 0;
+}
+
+/* remove the spool file of an unfinished DATA transaction */
+static void smf_smtpd_event_abort_data(SMFEventConn_T *conn) {
+    if (conn->spool != NULL) {
+        fclose(conn->spool);
+        conn->spool = NULL;
+        if (smf_internal_spool_remove(conn->session) != 0)
+            STRACE(TRACE_ERR,conn->session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+    }
+
+    if (conn->job != NULL) {
+        smf_smtpd_event_job_free(conn->job);
+        conn->job = NULL;
+    }
+}
+
+static void smf_smtpd_event_conn_free(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    smf_smtpd_event_abort_data(conn);
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    loop->num_conns--;
+
+    smf_session_free(conn->session);
+    free(conn->out);
+    free(conn);
+}
+
+/* close the client connection. While a filter thread still works on the
+ * message, the connection is released once the job is returned. */
+static void smf_smtpd_event_close(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    if (conn->fd >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    if (conn->phase != EV_PHASE_FILTER)
+        smf_smtpd_event_conn_free(loop,conn);
+}
+
+
+/* replace the session of the connection, helo and xforward data are
+ * kept, if requested */
+static void smf_smtpd_event_new_session(SMFEventConn_T *conn, int keep_client) {
+    SMFSession_T *session = smf_session_new();
+
+    if (keep_client == 1) {
+        if (conn->session->helo != NULL)
+            smf_session_set_helo(session,conn->session->helo);
+        if (conn->session->xforward_addr != NULL)
+            session->xforward_addr = strdup(conn->session->xforward_addr);
+    }
+    session->sock = conn->fd;
+    if (conn->listener->name != NULL)
+        smf_session_set_listener(session,conn->listener->name);
+
+    smf_session_free(conn->session);
+    conn->session = session;
+}
+
+static char *smf_smtpd_event_get_req_value(char *req, int jmp) {
+    char *p = req + jmp;
+
+    /* jump over space, if exists */
+    if (*p == (char)32) p++;
+
+    return smf_core_strstrip(strdup(p));
+}
+
+/* start a read deadline for the connection */
+static void smf_smtpd_event_set_timer(SMFEventLoop_T *loop, SMFEventConn_T *conn, int timer) {
+    int timeout;
+
+    switch (timer) {
+        case EV_TIMER_COMMAND: timeout = loop->settings->smtpd_command_timeout; break;
+        case EV_TIMER_DATA: timeout = loop->settings->smtpd_data_timeout; break;
+        default: timeout = loop->settings->smtpd_timeout; break;
+    }
+
+    conn->timer = timer;
+    conn->deadline = (timeout > 0) ? time(NULL) + timeout : 0;
+}
+
+static void smf_smtpd_event_start_data(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    SMFSession_T *session = conn->session;
+    SMFSettings_T *settings = loop->settings;
+
+    if ((conn->job = (SMFEventJob_T *)calloc(1,sizeof(SMFEventJob_T))) == NULL) {
+        STRACE(TRACE_ERR,session->id,"failed to allocate job");
+        smf_smtpd_event_code_reply(loop,conn,451);
+        return;
+    }
+    conn->job->conn = conn;
+    conn->job->session = session;
+    conn->job->max_size = smf_server_get_max_size(loop->settings,conn->listener);
+    smf_internal_header_scan_init(&conn->job->hs);
+
+    conn->spool = smf_internal_spool_open(session,&conn->job->hs,settings->queue_dir,settings->spool_memory_limit);
+    if (conn->spool == NULL) {
+        STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
+        smf_smtpd_event_abort_data(conn);
+        smf_smtpd_event_code_reply(loop,conn,451);
+        return;
+    }
+
+    conn->bol = 1;
+    conn->spool_error = 0;
+    conn->size_exceeded = 0;
+    conn->state = ST_DATA;
+    conn->phase = EV_PHASE_DATA;
+    smf_smtpd_event_set_timer(loop,conn,EV_TIMER_DATA);
+
+    STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file);
+    smf_smtpd_event_reply(conn,"354 End data with <CR><LF>.<CR><LF>\r\n");
+}
+
+/* handle a single smtp command line */
+static void smf_smtpd_event_command(SMFEventLoop_T *loop, SMFEventConn_T *conn, char *req) {
+    SMFSettings_T *settings = loop->settings;
+    SMFListElem_T *elem = NULL;
+    char *req_value = NULL;
+    char *t = NULL;
+    unsigned long max_size;
+    unsigned long mail_size;
+
+    STRACE(TRACE_DEBUG,conn->session->id,"client smtp dialog: [%s]",req);
+
+    if (strncasecmp(req,"quit",4)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'quit' received");
+        smf_smtpd_event_code_reply(loop,conn,221);
+        conn->state = ST_QUIT;
+        conn->phase = EV_PHASE_CLOSE;
+    } else if( (strncasecmp(req, "helo", 4)==0) || (strncasecmp(req, "ehlo", 4)==0)) {
+        /* an EHLO later in the session resets the state, like RSET */
+        if (conn->state != ST_INIT) {
+            smf_smtpd_event_new_session(conn,0);
+            STRACE(TRACE_DEBUG,conn->session->id,"session reset, helo/ehlo recieved not in init state");
+        }
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'helo/ehlo' received");
+        req_value = smf_smtpd_event_get_req_value(req,4);
+        smf_session_set_helo(conn->session,req_value);
+
+        if (strcmp(conn->session->helo,"") == 0)  {
+            smf_smtpd_event_reply(conn,"501 Syntax: HELO hostname\r\n");
+        } else {
+            STRACE(TRACE_DEBUG,conn->session->id,"session->helo: [%s]",smf_session_get_helo(conn->session));
+
+            if (strncasecmp(req, "ehlo", 4)==0) {
+                smf_smtpd_event_reply(conn,
+                    "250-%s\r\n250-PIPELINING\r\n250-XFORWARD ADDR\r\n250 SIZE %lu\r\n",loop->hostname,
+                    smf_server_get_max_size(settings,conn->listener));
+            } else {
+                smf_smtpd_event_reply(conn,"250 %s\r\n",loop->hostname);
+            }
+            conn->state = ST_HELO;
+        }
+        free(req_value);
+    } else if (strncasecmp(req,"xforward",8)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'xforward' received");
+        t = strcasestr(req,"ADDR=");
+        if (t != NULL) {
+            t = strchr(t,'=');
+            smf_core_strstrip(++t);
+            smf_session_set_xforward_addr(conn->session,t);
+            STRACE(TRACE_DEBUG,conn->session->id,"session->xforward_addr: [%s]",smf_session_get_xforward_addr(conn->session));
+            smf_smtpd_event_code_reply(loop,conn,250);
+            conn->state = ST_XFWD;
+        } else {
+            smf_smtpd_event_reply(conn,"501 Syntax: XFORWARD attribute=value...\r\n");
+        }
+    } else if (strncasecmp(req, "mail from:", 10)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'mail from' received");
+        if (conn->state == ST_MAIL) {
+            smf_smtpd_event_reply(conn,"503 Error: nested MAIL command\r\n");
+        } else {
+            req_value = smf_smtpd_event_get_req_value(req,10);
+            max_size = smf_server_get_max_size(loop->settings,conn->listener);
+            if (strcmp(req_value,"") == 0) {
+                smf_smtpd_event_reply(conn,"501 Syntax: MAIL FROM:<address>\r\n");
+            } else if (smf_internal_parse_mail_params(req_value,&mail_size) != 0) {
+                smf_smtpd_event_reply(conn,"501 Syntax: MAIL FROM:<address> [SIZE=size]\r\n");
+            } else if ((max_size != 0) && (mail_size > max_size)) {
+                STRACE(TRACE_DEBUG,conn->session->id,"announced message size %lu exceeds limit",mail_size);
+                smf_smtpd_event_reply(conn,"552 message size exceeds fixed maximium message size\r\n");
+            } else {
+                smf_envelope_set_sender(conn->session->envelope,req_value);
+                STRACE(TRACE_DEBUG,conn->session->id,"session->envelope->sender: [%s]",conn->session->envelope->sender);
+                smf_smtpd_event_code_reply(loop,conn,250);
+                conn->state = ST_MAIL;
+            }
+            free(req_value);
+        }
+    } else if (strncasecmp(req, "rcpt to:", 8)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'rcpt to' received");
+        if ((conn->state != ST_MAIL) && (conn->state != ST_RCPT)) {
+            smf_smtpd_event_reply(conn,"503 Error: need MAIL command\r\n");
+        } else {
+            req_value = smf_smtpd_event_get_req_value(req,8);
+            if (strcmp(req_value,"") == 0) {
+                smf_smtpd_event_reply(conn,"501 Syntax: RCPT TO:<address>\r\n");
+            } else {
+                smf_envelope_add_rcpt(conn->session->envelope, req_value);
+                smf_smtpd_event_code_reply(loop,conn,250);
+                elem = smf_list_tail(conn->session->envelope->recipients);
+                STRACE(TRACE_DEBUG,conn->session->id,"session->envelope->recipients: [%s]",(char *)smf_list_data(elem));
+                conn->state = ST_RCPT;
+            }
+            free(req_value);
+        }
+    } else if (strncasecmp(req,"data", 4)==0) {
+        if ((conn->state != ST_RCPT) && (conn->state != ST_MAIL)) {
+            smf_smtpd_event_reply(conn,"503 Error: need RCPT command\r\n");
+        } else if (conn->state == ST_MAIL) {
+            smf_smtpd_event_reply(conn,"554 Error: no valid recipients\r\n");
+        } else {
+            STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'data' received");
+            smf_smtpd_event_start_data(loop,conn);
+        }
+    } else if (strncasecmp(req,"rset", 4)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'rset' received");
+        smf_smtpd_event_new_session(conn,0);
+        smf_smtpd_event_code_reply(loop,conn,250);
+        conn->state = ST_INIT;
+    } else if (strncasecmp(req, "noop", 4)==0) {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: 'noop' received");
+        smf_smtpd_event_code_reply(loop,conn,250);
+    } else {
+        STRACE(TRACE_DEBUG,conn->session->id,"SMTP: got unknown command");
+        smf_smtpd_event_reply(conn,"502 Error: command not recognized\r\n");
+    }
+}
+
+/* the final dot was received, pass the message to the filter threads */
+static void smf_smtpd_event_end_data(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    SMFSession_T *session = conn->session;
+
+    if ((conn->spool_error == 0) && (conn->size_exceeded == 0) && (smf_internal_spool_finish(session,conn->spool,&conn->job->hs) != 0))
+        conn->spool_error = 1;
+    if (fclose(conn->spool) != 0)
+        conn->spool_error = 1;
+    conn->spool = NULL;
+
+    if ((conn->spool_error == 1) || (conn->size_exceeded == 1)) {
+        if (conn->spool_error == 1)
+            STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        if (smf_internal_spool_remove(session) != 0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        smf_smtpd_event_job_free(conn->job);
+        conn->job = NULL;
+        conn->phase = EV_PHASE_COMMAND;
+        if (conn->size_exceeded == 1)
+            smf_smtpd_event_reply(conn,"552 message size exceeds fixed maximium message size\r\n");
+        else
+            smf_smtpd_event_code_reply(loop,conn,451);
+        return;
+    }
+
+    conn->phase = EV_PHASE_FILTER;
+    smf_smtpd_event_pool_submit(loop->pool,conn->job);
+    conn->job = NULL;
+}
+
+/* spool buffered message data, returns 1 once the message is complete */
+static int smf_smtpd_event_data(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    char *line = NULL;
+    char *p = NULL;
+    size_t avail, len;
+
+    while ((avail = conn->in_len - conn->in_off) > 0) {
+        line = conn->in + conn->in_off;
+
+        if ((p = memchr(line, '\n', avail)) != NULL) {
+            len = p - line + 1;
+        } else if ((conn->in_off == 0) && (conn->in_len == EV_BUFSIZE)) {
+            /* line exceeds the buffer, spool what we have */
+            len = avail;
+        } else {
+            return 0;
+        }
+
+        if (conn->bol == 1) {
+            if ((p != NULL) && (((len == 3) && (strncmp(line,".\r\n",3)==0)) || ((len == 2) && (strncmp(line,".\n",2)==0)))) {
+                conn->in_off += len;
+                smf_smtpd_event_end_data(loop,conn);
+                return 1;
+            }
+
+            /* dot-stuffing */
+            if (line[0] == '.') {
+                conn->in_off++;
+                line++;
+                len--;
+            }
+        }
+
+        /* oversized messages are read until the end, but not spooled */
+        if ((conn->job->max_size != 0) && (conn->session->message_size + len > conn->job->max_size)) {
+            if (conn->size_exceeded == 0)
+                STRACE(TRACE_DEBUG,conn->session->id,"max message size limit exceeded, discarding message");
+            conn->size_exceeded = 1;
+        } else if ((conn->spool_error == 0) && (smf_internal_spool_line(conn->session,conn->spool,&conn->job->hs,line,len) != 0))
+            conn->spool_error = 1;
+
+        conn->session->message_size += len;
+        conn->bol = (p != NULL) ? 1 : 0;
+        conn->in_off += len;
+    }
+
+    return 0;
+}
+
+/* handle buffered client input, depending on the connection phase */
+static void smf_smtpd_event_process(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    char *line = NULL;
+    char *p = NULL;
+    size_t len;
+    char c;
+
+    while ((conn->in_off < conn->in_len)
+            && ((conn->phase == EV_PHASE_COMMAND) || (conn->phase == EV_PHASE_DATA))) {
+        if (conn->phase == EV_PHASE_DATA) {
+            if (smf_smtpd_event_data(loop,conn) == 0)
+                break;
+            continue;
+        }
+
+        line = conn->in + conn->in_off;
+        if ((p = memchr(line, '\n', conn->in_len - conn->in_off)) == NULL) {
+            if ((conn->in_off == 0) && (conn->in_len == EV_BUFSIZE)) {
+                smf_smtpd_event_reply(conn,"500 Error: line too long\r\n");
+                conn->in_off = conn->in_len;
+            }
+            break;
+        }
+
+        len = p - line + 1;
+        c = line[len];
+        line[len] = '\0';
+        smf_smtpd_event_command(loop,conn,line);
+        line[len] = c;
+        conn->in_off += len;
+    }
+
+    /* move remaining input to the start of the buffer */
+    if (conn->in_off > 0) {
+        memmove(conn->in, conn->in + conn->in_off, conn->in_len - conn->in_off);
+        conn->in_len -= conn->in_off;
+        conn->in_off = 0;
+    }
+
+    /* the idle timer restarts after each complete command, a partial 
+     * command line keeps the deadline of its first bytes */
+    if (conn->phase == EV_PHASE_COMMAND) {
+        if (conn->in_len == 0)
+            smf_smtpd_event_set_timer(loop,conn,EV_TIMER_IDLE);
+        else if (conn->timer != EV_TIMER_COMMAND)
+            smf_smtpd_event_set_timer(loop,conn,EV_TIMER_COMMAND);
+    }
+}
+
+/* read from the client, returns -1 if the connection has been closed */
+static int smf_smtpd_event_read(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    ssize_t n;
+
+    for (;;) {
+        n = read(conn->fd, conn->in + conn->in_len, EV_BUFSIZE - conn->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            STRACE(TRACE_DEBUG,conn->session->id,"failed to read from client: %s",strerror(errno));
+            return -1;
+        }
+        break;
+    }
+
+    if (n == 0)
+        return -1;
+
+    conn->in_len += n;
+    smf_smtpd_event_process(loop,conn);
+
+    return 0;
+}
+
+/* flush replies and re-arm the connection, closes it if required */
+static void smf_smtpd_event_finish(SMFEventLoop_T *loop, SMFEventConn_T *conn) {
+    if (smf_smtpd_event_flush(conn) != 0) {
+        smf_smtpd_event_close(loop,conn);
+        return;
+    }
+
+    if ((conn->phase == EV_PHASE_CLOSE) && (conn->out_len == 0)) {
+        smf_smtpd_event_close(loop,conn);
+        return;
+    }
+
+    smf_smtpd_event_update(loop,conn);
+}
+
+static void smf_smtpd_event_accept(SMFEventLoop_T *loop, SMFServerListener_T *listener) {
+    SMFEventConn_T *conn = NULL;
+    struct sockaddr_storage sa;
+    struct epoll_event ev;
+    socklen_t slen;
+    char host[NI_MAXHOST];
+    int client;
+
+    for (;;) {
+        slen = sizeof(sa);
+        if ((client = accept4(listener->sd, (struct sockaddr *)&sa, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                TRACE(TRACE_ERR,"accept failed: %s",strerror(errno));
+            return;
+        }
+
+        if ((conn = (SMFEventConn_T *)calloc(1,sizeof(SMFEventConn_T))) == NULL) {
+            TRACE(TRACE_ERR,"failed to allocate connection");
+            close(client);
+            continue;
+        }
+
+        conn->fd = client;
+        conn->listener = listener;
+        conn->state = ST_INIT;
+        conn->phase = EV_PHASE_COMMAND;
+        conn->events = EPOLLIN;
+        smf_smtpd_event_set_timer(loop,conn,EV_TIMER_IDLE);
+        conn->session = smf_session_new();
+        conn->session->sock = client;
+        if (listener->name != NULL)
+            smf_session_set_listener(conn->session,listener->name);
+
+        memset(&ev,0,sizeof(ev));
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            TRACE(TRACE_ERR,"epoll_ctl failed: %s",strerror(errno));
+            smf_session_free(conn->session);
+            free(conn);
+            close(client);
+            continue;
+        }
+
+        conn->next = loop->conns;
+        if (loop->conns != NULL)
+            loop->conns->prev = conn;
+        loop->conns = conn;
+        loop->num_conns++;
+
+        if (smf_server_peer_name(client,host,sizeof(host)) != NULL) {
+            if (listener->name != NULL)
+                STRACE(TRACE_INFO,conn->session->id,"connect from %s on listener %s",host,listener->name);
+            else
+                STRACE(TRACE_INFO,conn->session->id,"connect from %s",host);
+        }
+
+        smf_smtpd_event_reply(conn,"220 %s spmfilter\r\n",loop->hostname);
+        smf_smtpd_event_finish(loop,conn);
+    }
+}
+
+/* collect finished jobs from the filter threads and send their replies */
+static void smf_smtpd_event_collect(SMFEventLoop_T *loop) {
+    SMFEventJob_T *job = NULL;
+    SMFEventJob_T *next = NULL;
+    SMFEventConn_T *conn = NULL;
+    uint64_t count;
+
+    if (read(loop->pool->notify_fd,&count,sizeof(count)) < 0 && errno != EAGAIN)
+        TRACE(TRACE_ERR,"failed to read eventfd: %s",strerror(errno));
+
+    pthread_mutex_lock(&loop->pool->lock);
+    job = loop->pool->done;
+    loop->pool->done = NULL;
+    pthread_mutex_unlock(&loop->pool->lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        conn = job->conn;
+        conn->phase = EV_PHASE_COMMAND;
+
+        if (conn->fd < 0) {
+            /* client went away while the message was processed */
+            smf_smtpd_event_conn_free(loop,conn);
+        } else {
+            smf_smtpd_event_reply(conn,"%s",job->reply);
+            smf_smtpd_event_new_session(conn,1);
+            smf_smtpd_event_set_timer(loop,conn,EV_TIMER_IDLE);
+
+            /* continue with pipelined commands */
+            if (event_exit == 0)
+                smf_smtpd_event_process(loop,conn);
+            smf_smtpd_event_finish(loop,conn);
+        }
+
+        smf_smtpd_event_job_free(job);
+    }
+}
+
+/* close connections, which missed their read deadline */
+static void smf_smtpd_event_timeouts(SMFEventLoop_T *loop) {
+    SMFEventConn_T *conn = NULL;
+    SMFEventConn_T *next = NULL;
+    time_t now = time(NULL);
+
+    for (conn = loop->conns; conn != NULL; conn = next) {
+        next = conn->next;
+
+        if ((conn->fd < 0) || (conn->phase == EV_PHASE_FILTER))
+            continue;
+
+        if ((conn->deadline != 0) && (now >= conn->deadline)) {
+            STRACE(TRACE_DEBUG,conn->session->id,"session timeout exceeded");
+            smf_smtpd_event_reply(conn,"421 %s Error: timeout exceeded\r\n",loop->hostname);
+            smf_smtpd_event_flush(conn);
+            smf_smtpd_event_close(loop,conn);
+        }
+    }
+}
+
+/* stop accepting connections. The sockets are still open in the sibling 
+ * loops and the new master, so they have to leave our epoll set first */
+static void smf_smtpd_event_listeners_close(SMFEventLoop_T *loop) {
+    int i;
+
+    for (i = 0; i < loop->num_listeners; i++) {
+        if ((loop->listeners[i].sd >= 0) && 
+                (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listeners[i].sd, NULL) < 0))
+            TRACE(TRACE_ERR,"epoll_ctl failed: %s",strerror(errno));
+    }
+
+    smf_server_listeners_close(loop->listeners,loop->num_listeners);
+}
+
+static void smf_smtpd_event_loop_run(SMFEventLoop_T *loop) {
+    struct epoll_event events[EV_MAX_EVENTS];
+    SMFEventConn_T *conn = NULL;
+    time_t last_check = time(NULL);
+    int draining = 0;
+    int collect;
+    int i, n;
+
+    while (event_exit == 0) {
+        /* a new master took over, stop accepting and let the open 
+         * connections finish */
+        if ((event_drain == 1) && (draining == 0)) {
+            TRACE(TRACE_DEBUG,"event loop [%d] draining %d connections",getpid(),loop->num_conns);
+            smf_smtpd_event_listeners_close(loop);
+            draining = 1;
+        }
+
+        if ((draining == 1) && (loop->num_conns == 0))
+            break;
+
+        n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, EV_TICK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            TRACE(TRACE_ERR,"epoll_wait failed: %s",strerror(errno));
+            break;
+        }
+
+        collect = 0;
+        for (i = 0; i < n; i++) {
+            if ((events[i].data.ptr >= (void *)loop->listeners) 
+                    && (events[i].data.ptr < (void *)(loop->listeners + loop->num_listeners))) {
+                smf_smtpd_event_accept(loop,(SMFServerListener_T *)events[i].data.ptr);
+            } else if (events[i].data.ptr == loop->pool) {
+                /* finished jobs may close and free connections, which 
+                 * later events of this batch still point to */
+                collect = 1;
+            } else {
+                conn = (SMFEventConn_T *)events[i].data.ptr;
+
+                /* closed, waiting for its filter thread */
+                if (conn->fd < 0)
+                    continue;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    smf_smtpd_event_close(loop,conn);
+                    continue;
+                }
+
+                if ((events[i].events & EPOLLIN) && (smf_smtpd_event_read(loop,conn) != 0)) {
+                    smf_smtpd_event_close(loop,conn);
+                    continue;
+                }
+
+                smf_smtpd_event_finish(loop,conn);
+            }
+        }
+
+        if (collect == 1)
+            smf_smtpd_event_collect(loop);
+
+        if (time(NULL) != last_check) {
+            last_check = time(NULL);
+            smf_smtpd_event_timeouts(loop);
+        }
+    }
+}
+
+/* event loop process, serves connections until SIGTERM */
+static void smf_smtpd_event_child(SMFSettings_T *settings, SMFServerListener_T *listeners, int num_listeners) {
+    SMFEventLoop_T loop;
+    SMFProcessQueue_T *q = NULL;
+    struct epoll_event ev;
+    int i;
+
+    memset(&loop,0,sizeof(loop));
+    loop.listeners = listeners;
+    loop.num_listeners = num_listeners;
+    loop.settings = settings;
+    gethostname(loop.hostname,MAXHOSTNAMELEN);
+
+    q = smf_modules_pqueue_init(
+        smf_smtpd_event_handle_q_error,
+        smf_smtpd_event_handle_q_processing_error,
+        smf_smtpd_event_handle_nexthop_error
+    );
+
+    if (q == NULL) {
+        TRACE(TRACE_ERR,"failed to initialize module queue");
+        exit(EXIT_FAILURE);
+    }
+
+    if (smf_modules_child_init(settings) != 0)
+        exit(EXIT_FAILURE);
+
+    if ((replies = smf_internal_reply_table_new(settings->smtp_codes)) == NULL) {
+        TRACE(TRACE_ERR,"failed to build reply table");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((loop.pool = smf_smtpd_event_pool_new(settings,q)) == NULL)
+        exit(EXIT_FAILURE);
+
+    if ((loop.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        TRACE(TRACE_ERR,"epoll_create failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_listeners; i++) {
+        memset(&ev,0,sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listeners[i];
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listeners[i].sd, &ev) < 0) {
+            TRACE(TRACE_ERR,"epoll_ctl failed: %s",strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop.pool;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.pool->notify_fd, &ev) < 0) {
+        TRACE(TRACE_ERR,"epoll_ctl failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    smf_smtpd_event_loop_run(&loop);
+
+    TRACE(TRACE_DEBUG,"event loop [%d] stopping, %d open connections",getpid(),loop.num_conns);
+    smf_server_listeners_close(loop.listeners,loop.num_listeners);
+
+    /* let the filter threads finish their messages and send the replies */
+    smf_smtpd_event_pool_stop(loop.pool);
+    smf_smtpd_event_collect(&loop);
+
+    while (loop.conns != NULL)
+        smf_smtpd_event_close(&loop,loop.conns);
+
+    smf_smtpd_event_pool_free(loop.pool);
+    smf_modules_fini(settings);
+    smf_internal_reply_table_free(replies);
+    close(loop.epfd);
+    free(q);
+}
+
+static pid_t smf_smtpd_event_fork(SMFSettings_T *settings, SMFServerListener_T *listeners, int num_listeners) {
+    pid_t pid;
+    sigset_t mask;
+
+    switch(pid = fork()) {
+        case -1:
+            TRACE(TRACE_ERR,"fork() failed: %s",strerror(errno));
+            break;
+        case 0:
+            /* the master blocks its signals outside of pselect() */
+            signal(SIGCHLD, SIG_DFL);
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            smf_smtpd_event_child(settings,listeners,num_listeners);
+            smf_settings_free(settings);
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            TRACE(TRACE_DEBUG,"forked event loop [%d]",pid);
+            break;
+    }
+
+    return pid;
+}
+
+int load(SMFSettings_T *settings) {
+    pid_t *childs = NULL;
+    pid_t pid;
+    int num_childs;
+    SMFServerListener_T *listeners = NULL;
+    int num_listeners = 0;
+    int i, status;
+    pid_t upgrade_pid = 0;
+    pid_t *retired = NULL;
+    int num_retired = 0;
+    sigset_t block_mask, orig_mask;
+    struct timespec tick;
+
+    num_childs = (settings->event_processes > 0) ? settings->event_processes : 1;
+
+    if ((listeners = smf_server_listen(settings,&num_listeners)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_listeners; i++) {
+        if (fcntl(listeners[i].sd, F_SETFL, fcntl(listeners[i].sd, F_GETFL) | O_NONBLOCK) < 0) {
+            TRACE(TRACE_ERR,"failed to set listening socket non-blocking: %s",strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    smf_server_daemonize(settings);
+    smf_smtpd_event_sig_init();
+
+    /* signals are only delivered while we wait in pselect(), so none 
+     * of them gets lost between checking the flags and waiting */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGCHLD);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGUSR2);
+    sigaddset(&block_mask, SIGQUIT);
+    sigaddset(&block_mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    TRACE(TRACE_NOTICE, "starting spmfilter daemon");
+
+    childs = (pid_t *)calloc(num_childs,sizeof(pid_t));
+
+    for (i = 0; i < num_childs; i++)
+        childs[i] = smf_smtpd_event_fork(settings,listeners,num_listeners);
+
+    /* our event loops are running, the old master may stop now */
+    smf_server_upgrade_done();
+
+    while ((event_exit == 0) && (event_drain == 0)) {
+        if (event_upgrade == 1) {
+            event_upgrade = 0;
+            if (upgrade_pid > 0)
+                TRACE(TRACE_WARNING,"new master [%d] is still starting",upgrade_pid);
+            else
+                upgrade_pid = smf_server_upgrade(listeners,num_listeners);
+        }
+
+        if (event_reload == 1) {
+            event_reload = 0;
+            if (smf_server_reload(settings) == 0) {
+                /* the running event loops finish their connections with 
+                 * the old configuration, new ones are started below */
+                retired = (pid_t *)realloc(retired,(num_retired + num_childs) * sizeof(pid_t));
+                for (i = 0; i < num_childs; i++) {
+                    if (childs[i] > 0) {
+                        kill(childs[i],SIGQUIT);
+                        retired[num_retired++] = childs[i];
+                    }
+                }
+
+                free(childs);
+                num_childs = (settings->event_processes > 0) ? settings->event_processes : 1;
+                childs = (pid_t *)calloc(num_childs,sizeof(pid_t));
+            }
+        }
+
+        /* (re)start missing event loop processes */
+        for (i = 0; i < num_childs; i++)
+            if (childs[i] <= 0)
+                childs[i] = smf_smtpd_event_fork(settings,listeners,num_listeners);
+
+        /* wake up, when an event loop exits or a signal arrives */
+        if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
+            tick.tv_sec = 1;
+            tick.tv_nsec = 0;
+            pselect(0, NULL, NULL, NULL, &tick, &orig_mask);
+            continue;
+        }
+
+        if (pid == upgrade_pid) {
+            if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                TRACE(TRACE_ERR,"new master [%d] failed to start",pid);
+            upgrade_pid = 0;
+            continue;
+        }
+
+        for (i = 0; i < num_retired; i++) {
+            if (retired[i] == pid) {
+                TRACE(TRACE_DEBUG,"retired event loop [%d] exited",pid);
+                retired[i] = retired[--num_retired];
+                pid = 0;
+                break;
+            }
+        }
+        if (pid == 0)
+            continue;
+
+        for (i = 0; i < num_childs; i++) {
+            if (childs[i] == pid) {
+                TRACE(TRACE_ERR,"event loop [%d] exited unexpectedly, restarting",pid);
+                childs[i] = 0;
+                /* don't spin, if the event loops fail immediately */
+                sleep(1);
+                break;
+            }
+        }
+    }
+
+    if (event_drain == 1) {
+        /* the new master owns the listeners and the pid file now */
+        TRACE(TRACE_NOTICE, "stopping spmfilter daemon, waiting for active sessions");
+        smf_server_listeners_close(listeners,num_listeners);
+    } else {
+        TRACE(TRACE_NOTICE, "stopping spmfilter daemon");
+    }
+    smf_server_listeners_free(listeners,num_listeners);
+
+    for (i = 0; i < num_childs; i++)
+        if (childs[i] > 0)
+            kill(childs[i],(event_drain == 1) ? SIGQUIT : SIGTERM);
+
+    for (i = 0; i < num_retired; i++)
+        kill(retired[i],(event_drain == 1) ? SIGQUIT : SIGTERM);
+
+    /* a new master started in foreground is our child, too */
+    for (i = 0; i < num_childs; i++)
+        if (childs[i] > 0)
+            waitpid(childs[i],NULL,0);
+    for (i = 0; i < num_retired; i++)
+        waitpid(retired[i],NULL,0);
+
+    free(retired);
+    free(childs);
+    if ((settings->pid_file != NULL) && (event_drain == 0))
+        unlink(settings->pid_file);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2017 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SMF_SMTPD_EVENT_H
+#define _SMF_SMTPD_EVENT_H
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "smf_settings.h"
+#include "smf_session.h"
+#include "smf_modules.h"
+#include "smf_server.h"
+#include "smf_internal.h"
+
+#define EV_BUFSIZE 8192
+#define EV_MAX_EVENTS 256
+#define EV_TICK 1000
+
+/* connection phases */
+#define EV_PHASE_COMMAND 0 /* reading smtp commands */
+#define EV_PHASE_DATA 1 /* reading message content */
+#define EV_PHASE_FILTER 2 /* message is processed by a filter thread */
+#define EV_PHASE_CLOSE 3 /* flush pending replies, then close */
+
+/* running read deadlines */
+#define EV_TIMER_IDLE 0 /* waiting for the next command, smtpd_timeout */
+#define EV_TIMER_COMMAND 1 /* a command line is partially received, smtpd_command_timeout */
+#define EV_TIMER_DATA 2 /* receiving message content, smtpd_data_timeout */
+
+typedef struct _SMFEventConn_T SMFEventConn_T;
+
+typedef struct _SMFEventJob_T {
+    SMFEventConn_T *conn; /**< connection, which submitted the message */
+    SMFSession_T *session; /**< session of the connection */
+    header_scan_t hs; /**< header fields found in the message */
+    unsigned long max_size; /**< message size limit of the listener */
+    char *reply; /**< smtp reply, set by the filter thread */
+    struct _SMFEventJob_T *next;
+} SMFEventJob_T;
+
+struct _SMFEventConn_T {
+    int fd; /**< client socket, -1 if already closed */
+    SMFServerListener_T *listener; /**< listener, which accepted the connection */
+    int state; /**< smtp state, see ST_* */
+    int phase; /**< connection phase, see EV_PHASE_* */
+    int events; /**< registered epoll events */
+    SMFSession_T *session; /**< current smtp session */
+    SMFEventJob_T *job; /**< job of the running DATA transaction */
+    FILE *spool; /**< spool file of the running DATA transaction */
+    int bol; /**< next byte of the message starts a new line */
+    int spool_error; /**< writing the spool file failed */
+    int size_exceeded; /**< message exceeds the size limit, the rest is discarded */
+    char in[EV_BUFSIZE + 1]; /**< input buffer */
+    size_t in_off; /**< offset of unprocessed input */
+    size_t in_len; /**< end of buffered input */
+    char *out; /**< pending replies */
+    size_t out_off; /**< bytes of out already sent */
+    size_t out_len; /**< bytes in out */
+    size_t out_size; /**< allocated size of out */
+    int timer; /**< running read deadline, see EV_TIMER_* */
+    time_t deadline; /**< the client is disconnected after this time, 0 for none */
+    SMFEventConn_T *prev;
+    SMFEventConn_T *next;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SMFEventJob_T *queue_head; /**< jobs waiting for a filter thread */
+    SMFEventJob_T *queue_tail;
+    SMFEventJob_T *done; /**< finished jobs, collected by the event loop */
+    int notify_fd; /**< eventfd, signals finished jobs */
+    int shutdown; /**< stop filter threads, once the queue is empty */
+    int num_threads;
+    pthread_t *threads;
+    SMFSettings_T *settings;
+    SMFProcessQueue_T *q;
+} SMFEventPool_T;
+
+typedef struct {
+    int epfd; /**< epoll instance */
+    SMFServerListener_T *listeners; /**< listening sockets */
+    int num_listeners;
+    char hostname[MAXHOSTNAMELEN];
+    SMFEventConn_T *conns; /**< list of open connections */
+    int num_conns;
+    SMFEventPool_T *pool;
+    SMFSettings_T *settings;
+} SMFEventLoop_T;
+
+#endif  /* _SMF_SMTPD_EVENT_H */
@@ -36,11 +36,14 @@
 /* db4 */
 #cmakedefine HAVE_DB4
 
-/* sysv semaphores */
-#cmakedefine HAVE_SYSV_SEMAPHORE
+/* epoll */
+#cmakedefine HAVE_EPOLL
 
-/* posix semaphores */
-#cmakedefine HAVE_POSIX_SEMAPHORE
+/* splice */
+#cmakedefine HAVE_SPLICE
+
+/* memfd_create */
+#cmakedefine HAVE_MEMFD
 
 #endif /* _SPMFILTER_CONFIG_H */
 
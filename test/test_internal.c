@@ -43,6 +43,84 @@ int remove_testfile(char *absolute_path_to_file) {
     return 0;
 }
 
+/* spools msg line by line, the way the smtpd engine does, and returns
+ * the spooled message */
+char *spool_message(SMFSession_T *session, unsigned long mem_limit, const char *msg) {
+    header_scan_t hs;
+    FILE *fp = NULL;
+    const char *p = msg;
+    const char *eol = NULL;
+    char *out = NULL;
+    size_t len;
+    struct stat st;
+
+    smf_internal_header_scan_init(&hs);
+    if ((fp = smf_internal_spool_open(session,&hs,test_queue_dir,mem_limit)) == NULL)
+        return NULL;
+
+    while (*p != '\0') {
+        len = ((eol = strchr(p,'\n')) != NULL) ? (size_t)(eol - p + 1) : strlen(p);
+        if (smf_internal_spool_line(session,fp,&hs,p,len) != 0) {
+            smf_internal_header_scan_free(&hs);
+            fclose(fp);
+            return NULL;
+        }
+        p += len;
+    }
+
+    if (smf_internal_spool_finish(session,fp,&hs) != 0) {
+        smf_internal_header_scan_free(&hs);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    if (smf_internal_append_missing_headers(session,test_queue_dir,&hs) != 0)
+        return NULL;
+
+    if (((fp = fopen(session->message_file,"r")) == NULL) || (fstat(fileno(fp),&st) != 0))
+        return NULL;
+
+    out = calloc(st.st_size + 1,sizeof(char));
+    if (fread(out,sizeof(char),st.st_size,fp) != (size_t)st.st_size) {
+        free(out);
+        out = NULL;
+    }
+    fclose(fp);
+
+    return out;
+}
+
+/* checks that out is msg, preceded by exactly the given header
+ * lines, which end with the line break nl */
+int check_spooled(const char *out, const char *msg, const char *nl, const char **headers) {
+    size_t out_len = strlen(out);
+    size_t msg_len = strlen(msg);
+    const char *end = out + out_len - msg_len;
+    const char *t = NULL;
+    int lines = 0;
+    int i;
+
+    if ((out_len < msg_len) || (strcmp(end,msg) != 0))
+        return -1;
+
+    for (i = 0; headers[i] != NULL; i++) {
+        if (((t = strstr(out,headers[i])) == NULL) || (t >= end))
+            return -1;
+    }
+
+    /* nothing else has been added */
+    for (t = out; t < end; t++) {
+        if (*t != '\n')
+            continue;
+        if ((strcmp(nl,CRLF) == 0) != ((t > out) && (*(t - 1) == '\r')))
+            return -1;
+        lines++;
+    }
+
+    return (lines == i) ? 0 : -1;
+}
+
 int main (int argc, char const *argv[]) {
 	
 
@@ -52,8 +130,23 @@ int main (int argc, char const *argv[]) {
 	char *out_s = "this is a test message";
 	char buf[MAXLINE];
 	void *rl = NULL;
+	readline_t srl;
+	int pfd[2];
+	char *line = NULL;
+	header_scan_t hs;
+	unsigned long size;
+	SMFDict_T *codes = NULL;
+	reply_table_t *replies = NULL;
+	size_t reply_len;
 	char *out_f = NULL;
     char *res = NULL;
+    SMFSession_T *session = NULL;
+    const char *msg = NULL;
+    char *spooled = NULL;
+    char *big = NULL;
+    SMFMessage_T *message = NULL;
+    FILE *fp = NULL;
+    char *t = NULL;
 
 	asprintf(&out_f, "%s/%s", SAMPLES_DIR, "test_smf_internal.txt");
 
@@ -79,6 +172,22 @@ int main (int argc, char const *argv[]) {
     free(res);
 
 
+	printf("* testing smf_internal_parse_mail_params()...\t\t\t");
+	res = strdup("<user@example.org> BODY=7BIT SIZE=4096");
+	if ((smf_internal_parse_mail_params(res,&size) != 0) || (size != 4096) || (strcmp(res,"<user@example.org>") != 0)) {
+		printf("failed\n");
+		return -1;
+	}
+	free(res);
+	res = strdup("<> SIZE=x");
+	if (smf_internal_parse_mail_params(res,&size) != -1) {
+		printf("failed\n");
+		return -1;
+	}
+	free(res);
+	printf("passed\n");
+
+
 	printf("* testing smf_internal_writen() \t\t\t\t");
 	fd = open(out_f, O_WRONLY | O_CREAT | O_TRUNC, mode);
 	smf_internal_writen(fd,out_s,strlen(out_s));
@@ -104,6 +213,150 @@ int main (int argc, char const *argv[]) {
 	}
 	printf("passed\n");
 
+    printf("* testing smf_internal_readline_slice()\t\t\t\t");
+    if (pipe(pfd) != 0) {
+        printf("failed\n");
+        return -1;
+    }
+    smf_internal_writen(pfd[1],"HELO localhost\r\nDATA\nlast line",30);
+    close(pfd[1]);
+    smf_internal_readline_init(&srl);
+    if ((smf_internal_readline_slice(pfd[0],&srl,&line) != 16) || (strncmp(line,"HELO localhost\r\n",16) != 0) ||
+        (smf_internal_readline_slice(pfd[0],&srl,&line) != 5) || (strncmp(line,"DATA\n",5) != 0) ||
+        (smf_internal_readline_slice(pfd[0],&srl,&line) != 9) || (strncmp(line,"last line",9) != 0) ||
+        (smf_internal_readline_slice(pfd[0],&srl,&line) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    close(pfd[0]);
+    printf("passed\n");
+
+
+    printf("* testing smf_internal_header_scan()\t\t\t\t");
+    smf_internal_header_scan_init(&hs);
+    smf_internal_header_scan(&hs,"Subject: test\r\n",15);
+    smf_internal_header_scan(&hs,"\tfolded\r\n",9);
+    smf_internal_header_scan(&hs,"message-id : <1@localhost>\r\n",28);
+    smf_internal_header_scan(&hs,"\r\n",2);
+    smf_internal_header_scan(&hs,"To: body@localhost\r\n",20);
+    if ((hs.in_header != 0) || (hs.found_header != 1) || (strcmp(hs.nl,CRLF) != 0) || 
+        (hs.pos[HDR_MESSAGE_ID] != 24) || (hs.pos[HDR_TO] != -1) || (hs.pos[HDR_DATE] != -1)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_line()...\t\t\t\t");
+    session = smf_session_new();
+    smf_envelope_set_sender(session->envelope,"sender@example.org");
+    msg = "Subject: test\n\nbody\n";
+    if (((spooled = spool_message(session,0,msg)) == NULL) ||
+            (strncmp(spooled,"Message-Id: ",12) != 0) ||
+            (check_spooled(spooled,msg,LF,(const char *[]){"Message-Id: ","Date: ",
+                "From: sender@example.org\n","To: undisclosed-recipients:;\n",NULL}) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_line() with CRLF...\t\t");
+    msg = "From: author@example.org\r\nmessage-id: <1@localhost>\r\n\r\nTo: body@example.org\r\n";
+    if (((spooled = spool_message(session,BUFSIZE,msg)) == NULL) ||
+            (check_spooled(spooled,msg,CRLF,(const char *[]){"Date: ","To: undisclosed-recipients:;\r\n",NULL}) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_finish()...\t\t\t");
+    /* header block only, without an empty line */
+    msg = "Subject: test\r\nDate: Thu, 1 Jan 2015 00:00:00 +0000\r\nFrom: author@example.org\r\nTo: rcpt@example.org\r\n";
+    if (((spooled = spool_message(session,BUFSIZE,msg)) == NULL) ||
+            (check_spooled(spooled,msg,CRLF,(const char *[]){"Message-Id: ",NULL}) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    /* no header at all, the body is separated by an empty line */
+    msg = "body\r\n";
+    if (((spooled = spool_message(session,BUFSIZE,msg)) == NULL) ||
+            (strstr(spooled,"To: undisclosed-recipients:;\r\n\r\nbody\r\n") == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_line() with large header...\t");
+    big = strdup("Subject: test\r\n");
+    while (strlen(big) <= HEADER_BLOCK_MAX)
+        smf_core_strcat_printf(&big,"X-Padding: %080d\r\n",0);
+    smf_core_strcat_printf(&big,"\r\nbody\r\n");
+    /* the header block is spooled as is and the missing headers are added afterwards */
+    if (((spooled = spool_message(session,HEADER_BLOCK_MAX * 4,big)) == NULL) ||
+            (strncmp(session->message_file,"/proc/",6) == 0) ||
+            (check_spooled(spooled,big,CRLF,(const char *[]){"Message-Id: ","Date: ",
+                "From: sender@example.org\r\n","To: undisclosed-recipients:;\r\n",NULL}) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    free(big);
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_line() with memory limit...\t");
+    /* the body exceeds the memory spool, which is moved to queue_dir */
+    big = strdup("Subject: test\n\n");
+    while (strlen(big) <= BUFSIZE * 4)
+        smf_core_strcat_printf(&big,"%080d\n",0);
+    if (((spooled = spool_message(session,BUFSIZE,big)) == NULL) ||
+            (strncmp(session->message_file,"/proc/",6) == 0) ||
+            (check_spooled(spooled,big,LF,(const char *[]){"Message-Id: ","Date: ",
+                "From: sender@example.org\n","To: undisclosed-recipients:;\n",NULL}) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_internal_spool_remove(session);
+    free(big);
+    printf("passed\n");
+
+    printf("* testing smf_internal_spool_flush_header()...\t\t");
+    /* the message is loaded with its body, as after a body rewrite, 
+     * but only the header block may be flushed */
+    msg = "Subject: test\r\n\r\nbody line\r\n";
+    message = smf_message_new();
+    if (((spooled = spool_message(session,0,msg)) == NULL) ||
+            (smf_message_from_file(&message,session->message_file,0) != 0) ||
+            (smf_message_add_header(message,"X-Flushed","yes") != 0) ||
+            (smf_internal_spool_flush_header(session,test_queue_dir,message) != 0) ||
+            ((fp = smf_internal_spool_fopen(session)) == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    spooled = calloc(BUFSIZE * 4,sizeof(char));
+    fread(spooled,sizeof(char),BUFSIZE * 4 - 1,fp);
+    fclose(fp);
+    /* the body follows the header block exactly once */
+    if ((strstr(spooled,"X-Flushed: yes\r\n") == NULL) || (strstr(spooled,"Subject: test\r\n") == NULL) ||
+            ((t = strstr(spooled,"\r\n\r\nbody line\r\n")) == NULL) || (strcmp(t,"\r\n\r\nbody line\r\n") != 0) ||
+            (strstr(spooled,"body line") != t + 4)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(spooled);
+    smf_message_free(message);
+    smf_internal_spool_remove(session);
+    smf_session_free(session);
+    printf("passed\n");
 
     printf("* testing smf_internal_determine_linebreak with CRLF() \t\t");
     if(strcmp(smf_internal_determine_linebreak(test_internal_determine_linebreak_CRLF),CRLF) != 0) {
@@ -126,6 +379,24 @@ int main (int argc, char const *argv[]) {
     }
     printf("passed\n");
 
+    printf("* testing smf_internal_reply_table_new()...\t\t\t");
+    codes = smf_dict_new();
+    smf_dict_set(codes,"550","mailbox unavailable");
+    if ((replies = smf_internal_reply_table_new(codes)) == NULL) {
+        printf("failed\n");
+        return -1;
+    }
+    if ((strcmp(smf_internal_reply_table_get(replies,550,&reply_len),"550 mailbox unavailable\r\n") != 0) ||
+            (reply_len != 25) ||
+            (strcmp(smf_internal_reply_table_get(replies,250,NULL),CODE_250) != 0) ||
+            (strcmp(smf_internal_reply_table_get(replies,999,NULL),CODE_451) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    smf_internal_reply_table_free(replies);
+    smf_dict_free(codes);
+    printf("passed\n");
+
 
     close(fd);
     remove_testfile(out_f);
@@ -18,14 +18,18 @@
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <check.h>
 #include <stdio.h>
+#include <string.h>
 #include <utime.h>
 
 #include "../src/smf_modules.h"
 #include "../src/smf_session.h"
 #include "../src/smf_settings.h"
 #include "../src/smf_settings_private.h"
+#include "../src/smf_message_private.h"
+#include "../src/smf_internal.h"
 
 #include "test.h"
 #include "test_params.h"
@@ -108,7 +112,32 @@ static int mod3(SMFSettings_T *set, SMFSession_T *s) {
     return mod3_data.rc;
 }
 
+/* read-only modules get a private copy of the session */
+static int readonly1(SMFSettings_T *set, SMFSession_T *s) {
+    fail_unless(set == settings);
+    fail_unless(session != s);
+    fail_unless(strcmp(session->id, s->id) == 0);
+    mod1_data.count++;
+    return mod1_data.rc;
+}
+
+static int readonly2(SMFSettings_T *set, SMFSession_T *s) {
+    fail_unless(set == settings);
+    fail_unless(session != s);
+    fail_unless(s->response_msg == NULL);
+    smf_session_set_response_msg(s, "rejected by readonly2");
+    mod2_data.count++;
+    return mod2_data.rc;
+}
+
 static int message_file_changed_cb(SMFSettings_T *set, SMFSession_T *s) {
+  smf_session_mark_body_dirty(s);
+  fail_unless(smf_session_is_body_dirty(s) == 1);
+
+  return 0;
+}
+
+static int message_file_touched_cb(SMFSettings_T *set, SMFSession_T *s) {
   struct stat fstat;
   struct utimbuf times;
 
@@ -120,6 +149,17 @@ static int message_file_changed_cb(SMFSettings_T *set, SMFSession_T *s) {
   return 0;
 }
 
+static int header_changed_cb(SMFSettings_T *set, SMFSession_T *s) {
+    SMFMessage_T *msg = smf_envelope_get_message(s->envelope);
+
+    fail_unless(smf_message_journal_get(msg) == NULL);
+    fail_unless(smf_message_update_header(msg, "X-Journal", "1") == 0);
+    fail_unless(smf_message_journal_get(msg) != NULL);
+    fail_unless(smf_list_size(smf_message_journal_get(msg)) == 1);
+
+    return 0;
+}
+
 static int error_cb(SMFSettings_T *set, SMFSession_T *ses) {
     fail_unless(settings == set);
     fail_unless(session == ses);
@@ -173,6 +213,10 @@ START_TEST(create_invoke_destroy) {
     SMFModule_T *module;
 
     fail_unless((module = smf_module_create(settings, "testmod1")) !=  NULL);
+    fail_unless(module->load != NULL);
+    fail_unless(module->init == NULL);
+    fail_unless(module->fini == NULL);
+    fail_unless(module->flags == SMF_MODULE_DEFAULT);
     fail_unless(smf_module_invoke(settings, module, session) == 0);
     fail_unless(smf_module_destroy(module) == 0);
 }
@@ -320,6 +364,183 @@ START_TEST(message_file_changed) {
   fail_unless(smf_module_invoke(settings, module, session) == 0);
   fail_unless(smf_module_destroy(module) == 0);
   fail_unless(old_msg_ptr != session->envelope->message); /* Reloaded */
+  fail_unless(smf_session_is_body_dirty(session) == 0);
+}
+END_TEST
+
+START_TEST(message_file_changed_undeclared) {
+  SMFModule_T *module;
+  SMFMessage_T *old_msg_ptr;
+
+  fail_unless((old_msg_ptr = session->envelope->message) != NULL);
+  fail_unless((module = smf_module_create_callback(settings, "foo", message_file_changed_cb)) != NULL);
+  module->flags &= ~SMF_MODULE_MODIFIES_BODY;
+  fail_unless(smf_module_invoke(settings, module, session) == 0);
+  fail_unless(smf_module_destroy(module) == 0);
+  fail_unless(old_msg_ptr == session->envelope->message); /* Not reloaded */
+}
+END_TEST
+
+START_TEST(message_file_not_marked) {
+  SMFModule_T *module;
+  SMFMessage_T *old_msg_ptr;
+
+  fail_unless((old_msg_ptr = session->envelope->message) != NULL);
+  fail_unless((module = smf_module_create_callback(settings, "foo", message_file_touched_cb)) != NULL);
+  fail_unless(smf_module_invoke(settings, module, session) == 0);
+  fail_unless(smf_module_destroy(module) == 0);
+  fail_unless(old_msg_ptr == session->envelope->message); /* Not reloaded */
+}
+END_TEST
+
+START_TEST(init_fini) {
+    SMFModule_T *module;
+
+    fail_unless((module = smf_module_create(settings, "testmod2")) != NULL);
+    fail_unless(module->init != NULL);
+    fail_unless(module->child_init != NULL);
+    fail_unless(module->fini != NULL);
+    fail_unless(module->flags == SMF_MODULE_READONLY);
+    smf_list_append(settings->modules, module);
+
+    fail_unless(smf_modules_init(settings) == 0);
+    fail_unless(smf_modules_child_init(settings) == 0);
+    smf_modules_fini(settings);
+}
+END_TEST
+
+START_TEST(process_parallel) {
+    SMFModule_T *module;
+
+    fail_unless((module = smf_module_create_callback(settings, "readonly1", readonly1)) != NULL);
+    module->flags = SMF_MODULE_READONLY;
+    smf_list_append(settings->modules, module);
+    fail_unless((module = smf_module_create_callback(settings, "readonly2", readonly2)) != NULL);
+    module->flags = SMF_MODULE_READONLY;
+    smf_list_append(settings->modules, module);
+    smf_list_append(settings->modules, smf_module_create_callback(settings, "mod3", mod3));
+    smf_settings_set_module_threads(settings, 2);
+
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(mod1_data.count == 1);
+    fail_unless(mod2_data.count == 1);
+    fail_unless(mod3_data.count == 1);
+    fail_unless(processing_error_data.count == 0);
+
+    // the verdict of readonly2 stops the queue, after both have run
+    mod2_data.rc = 1;
+    processing_error_data.rc = 1;
+
+    fail_unless(smf_modules_process(queue, session, settings) == 1);
+    fail_unless(mod1_data.count == 2);
+    fail_unless(mod2_data.count == 2);
+    fail_unless(mod3_data.count == 1);
+    fail_unless(processing_error_data.count == 1);
+    fail_unless(strcmp(smf_session_get_response_msg(session), "rejected by readonly2") == 0);
+}
+END_TEST
+
+START_TEST(process_route) {
+    SMFModuleRoute_T *route;
+
+    smf_list_append(settings->modules, smf_module_create_callback(settings, "mod1", mod1));
+    smf_list_append(settings->modules, smf_module_create_callback(settings, "mod2", mod2));
+    smf_list_append(settings->modules, smf_module_create_callback(settings, "mod3", mod3));
+
+    smf_settings_add_route(settings, strdup("relay"));
+    smf_dict_set(settings->groups, "route:relay:client", "10.0.0.0/8, 2001:db8::/32");
+    smf_dict_set(settings->groups, "route:relay:recipient_domain", "Example.com");
+    smf_dict_set(settings->groups, "route:relay:modules", "mod3, mod1");
+    fail_unless(smf_modules_routes_compile(settings) == 0);
+
+    smf_session_set_xforward_addr(session, "10.1.2.3");
+    smf_envelope_add_rcpt(session->envelope, "<user@example.COM>");
+    fail_unless((route = smf_modules_route_find(settings, session)) != NULL);
+    fail_unless(strcmp(route->name, "relay") == 0);
+    fail_unless(smf_list_size(route->modules) == 2);
+
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(mod1_data.count == 1);
+    fail_unless(mod2_data.count == 0);
+    fail_unless(mod3_data.count == 1);
+
+    // a client outside of the networks passes all modules
+    smf_session_set_xforward_addr(session, "IPv6:2001:db9::1");
+    fail_unless(smf_modules_route_find(settings, session) == NULL);
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(mod1_data.count == 2);
+    fail_unless(mod2_data.count == 1);
+    fail_unless(mod3_data.count == 2);
+
+    // all recipients have to match
+    smf_session_set_xforward_addr(session, "IPv6:2001:db8::1");
+    fail_unless(smf_modules_route_find(settings, session) != NULL);
+    smf_envelope_add_rcpt(session->envelope, "<user@example.org>");
+    fail_unless(smf_modules_route_find(settings, session) == NULL);
+
+    // unknown modules are rejected
+    smf_dict_set(settings->groups, "route:relay:modules", "mod4");
+    fail_unless(smf_modules_routes_compile(settings) == -1);
+}
+END_TEST
+
+START_TEST(process_header_journal) {
+    struct stat before, after;
+    char buf[512];
+    FILE *fp;
+    int found = 0;
+
+    smf_list_append(settings->modules, smf_module_create_callback(settings, "journal", header_changed_cb));
+
+    fail_unless(stat(spoolfile, &before) == 0);
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(smf_message_get_header(session->envelope->message, "X-Journal") != NULL);
+    fail_unless(smf_message_journal_get(session->envelope->message) == NULL);
+
+    /* only the header block has been written, the spool file is untouched */
+    fail_unless(session->header_file != NULL);
+    fail_unless(session->body_offset > 0);
+    fail_unless(stat(spoolfile, &after) == 0);
+    fail_unless(before.st_ino == after.st_ino);
+    fail_unless(before.st_size == after.st_size);
+
+    fail_unless((fp = smf_internal_spool_fopen(session)) != NULL);
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        if (strncmp(buf, "X-Journal:", 10) == 0)
+            found = 1;
+    }
+    fclose(fp);
+    fail_unless(found == 1);
+
+    fail_unless(unlink(session->header_file) == 0);
+}
+END_TEST
+
+START_TEST(header_journal_owner) {
+    SMFMessage_T *msg = smf_message_new();
+    SMFHeader_T *detached = smf_header_new();
+    SMFHeaderModification_T *mod;
+
+    smf_message_journal_start(msg);
+
+    // headers, which don't belong to the journaled message, are not recorded
+    smf_header_set_name(detached, "X-Detached");
+    smf_header_set_value(detached, "1", 1);
+    fail_unless(smf_message_journal_get(msg) == NULL);
+
+    // recipients are recorded by their header
+    fail_unless(smf_message_add_recipient(msg, "cc@example.org", SMF_EMAIL_ADDRESS_TYPE_CC) == 0);
+    fail_unless(smf_list_size(smf_message_journal_get(msg)) == 1);
+    mod = (SMFHeaderModification_T *)smf_list_data(smf_list_head(smf_message_journal_get(msg)));
+    ck_assert_str_eq(mod->name, "Cc");
+
+    // headers of the journaled message are
+    smf_header_set_value(smf_message_get_header(msg, "Cc"), "cc2@example.org", 0);
+    fail_unless(smf_list_size(smf_message_journal_get(msg)) == 2);
+
+    smf_message_journal_stop();
+    smf_header_free(detached);
+    smf_message_free(msg);
 }
 END_TEST
 
@@ -335,6 +556,13 @@ TCase *modules_tcase() {
     tcase_add_test(tc, process_err_nexthop);
     tcase_add_test(tc, process_err_nexthop_err);
     tcase_add_test(tc, message_file_changed);
+    tcase_add_test(tc, message_file_changed_undeclared);
+    tcase_add_test(tc, message_file_not_marked);
+    tcase_add_test(tc, init_fini);
+    tcase_add_test(tc, process_parallel);
+    tcase_add_test(tc, process_route);
+    tcase_add_test(tc, process_header_journal);
+    tcase_add_test(tc, header_journal_owner);
     
     return tc;
 }
@@ -207,6 +207,17 @@ int main (int argc, char const *argv[]) {
     }
     printf("passed\n");
     
+    printf("* testing smf_settings_set_module_threads()...\t\t");
+    smf_settings_set_module_threads(settings, 4);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_module_threads()...\t\t");
+    if(smf_settings_get_module_threads(settings) != 4) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+    
     printf("* testing smf_settings_set_max_size()...\t\t");
     smf_settings_set_max_size(settings, 5000);
     printf("passed\n");
@@ -217,6 +228,17 @@ int main (int argc, char const *argv[]) {
         return -1;
     }
     printf("passed\n");
+
+    printf("* testing smf_settings_set_spool_memory_limit()...\t");
+    smf_settings_set_spool_memory_limit(settings, 32768);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_spool_memory_limit()...\t");
+    if(smf_settings_get_spool_memory_limit(settings) != 32768) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
     
     printf("* testing smf_settings_set_tls()...\t\t\t");
     smf_settings_set_tls(settings, SMF_TLS_REQUIRED);
@@ -339,6 +361,63 @@ int main (int argc, char const *argv[]) {
     }
     printf("passed\n");
 
+    printf("* testing smf_settings_set_max_spare_childs()...\t\t");
+    smf_settings_set_max_spare_childs(settings, 8);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_max_spare_childs()...\t\t");
+    if(smf_settings_get_max_spare_childs(settings) != 8) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_set_max_requests_per_child()...\t");
+    smf_settings_set_max_requests_per_child(settings, 100);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_max_requests_per_child()...\t");
+    if(smf_settings_get_max_requests_per_child(settings) != 100) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_set_accept_mode()...\t\t");
+    smf_settings_set_accept_mode(settings, SMF_ACCEPT_REUSEPORT);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_accept_mode()...\t\t");
+    if(smf_settings_get_accept_mode(settings) != SMF_ACCEPT_REUSEPORT) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_add_listener()...\t\t");
+    smf_settings_add_listener(settings, strdup("local"));
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_listeners()...\t\t");
+    list = smf_settings_get_listeners(settings);
+    if (smf_list_size(list)!=1) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_add_route()...\t\t\t");
+    smf_settings_add_route(settings, strdup("relay"));
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_routes()...\t\t\t");
+    list = smf_settings_get_routes(settings);
+    if (smf_list_size(list)!=1) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
     printf("* testing smf_settings_set_smtpd_timeout()...\t\t");
     smf_settings_set_smtpd_timeout(settings, 300);
     printf("passed\n");
@@ -350,6 +429,50 @@ int main (int argc, char const *argv[]) {
     }
     printf("passed\n");
 
+    printf("* testing smf_settings_set_smtpd_command_timeout()...\t");
+    smf_settings_set_smtpd_command_timeout(settings, 20);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_smtpd_command_timeout()...\t");
+    if(smf_settings_get_smtpd_command_timeout(settings) != 20) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_set_smtpd_data_timeout()...\t");
+    smf_settings_set_smtpd_data_timeout(settings, 900);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_smtpd_data_timeout()...\t");
+    if(smf_settings_get_smtpd_data_timeout(settings) != 900) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_set_event_processes()...\t\t");
+    smf_settings_set_event_processes(settings, 4);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_event_processes()...\t\t");
+    if(smf_settings_get_event_processes(settings) != 4) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* testing smf_settings_set_event_threads()...\t\t");
+    smf_settings_set_event_threads(settings, 8);
+    printf("passed\n");
+
+    printf("* testing smf_settings_get_event_threads()...\t\t");
+    if(smf_settings_get_event_threads(settings) != 8) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
     printf("* testing smf_settings_set_sql_driver()...\t\t");
     smf_settings_set_sql_driver(settings, test_sql_driver);
     printf("passed\n");
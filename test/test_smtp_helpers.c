@@ -0,0 +1,79 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2019 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/smf_internal.h"
+#include "../src/smf_settings.h"
+#include "test_smtp_helpers.h"
+
+int smtpd_reply(int sd) {
+    char buf[MAXLINE];
+    size_t len;
+
+    do {
+        len = 0;
+        while ((len < sizeof(buf) - 1) && (read(sd,buf + len,1) == 1) && (buf[len++] != '\n'));
+        buf[len] = '\0';
+        if (len < 4)
+            return -1;
+    } while (buf[3] == '-');
+
+    return atoi(buf);
+}
+
+int smtpd_exchange(int sd, const char *cmds, const int *codes) {
+    if (smf_internal_writen(sd,(char *)cmds,strlen(cmds)) != (ssize_t)strlen(cmds))
+        return -1;
+
+    for (; *codes != 0; codes++) {
+        if (smtpd_reply(sd) != *codes)
+            return -1;
+    }
+
+    return 0;
+}
+
+int smtpd_connect(SMFSettings_T *settings) {
+    struct sockaddr_in sa;
+    struct timeval tv = { 5, 0 };
+    int sd;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(smf_settings_get_bind_port(settings));
+    inet_pton(AF_INET,smf_settings_get_bind_ip(settings),&sa.sin_addr);
+
+    if ((sd = socket(AF_INET,SOCK_STREAM,0)) == -1)
+        return -1;
+
+    if ((setsockopt(sd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv)) != 0) ||
+            (connect(sd,(struct sockaddr *)&sa,sizeof(sa)) != 0) ||
+            (smtpd_exchange(sd,"EHLO localhost\r\n",(const int[]){220,250,0}) != 0)) {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
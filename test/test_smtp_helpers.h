@@ -0,0 +1,33 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2019 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_SMTP_HELPERS_H
+#define _TEST_SMTP_HELPERS_H
+
+#include "../src/smf_settings.h"
+
+/* reads a reply from the smtpd engine and returns its code */
+int smtpd_reply(int sd);
+
+/* sends cmds at once and checks the replies against codes, terminated by 0 */
+int smtpd_exchange(int sd, const char *cmds, const int *codes);
+
+/* connects to the smtpd engine and greets it. A session, which isn't
+ * served, fails after a few seconds instead of blocking the test */
+int smtpd_connect(SMFSettings_T *settings);
+
+#endif  /* _TEST_SMTP_HELPERS_H */
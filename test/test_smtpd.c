@@ -35,6 +35,7 @@
 
 #include "test.h"
 #include "test_params.h"
+#include "test_smtp_helpers.h"
 #include "../src/smf_internal.h"
 #include "../src/smf_server.h"
 #include "../src/smf_settings.h"
@@ -49,6 +50,7 @@ int main (int argc, char const *argv[]) {
     SMFEnvelope_T *env = smf_envelope_new();
     pid_t pid;
     char *delivery_destination = NULL;
+    int sd;
 
     printf("Start smf_smtpd tests...\n");
 
@@ -91,6 +93,44 @@ int main (int argc, char const *argv[]) {
             smf_smtp_status_free(status);
             printf("passed\n");
 
+            printf("* sending pipelined commands ...\t\t");
+            /* the rejected recipient must not stop the transaction */
+            if (((sd = smtpd_connect(settings)) == -1) || 
+                    (smtpd_exchange(sd,"MAIL FROM:<sender@example.org>\r\nRCPT TO:<rcpt@example.org>\r\n"
+                        "RCPT TO:\r\nDATA\r\n",(const int[]){250,250,501,354,0}) != 0) ||
+                    (smtpd_exchange(sd,"Subject: pipelining\r\n\r\ntest\r\n.\r\nQUIT\r\n",
+                        (const int[]){250,221,0}) != 0)) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            close(sd);
+            printf("passed\n");
+
+            printf("* sending BDAT chunks ...\t\t\t");
+            if (((sd = smtpd_connect(settings)) == -1) || 
+                    (smtpd_exchange(sd,"MAIL FROM:<sender@example.org>\r\nRCPT TO:<rcpt@example.org>\r\n"
+                        "BDAT 21\r\nSubject: chunking\r\n\r\nBDAT 6 LAST\r\ntest\r\nQUIT\r\n",
+                        (const int[]){250,250,250,250,221,0}) != 0)) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            close(sd);
+            printf("passed\n");
+
+            printf("* sending BDAT without recipient ...\t\t");
+            /* the chunk is skipped, QUIT is read as a command again */
+            if (((sd = smtpd_connect(settings)) == -1) || 
+                    (smtpd_exchange(sd,"MAIL FROM:<sender@example.org>\r\nRCPT TO:\r\n"
+                        "BDAT 6 LAST\r\nQUIT\r\nQUIT\r\n",(const int[]){250,501,554,221,0}) != 0)) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            close(sd);
+            printf("passed\n");
+
             kill(pid,SIGTERM);
             waitpid(pid, NULL, 0);
 
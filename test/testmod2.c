@@ -3,11 +3,27 @@
 #include "../src/smf_settings.h"
 #include "../src/smf_session.h"
 #include "../src/smf_trace.h"
+#include "../src/smf_modules.h"
 
 #define THIS_MODULE "testmod2"
 
+unsigned int module_flags = SMF_MODULE_READONLY;
+
 int load(SMFSettings_T *settings, SMFSession_T *session) {       
     STRACE(TRACE_DEBUG,session->id,"Hello testmod2\n");
 
     return 0;
-}
\ No newline at end of file
+}
+int init(SMFSettings_T *settings) {
+    TRACE(TRACE_DEBUG,"init testmod2");
+    return 0;
+}
+
+int child_init(SMFSettings_T *settings) {
+    TRACE(TRACE_DEBUG,"child_init testmod2");
+    return 0;
+}
+
+void fini(SMFSettings_T *settings) {
+    TRACE(TRACE_DEBUG,"fini testmod2");
+}